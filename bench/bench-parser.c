@@ -0,0 +1,304 @@
+/**
+ * This file is part of the KNOT Project
+ *
+ * Copyright (c) 2019, CESAR. All rights reserved.
+ *
+ *  This library is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU Lesser General Public
+ *  License as published by the Free Software Foundation; either
+ *  version 2.1 of the License, or (at your option) any later version.
+ *
+ *  This library is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Lesser General Public License for more details.
+ */
+
+/**
+ *  Parser and serializer benchmarks
+ *
+ *  Serialization benchmarks include json_object_to_json_string(), as the
+ *  publish path always does.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+#include <ell/ell.h>
+#include <json-c/json.h>
+#include <amqp.h>
+
+#include <knot/knot_protocol.h>
+
+#include "knot_cloud.h"
+#include "arena.h"
+#include "parser.h"
+#include "knot_cloud_internal.h"
+#include "bench.h"
+
+#define BENCH_DEVICE_ID "fbe64efa6c7f717e"
+#define BENCH_SCHEMA_LEN 8
+
+#define BENCH_SCHEMA_JSON \
+	"[{\"sensorId\": 1, \"valueType\": 1, \"unit\": 0, " \
+	"\"typeId\": 65521, \"name\": \"Door lock\"}, " \
+	"{\"sensorId\": 2, \"valueType\": 2, \"unit\": 1, " \
+	"\"typeId\": 2, \"name\": \"Temperature\"}, " \
+	"{\"sensorId\": 3, \"valueType\": 3, \"unit\": 0, " \
+	"\"typeId\": 65521, \"name\": \"Switch\"}, " \
+	"{\"sensorId\": 4, \"valueType\": 4, \"unit\": 0, " \
+	"\"typeId\": 65521, \"name\": \"Raw frame\"}, " \
+	"{\"sensorId\": 5, \"valueType\": 5, \"unit\": 0, " \
+	"\"typeId\": 65521, \"name\": \"Counter\"}, " \
+	"{\"sensorId\": 6, \"valueType\": 6, \"unit\": 0, " \
+	"\"typeId\": 65521, \"name\": \"Level\"}, " \
+	"{\"sensorId\": 7, \"valueType\": 7, \"unit\": 0, " \
+	"\"typeId\": 65521, \"name\": \"Energy\"}, " \
+	"{\"sensorId\": 8, \"valueType\": 2, \"unit\": 1, " \
+	"\"typeId\": 3, \"name\": \"Humidity\"}]"
+
+#define BENCH_UPDATE_JSON \
+	"{\"id\": \"" BENCH_DEVICE_ID "\", \"data\": [" \
+	"{\"sensorId\": 1, \"value\": 42}, " \
+	"{\"sensorId\": 2, \"value\": 21.5}, " \
+	"{\"sensorId\": 3, \"value\": true}, " \
+	"{\"sensorId\": 4, \"value\": \"AAECAwQFBgcICQoLDA0ODw==\"}]}"
+
+#define BENCH_REQUEST_JSON \
+	"{\"id\": \"" BENCH_DEVICE_ID "\", \"sensorIds\": [1, 2, 3, 4]}"
+
+#define BENCH_REGISTER_JSON \
+	"{\"id\": \"" BENCH_DEVICE_ID "\", " \
+	"\"token\": \"0f4b0e6c1bd6e7f5a3b6e8f2d5c4a3b2c1d0e9f8\", " \
+	"\"error\": null}"
+
+#define BENCH_REPLY_JSON \
+	"{\"id\": \"" BENCH_DEVICE_ID "\", \"error\": null}"
+
+struct data_bench {
+	const char *name;
+	uint8_t value_type;
+	knot_value_type value;
+	uint8_t len;
+};
+
+struct msg_bench {
+	const char *name;
+	const char *routing_key;
+	const char *json;
+	json_object *jso;
+};
+
+struct parse_bench {
+	json_object *jso;
+	struct arena *arena;
+};
+
+static struct data_bench data_benches[] = {
+	{ "data_create/int", KNOT_VALUE_TYPE_INT,
+		{ .val_i = -1234567 }, sizeof(int32_t) },
+	{ "data_create/float", KNOT_VALUE_TYPE_FLOAT,
+		{ .val_f = 21.5 }, sizeof(float) },
+	{ "data_create/bool", KNOT_VALUE_TYPE_BOOL,
+		{ .val_b = true }, sizeof(bool) },
+	{ "data_create/raw", KNOT_VALUE_TYPE_RAW,
+		{ .raw = { 0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14,
+			   15 } }, KNOT_DATA_RAW_SIZE },
+	{ "data_create/int64", KNOT_VALUE_TYPE_INT64,
+		{ .val_i64 = -1234567890123LL }, sizeof(int64_t) },
+	{ "data_create/uint", KNOT_VALUE_TYPE_UINT,
+		{ .val_u = 4000000000U }, sizeof(uint32_t) },
+	{ "data_create/uint64", KNOT_VALUE_TYPE_UINT64,
+		{ .val_u64 = 18000000000000000000ULL }, sizeof(uint64_t) },
+};
+
+static void bench_data_create(uint64_t iterations, void *user_data)
+{
+	struct data_bench *data = user_data;
+	json_object *jso;
+	uint64_t i;
+
+	for (i = 0; i < iterations; i++) {
+		jso = parser_data_create_object(BENCH_DEVICE_ID, 1,
+						data->value_type,
+						&data->value, data->len);
+		json_object_to_json_string(jso);
+		json_object_put(jso);
+	}
+}
+
+static void bench_schema_create(uint64_t iterations, void *user_data)
+{
+	struct l_queue *schema_list = user_data;
+	json_object *jso;
+	uint64_t i;
+
+	for (i = 0; i < iterations; i++) {
+		jso = parser_schema_create_object(BENCH_DEVICE_ID,
+						  schema_list);
+		json_object_to_json_string(jso);
+		json_object_put(jso);
+	}
+}
+
+static void bench_schema_to_list(uint64_t iterations, void *user_data)
+{
+	struct l_queue *list;
+	uint64_t i;
+
+	for (i = 0; i < iterations; i++) {
+		list = parser_schema_to_list(BENCH_SCHEMA_JSON);
+		l_queue_destroy(list, l_free);
+	}
+}
+
+static void bench_update_to_list(uint64_t iterations, void *user_data)
+{
+	struct parse_bench *parse = user_data;
+	struct l_queue *list;
+	uint64_t i;
+
+	for (i = 0; i < iterations; i++) {
+		list = parser_update_to_list(parse->jso, parse->arena);
+		l_queue_destroy(list, NULL);
+		arena_reset(parse->arena);
+	}
+}
+
+static void bench_request_to_list(uint64_t iterations, void *user_data)
+{
+	struct parse_bench *parse = user_data;
+	struct l_queue *list;
+	uint64_t i;
+
+	for (i = 0; i < iterations; i++) {
+		list = parser_request_to_list(parse->jso, parse->arena);
+		l_queue_destroy(list, NULL);
+		arena_reset(parse->arena);
+	}
+}
+
+static struct knot_cloud *bench_cloud;
+static struct arena *bench_arena;
+
+static void bench_create_msg(uint64_t iterations, void *user_data)
+{
+	struct msg_bench *msg_bench = user_data;
+	struct knot_cloud_msg *msg;
+	uint64_t i;
+
+	for (i = 0; i < iterations; i++) {
+		msg = cloud_internal_create_msg(bench_cloud,
+						msg_bench->routing_key,
+						msg_bench->jso,
+						bench_arena);
+		cloud_internal_destroy_msg(msg);
+		arena_reset(bench_arena);
+	}
+}
+
+static struct l_queue *schema_list_new(void)
+{
+	struct l_queue *list = l_queue_new();
+	knot_msg_schema *schema;
+	int i;
+
+	for (i = 0; i < BENCH_SCHEMA_LEN; i++) {
+		schema = l_new(knot_msg_schema, 1);
+		schema->sensor_id = i + 1;
+		schema->values.value_type = KNOT_VALUE_TYPE_INT;
+		schema->values.unit = 0;
+		schema->values.type_id = 0xfff1;
+		snprintf(schema->values.name, sizeof(schema->values.name),
+			 "Sensor %d", i + 1);
+		l_queue_push_tail(list, schema);
+	}
+
+	return list;
+}
+
+static void run_create_msg_benches(void)
+{
+	char update_key[100], request_key[100], reply_key[100];
+	struct msg_bench benches[] = {
+		{ "create_msg/update", update_key, BENCH_UPDATE_JSON },
+		{ "create_msg/request", request_key, BENCH_REQUEST_JSON },
+		{ "create_msg/register", MQ_EVENT_DEVICE_REGISTERED,
+			BENCH_REGISTER_JSON },
+		{ "create_msg/unregister", MQ_EVENT_DEVICE_UNREGISTERED,
+			BENCH_REPLY_JSON },
+		{ "create_msg/auth", reply_key, BENCH_REPLY_JSON },
+		{ "create_msg/schema", MQ_EVENT_DEVICE_SCHEMA_UPDATED,
+			BENCH_REPLY_JSON },
+	};
+	size_t i;
+
+	bench_cloud = knot_cloud_session_new();
+	bench_arena = arena_new(0);
+
+	cloud_internal_set_routes(bench_cloud, BENCH_DEVICE_ID,
+				  BENCH_DEVICE_ID);
+	snprintf(update_key, sizeof(update_key), "%s.%s.%s",
+		 MQ_EVENT_PREFIX_DEVICE, BENCH_DEVICE_ID,
+		 MQ_EVENT_POSTFIX_DATA_UPDATE);
+	snprintf(request_key, sizeof(request_key), "%s.%s.%s",
+		 MQ_EVENT_PREFIX_DEVICE, BENCH_DEVICE_ID,
+		 MQ_EVENT_POSTFIX_DATA_REQUEST);
+	snprintf(reply_key, sizeof(reply_key), "%s-%s", MQ_QUEUE_REPLY,
+		 BENCH_DEVICE_ID);
+
+	for (i = 0; i < L_ARRAY_SIZE(benches); i++) {
+		benches[i].jso = json_tokener_parse(benches[i].json);
+		bench_run(benches[i].name, bench_create_msg, &benches[i]);
+		json_object_put(benches[i].jso);
+	}
+
+	arena_free(bench_arena);
+	knot_cloud_session_free(bench_cloud);
+}
+
+int main(int argc, char *argv[])
+{
+	struct parse_bench parse;
+	struct l_queue *schema_list;
+	size_t i;
+
+	if (bench_init(argc, argv))
+		return EXIT_FAILURE;
+
+	for (i = 0; i < L_ARRAY_SIZE(data_benches); i++)
+		bench_run(data_benches[i].name, bench_data_create,
+			  &data_benches[i]);
+
+	schema_list = schema_list_new();
+	bench_run("schema_create", bench_schema_create, schema_list);
+	l_queue_destroy(schema_list, l_free);
+
+	bench_run("schema_to_list", bench_schema_to_list, NULL);
+
+	parse.arena = arena_new(0);
+
+	parse.jso = json_tokener_parse(BENCH_UPDATE_JSON);
+	bench_run("update_to_list", bench_update_to_list, &parse);
+	json_object_put(parse.jso);
+
+	parse.jso = json_tokener_parse(BENCH_REQUEST_JSON);
+	bench_run("request_to_list", bench_request_to_list, &parse);
+	json_object_put(parse.jso);
+
+	arena_free(parse.arena);
+
+	run_create_msg_benches();
+
+	return bench_exit() ? EXIT_FAILURE : EXIT_SUCCESS;
+}
@@ -0,0 +1,372 @@
+/**
+ * This file is part of the KNOT Project
+ *
+ * Copyright (c) 2019, CESAR. All rights reserved.
+ *
+ *  This library is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU Lesser General Public
+ *  License as published by the Free Software Foundation; either
+ *  version 2.1 of the License, or (at your option) any later version.
+ *
+ *  This library is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Lesser General Public License for more details.
+ */
+
+/**
+ *  End to end throughput benchmarks
+ *
+ *  The SDK talks to the loopback broker over a local socket. Publish
+ *  benchmarks report the latency of each call and the throughput until the
+ *  broker got every message. Round trip benchmarks inject a command and
+ *  report the latency until the broker got the data published by the read
+ *  handler in response, one command at a time.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <time.h>
+#include <ell/ell.h>
+
+#include <knot/knot_protocol.h>
+
+#include "knot_cloud.h"
+#include "bench.h"
+#include "loopback.h"
+
+#define BENCH_DEVICE_ID "fbe64efa6c7f717e"
+#define BENCH_USER_TOKEN "bench"
+#define BENCH_CONNECT_TIMEOUT 5
+
+#define BENCH_EXCHANGE_DEVICE "device"
+#define BENCH_EXCHANGE_DATA_SENT "data.sent"
+#define BENCH_UPDATE_KEY "device." BENCH_DEVICE_ID ".data.update"
+#define BENCH_REQUEST_KEY "device." BENCH_DEVICE_ID ".data.request"
+
+#define BENCH_UPDATE_JSON \
+	"{\"id\": \"" BENCH_DEVICE_ID "\", \"data\": [" \
+	"{\"sensorId\": 1, \"value\": 42}]}"
+
+#define BENCH_REQUEST_JSON \
+	"{\"id\": \"" BENCH_DEVICE_ID "\", \"sensorIds\": [1]}"
+
+struct throughput {
+	struct loopback *loopback;
+	struct knot_cloud *cloud;
+	struct l_io *io;
+	int wake_fds[2];
+	bool ready;
+	bool failed;
+	bool done;
+	/* Written by the broker thread */
+	uint64_t received;
+	uint64_t target;
+	uint64_t done_ns;
+};
+
+struct publish_bench {
+	const char *name;
+	uint8_t value_type;
+	knot_value_type value;
+	uint8_t len;
+};
+
+struct roundtrip_bench {
+	const char *name;
+	const char *routing_key;
+	const char *json;
+};
+
+static struct throughput bench;
+
+static uint64_t clock_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/* Called on the broker thread */
+static void on_broker_publish(const struct loopback_msg *msg,
+			      void *user_data)
+{
+	struct throughput *t = user_data;
+	uint64_t received;
+	uint8_t byte = 0;
+
+	/* Only the allocations of the SDK are of interest */
+	bench_exclude_thread();
+
+	if (strcmp(msg->exchange, BENCH_EXCHANGE_DATA_SENT))
+		return;
+
+	received = __atomic_add_fetch(&t->received, 1, __ATOMIC_RELAXED);
+	if (received != __atomic_load_n(&t->target, __ATOMIC_RELAXED))
+		return;
+
+	__atomic_store_n(&t->done_ns, clock_ns(), __ATOMIC_RELAXED);
+	if (write(t->wake_fds[1], &byte, sizeof(byte)) < 0)
+		fprintf(stderr, "write(): %s\n", strerror(errno));
+}
+
+static bool on_wake(struct l_io *io, void *user_data)
+{
+	struct throughput *t = user_data;
+	uint8_t buf[64];
+
+	while (read(t->wake_fds[0], buf, sizeof(buf)) > 0)
+		;
+
+	t->done = true;
+
+	return true;
+}
+
+/* Waits until the broker got @count more messages */
+static void expect_messages(struct throughput *t, uint64_t count)
+{
+	__atomic_store_n(&t->target,
+			 __atomic_load_n(&t->received, __ATOMIC_RELAXED) +
+			 count, __ATOMIC_RELAXED);
+	t->done = false;
+}
+
+static void wait_messages(struct throughput *t)
+{
+	while (!t->done && !t->failed)
+		l_main_iterate(-1);
+
+	if (t->failed) {
+		fprintf(stderr, "Connection to the broker lost\n");
+		exit(EXIT_FAILURE);
+	}
+}
+
+static void publish_int(struct throughput *t, const char *id,
+			uint8_t sensor_id, const knot_value_type *value)
+{
+	knot_cloud_session_publish_data(t->cloud, id, sensor_id,
+					KNOT_VALUE_TYPE_INT, value,
+					sizeof(int32_t));
+}
+
+/* Answers updates with the values set and requests with a fixed value */
+static bool on_cloud_msg(const struct knot_cloud_msg *msg, void *user_data)
+{
+	struct throughput *t = user_data;
+	const struct l_queue_entry *entry;
+	const knot_msg_data *data;
+	knot_value_type value = { .val_i = 42 };
+	const int *sensor_id;
+
+	entry = l_queue_get_entries(msg->list);
+
+	switch (msg->type) {
+	case UPDATE_MSG:
+		for (; entry; entry = entry->next) {
+			data = entry->data;
+			publish_int(t, msg->device_id, data->sensor_id,
+				    &data->payload);
+		}
+		break;
+	case REQUEST_MSG:
+		for (; entry; entry = entry->next) {
+			sensor_id = entry->data;
+			publish_int(t, msg->device_id, *sensor_id, &value);
+		}
+		break;
+	case REGISTER_MSG:
+	case UNREGISTER_MSG:
+	case AUTH_MSG:
+	case SCHEMA_MSG:
+	case MSG_TYPES_LENGTH:
+	default:
+		break;
+	}
+
+	return true;
+}
+
+static void on_connected(void *user_data)
+{
+	struct throughput *t = user_data;
+
+	if (knot_cloud_session_read_start(t->cloud, BENCH_DEVICE_ID,
+					  on_cloud_msg, t)) {
+		t->failed = true;
+		return;
+	}
+
+	t->ready = true;
+}
+
+static void on_disconnected(void *user_data)
+{
+	struct throughput *t = user_data;
+
+	t->failed = true;
+}
+
+static void on_connect_timeout(struct l_timeout *timeout, void *user_data)
+{
+	struct throughput *t = user_data;
+
+	t->failed = true;
+}
+
+static int throughput_start(struct throughput *t)
+{
+	struct l_timeout *timeout;
+
+	if (pipe2(t->wake_fds, O_NONBLOCK | O_CLOEXEC) < 0) {
+		fprintf(stderr, "pipe2(): %s\n", strerror(errno));
+		return -1;
+	}
+
+	t->io = l_io_new(t->wake_fds[0]);
+	l_io_set_read_handler(t->io, on_wake, t, NULL);
+
+	t->loopback = loopback_new(on_broker_publish, t);
+	if (!t->loopback)
+		return -1;
+
+	t->cloud = knot_cloud_session_new();
+	if (knot_cloud_session_start(t->cloud,
+				     loopback_get_url(t->loopback),
+				     BENCH_USER_TOKEN, on_connected,
+				     on_disconnected, t))
+		return -1;
+
+	timeout = l_timeout_create(BENCH_CONNECT_TIMEOUT, on_connect_timeout,
+				   t, NULL);
+
+	while (!t->ready && !t->failed)
+		l_main_iterate(-1);
+
+	l_timeout_remove(timeout);
+
+	if (t->failed) {
+		fprintf(stderr, "Error connecting to the loopback broker\n");
+		return -1;
+	}
+
+	return 0;
+}
+
+static void throughput_stop(struct throughput *t)
+{
+	knot_cloud_session_free(t->cloud);
+	loopback_free(t->loopback);
+
+	if (t->io) {
+		l_io_destroy(t->io);
+		close(t->wake_fds[0]);
+		close(t->wake_fds[1]);
+	}
+}
+
+static void bench_publish(uint64_t iterations, uint64_t *latency_ns,
+			  void *user_data)
+{
+	struct publish_bench *pub = user_data;
+	uint64_t i, start;
+
+	expect_messages(&bench, iterations);
+
+	for (i = 0; i < iterations; i++) {
+		start = clock_ns();
+		knot_cloud_session_publish_data(bench.cloud, BENCH_DEVICE_ID,
+						1, pub->value_type,
+						&pub->value, pub->len);
+		latency_ns[i] = clock_ns() - start;
+	}
+
+	wait_messages(&bench);
+}
+
+static void bench_roundtrip(uint64_t iterations, uint64_t *latency_ns,
+			    void *user_data)
+{
+	struct roundtrip_bench *rt = user_data;
+	struct loopback_msg msg = {
+		.exchange = BENCH_EXCHANGE_DEVICE,
+		.routing_key = rt->routing_key,
+		.body = rt->json,
+		.len = strlen(rt->json),
+	};
+	uint64_t i, start;
+
+	for (i = 0; i < iterations; i++) {
+		expect_messages(&bench, 1);
+
+		start = clock_ns();
+		loopback_inject(bench.loopback, &msg);
+		wait_messages(&bench);
+
+		latency_ns[i] = __atomic_load_n(&bench.done_ns,
+						__ATOMIC_RELAXED) - start;
+	}
+}
+
+static struct publish_bench publish_benches[] = {
+	{ "publish/int", KNOT_VALUE_TYPE_INT,
+		{ .val_i = -1234567 }, sizeof(int32_t) },
+	{ "publish/float", KNOT_VALUE_TYPE_FLOAT,
+		{ .val_f = 21.5 }, sizeof(float) },
+	{ "publish/raw", KNOT_VALUE_TYPE_RAW,
+		{ .raw = { 0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14,
+			   15 } }, KNOT_DATA_RAW_SIZE },
+};
+
+static struct roundtrip_bench roundtrip_benches[] = {
+	{ "roundtrip/update", BENCH_UPDATE_KEY, BENCH_UPDATE_JSON },
+	{ "roundtrip/request", BENCH_REQUEST_KEY, BENCH_REQUEST_JSON },
+};
+
+int main(int argc, char *argv[])
+{
+	int err = EXIT_FAILURE;
+	size_t i;
+
+	if (bench_init(argc, argv))
+		return EXIT_FAILURE;
+
+	if (!l_main_init())
+		return EXIT_FAILURE;
+
+	if (throughput_start(&bench))
+		goto done;
+
+	for (i = 0; i < L_ARRAY_SIZE(publish_benches); i++)
+		bench_run_latency(publish_benches[i].name, bench_publish,
+				  &publish_benches[i]);
+
+	for (i = 0; i < L_ARRAY_SIZE(roundtrip_benches); i++)
+		bench_run_latency(roundtrip_benches[i].name, bench_roundtrip,
+				  &roundtrip_benches[i]);
+
+	err = bench_exit() ? EXIT_FAILURE : EXIT_SUCCESS;
+
+done:
+	throughput_stop(&bench);
+	l_main_exit();
+
+	return err;
+}
@@ -0,0 +1,579 @@
+/**
+ * This file is part of the KNOT Project
+ *
+ * Copyright (c) 2019, CESAR. All rights reserved.
+ *
+ *  This library is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU Lesser General Public
+ *  License as published by the Free Software Foundation; either
+ *  version 2.1 of the License, or (at your option) any later version.
+ *
+ *  This library is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Lesser General Public License for more details.
+ */
+
+/**
+ *  Benchmark harness source file
+ *
+ *  Allocations are counted by wrapping the glibc allocator, so allocations
+ *  made by ell, json-c and librabbitmq are counted as well. Built with
+ *  --enable-alloc-stats, the library wraps it already and its counters are
+ *  used instead.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
+#include <stdio.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <string.h>
+#include <errno.h>
+#include <getopt.h>
+#include <time.h>
+
+#include "alloc.h"
+#include "bench.h"
+
+#define BENCH_ITERATIONS_DEFAULT 100000
+#define BENCH_REPEAT_DEFAULT 5
+#define BENCH_REPEAT_MAX 64
+#define BENCH_RESULTS_MAX 64
+#define BENCH_NAME_MAX 64
+/* Allocations don't depend on the machine, only a small slack is given */
+#define BENCH_ALLOCS_TOLERANCE 5
+#define BENCH_ALLOCS_SLACK 0.05
+#define BENCH_BYTES_TOLERANCE 10
+#define BENCH_BYTES_SLACK 1.0
+
+struct bench_result {
+	char name[BENCH_NAME_MAX];
+	double cpu_ns;
+	double allocs;
+	double bytes;
+};
+
+static uint64_t iterations = BENCH_ITERATIONS_DEFAULT;
+static unsigned int repeat = BENCH_REPEAT_DEFAULT;
+static const char *filter;
+static const char *baseline_path;
+static bool baseline_update;
+/* CPU time tolerance in percent, only checked when set with -t */
+static double tolerance = -1;
+static struct bench_result baseline[BENCH_RESULTS_MAX];
+static unsigned int num_baseline;
+static struct bench_result results[BENCH_RESULTS_MAX];
+static unsigned int num_results;
+/* Columns of the last header printed */
+static enum {
+	BENCH_COLUMNS_NONE,
+	BENCH_COLUMNS_TIME,
+	BENCH_COLUMNS_LATENCY,
+} columns;
+
+#ifndef HAVE_ALLOC_STATS
+void *__libc_malloc(size_t size);
+void *__libc_calloc(size_t nmemb, size_t size);
+void *__libc_realloc(void *ptr, size_t size);
+void __libc_free(void *ptr);
+
+static uint64_t alloc_count;
+static uint64_t alloc_bytes;
+static __thread bool alloc_excluded;
+
+void *malloc(size_t size)
+{
+	if (!alloc_excluded) {
+		__atomic_fetch_add(&alloc_count, 1, __ATOMIC_RELAXED);
+		__atomic_fetch_add(&alloc_bytes, size, __ATOMIC_RELAXED);
+	}
+
+	return __libc_malloc(size);
+}
+
+void *calloc(size_t nmemb, size_t size)
+{
+	if (!alloc_excluded) {
+		__atomic_fetch_add(&alloc_count, 1, __ATOMIC_RELAXED);
+		__atomic_fetch_add(&alloc_bytes, nmemb * size,
+				   __ATOMIC_RELAXED);
+	}
+
+	return __libc_calloc(nmemb, size);
+}
+
+void *realloc(void *ptr, size_t size)
+{
+	if (!alloc_excluded) {
+		__atomic_fetch_add(&alloc_count, 1, __ATOMIC_RELAXED);
+		__atomic_fetch_add(&alloc_bytes, size, __ATOMIC_RELAXED);
+	}
+
+	return __libc_realloc(ptr, size);
+}
+
+void free(void *ptr)
+{
+	__libc_free(ptr);
+}
+#endif
+
+/**
+ * bench_exclude_thread:
+ *
+ * Stops counting the allocations made by the calling thread, e.g. by a
+ * broker standing in for the real one.
+ */
+void bench_exclude_thread(void)
+{
+#ifdef HAVE_ALLOC_STATS
+	alloc_exclude_thread();
+#else
+	alloc_excluded = true;
+#endif
+}
+
+/**
+ * bench_get_allocs:
+ * @count: filled with the allocations made so far
+ * @bytes: filled with the bytes requested so far
+ */
+void bench_get_allocs(uint64_t *count, uint64_t *bytes)
+{
+#ifdef HAVE_ALLOC_STATS
+	alloc_get_totals(count, bytes);
+#else
+	*count = __atomic_load_n(&alloc_count, __ATOMIC_RELAXED);
+	*bytes = __atomic_load_n(&alloc_bytes, __ATOMIC_RELAXED);
+#endif
+}
+
+static uint64_t clock_ns(clockid_t clock)
+{
+	struct timespec ts;
+
+	clock_gettime(clock, &ts);
+
+	return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static int compare_u64(const void *a, const void *b)
+{
+	uint64_t va = *(const uint64_t *) a;
+	uint64_t vb = *(const uint64_t *) b;
+
+	return va < vb ? -1 : va > vb;
+}
+
+static void usage(const char *prog)
+{
+	printf("Usage: %s [-n iterations] [-r repeat] [-f filter]\n"
+	       "\t[-b baseline | -u baseline] [-t tolerance]\n", prog);
+}
+
+static struct bench_result *result_find(struct bench_result *list,
+					unsigned int num, const char *name)
+{
+	unsigned int i;
+
+	for (i = 0; i < num; i++) {
+		if (!strcmp(list[i].name, name))
+			return &list[i];
+	}
+
+	return NULL;
+}
+
+static void result_add(const char *name, double cpu_ns, double allocs,
+		       double bytes)
+{
+	struct bench_result *result;
+
+	if (!baseline_path)
+		return;
+
+	if (num_results == BENCH_RESULTS_MAX) {
+		fprintf(stderr, "%s: too many benchmarks\n", name);
+		return;
+	}
+
+	result = &results[num_results++];
+	snprintf(result->name, sizeof(result->name), "%s", name);
+	result->cpu_ns = cpu_ns;
+	result->allocs = allocs;
+	result->bytes = bytes;
+}
+
+/* A missing file is an empty baseline when updating it */
+static int baseline_load(const char *path)
+{
+	struct bench_result *result;
+	char line[256];
+	unsigned int lineno = 0;
+	FILE *fp;
+
+	fp = fopen(path, "r");
+	if (!fp) {
+		if (errno == ENOENT && baseline_update)
+			return 0;
+
+		fprintf(stderr, "%s: %s\n", path, strerror(errno));
+		return -1;
+	}
+
+	while (fgets(line, sizeof(line), fp)) {
+		lineno++;
+
+		if (line[0] == '#' || line[0] == '\n')
+			continue;
+
+		if (num_baseline == BENCH_RESULTS_MAX) {
+			fprintf(stderr, "%s:%u: too many entries\n", path,
+				lineno);
+			goto fail;
+		}
+
+		result = &baseline[num_baseline];
+		if (sscanf(line, "%63s %lf %lf %lf", result->name,
+			   &result->cpu_ns, &result->allocs,
+			   &result->bytes) != 4) {
+			fprintf(stderr, "%s:%u: invalid entry\n", path, lineno);
+			goto fail;
+		}
+
+		num_baseline++;
+	}
+
+	fclose(fp);
+
+	return 0;
+
+fail:
+	fclose(fp);
+
+	return -1;
+}
+
+/* Keeps the entries of the benchmarks not run, e.g. by another program */
+static int baseline_write(const char *path)
+{
+	struct bench_result *entry;
+	unsigned int i;
+	FILE *fp;
+
+	for (i = 0; i < num_results; i++) {
+		entry = result_find(baseline, num_baseline, results[i].name);
+		if (!entry) {
+			if (num_baseline == BENCH_RESULTS_MAX)
+				continue;
+
+			entry = &baseline[num_baseline++];
+		}
+
+		*entry = results[i];
+	}
+
+	fp = fopen(path, "w");
+	if (!fp) {
+		fprintf(stderr, "%s: %s\n", path, strerror(errno));
+		return -1;
+	}
+
+	fprintf(fp, "# Benchmark baseline checked by \"make bench-check\"\n"
+		"# Regenerate with \"make bench-baseline\", see README.md\n"
+		"# benchmark cpu-ns/op allocs/op B/op\n");
+
+	for (i = 0; i < num_baseline; i++)
+		fprintf(fp, "%s %.1f %.2f %.1f\n", baseline[i].name,
+			baseline[i].cpu_ns, baseline[i].allocs,
+			baseline[i].bytes);
+
+	if (fclose(fp)) {
+		fprintf(stderr, "%s: %s\n", path, strerror(errno));
+		return -1;
+	}
+
+	printf("# %u results written to %s\n", num_results, path);
+
+	return 0;
+}
+
+/* Prints a row of the comparison and returns true on a regression */
+static bool compare_metric(const char *name, const char *metric,
+			   double base, double current, double percent,
+			   double slack)
+{
+	bool regressed = current > base * (1 + percent / 100) + slack;
+	char delta[16] = "-";
+
+	if (base > 0)
+		snprintf(delta, sizeof(delta), "%+.1f%%",
+			 (current - base) * 100 / base);
+
+	printf("%-36s %-10s %12.2f %12.2f %8s %s\n", name, metric, base,
+	       current, delta, regressed ? "FAIL" : "ok");
+
+	return regressed;
+}
+
+static int baseline_compare(void)
+{
+	struct bench_result *base, *result;
+	unsigned int i, regressions = 0;
+
+	printf("%-36s %-10s %12s %12s %8s\n", "# baseline", "metric",
+	       "baseline", "current", "delta");
+
+	for (i = 0; i < num_results; i++) {
+		result = &results[i];
+		base = result_find(baseline, num_baseline, result->name);
+		/* A new benchmark must be recorded along with its change */
+		if (!base) {
+			printf("%-36s not in the baseline FAIL\n",
+			       result->name);
+			regressions++;
+			continue;
+		}
+
+		if (tolerance >= 0)
+			regressions += compare_metric(result->name,
+						      "cpu-ns/op",
+						      base->cpu_ns,
+						      result->cpu_ns,
+						      tolerance, 0);
+
+		regressions += compare_metric(result->name, "allocs/op",
+					      base->allocs, result->allocs,
+					      BENCH_ALLOCS_TOLERANCE,
+					      BENCH_ALLOCS_SLACK);
+		regressions += compare_metric(result->name, "B/op",
+					      base->bytes, result->bytes,
+					      BENCH_BYTES_TOLERANCE,
+					      BENCH_BYTES_SLACK);
+	}
+
+	if (regressions) {
+		printf("# %u regressions from %s, run \"make bench-baseline\" "
+		       "if intended\n", regressions, baseline_path);
+		return -1;
+	}
+
+	return 0;
+}
+
+/**
+ * bench_init:
+ * @argc: number of arguments
+ * @argv: -n sets the iterations, -r the repetitions and -f runs only the
+ * benchmarks whose name contains the filter. -b compares the allocations
+ * with a baseline file, and the CPU time too if -t gives the percent it may
+ * grow by. -u writes the results to the baseline file instead.
+ *
+ * Returns: 0 if successful and -1 on invalid arguments.
+ */
+int bench_init(int argc, char *argv[])
+{
+	int opt;
+
+	while ((opt = getopt(argc, argv, "n:r:f:b:u:t:h")) != -1) {
+		switch (opt) {
+		case 'n':
+			iterations = strtoull(optarg, NULL, 10);
+			break;
+		case 'r':
+			repeat = strtoul(optarg, NULL, 10);
+			break;
+		case 'f':
+			filter = optarg;
+			break;
+		case 'b':
+		case 'u':
+			if (baseline_path) {
+				usage(argv[0]);
+				return -1;
+			}
+
+			baseline_path = optarg;
+			baseline_update = opt == 'u';
+			break;
+		case 't':
+			tolerance = strtod(optarg, NULL);
+			if (tolerance < 0) {
+				usage(argv[0]);
+				return -1;
+			}
+
+			break;
+		default:
+			usage(argv[0]);
+			return -1;
+		}
+	}
+
+	if (!iterations || !repeat || repeat > BENCH_REPEAT_MAX) {
+		usage(argv[0]);
+		return -1;
+	}
+
+	if (baseline_path && baseline_load(baseline_path))
+		return -1;
+
+	return 0;
+}
+
+/**
+ * bench_exit:
+ *
+ * Compares the results with the baseline given to bench_init(), or writes
+ * them to it.
+ *
+ * Returns: 0 if successful and -1 if a benchmark regressed or on errors.
+ */
+int bench_exit(void)
+{
+	if (!baseline_path)
+		return 0;
+
+	if (baseline_update)
+		return baseline_write(baseline_path);
+
+	return baseline_compare();
+}
+
+/**
+ * bench_run:
+ * @name: benchmark name
+ * @func: runs the iterations given
+ * @user_data: user data provided to @func
+ *
+ * Runs @func once to warm up, then the repetitions, and prints the median
+ * wall and CPU time per iteration.
+ */
+void bench_run(const char *name, bench_func_t func, void *user_data)
+{
+	uint64_t wall[BENCH_REPEAT_MAX];
+	uint64_t cpu[BENCH_REPEAT_MAX];
+	uint64_t count_start, bytes_start, count, bytes;
+	uint64_t wall_start, cpu_start;
+	unsigned int i;
+
+	if (filter && !strstr(name, filter))
+		return;
+
+	func(iterations / 10 ? : 1, user_data);
+
+	for (i = 0; i < repeat; i++) {
+		bench_get_allocs(&count_start, &bytes_start);
+		wall_start = clock_ns(CLOCK_MONOTONIC);
+		cpu_start = clock_ns(CLOCK_PROCESS_CPUTIME_ID);
+
+		func(iterations, user_data);
+
+		cpu[i] = clock_ns(CLOCK_PROCESS_CPUTIME_ID) - cpu_start;
+		wall[i] = clock_ns(CLOCK_MONOTONIC) - wall_start;
+		bench_get_allocs(&count, &bytes);
+	}
+
+	qsort(wall, repeat, sizeof(wall[0]), compare_u64);
+	qsort(cpu, repeat, sizeof(cpu[0]), compare_u64);
+
+	if (columns != BENCH_COLUMNS_TIME) {
+		printf("%-36s %10s %12s %12s %10s %10s\n", "# benchmark",
+		       "iters", "ns/op", "cpu-ns/op", "allocs/op", "B/op");
+		columns = BENCH_COLUMNS_TIME;
+	}
+
+	/* Allocations of the last repetition, the same on every one */
+	printf("%-36s %10" PRIu64 " %12.1f %12.1f %10.2f %10.1f\n",
+	       name, iterations,
+	       (double) wall[repeat / 2] / iterations,
+	       (double) cpu[repeat / 2] / iterations,
+	       (double) (count - count_start) / iterations,
+	       (double) (bytes - bytes_start) / iterations);
+	fflush(stdout);
+
+	result_add(name, (double) cpu[repeat / 2] / iterations,
+		   (double) (count - count_start) / iterations,
+		   (double) (bytes - bytes_start) / iterations);
+}
+
+/**
+ * bench_run_latency:
+ * @name: benchmark name
+ * @func: runs the iterations given, filling the latency of each one
+ * @user_data: user data provided to @func
+ *
+ * Runs @func once to warm up, then the repetitions. Prints the median
+ * throughput and the percentiles of the latencies of every repetition. The
+ * CPU time is the one of the calling thread only.
+ */
+void bench_run_latency(const char *name, bench_latency_func_t func,
+		       void *user_data)
+{
+	uint64_t wall[BENCH_REPEAT_MAX];
+	uint64_t cpu[BENCH_REPEAT_MAX];
+	uint64_t count_start, bytes_start, count, bytes;
+	uint64_t wall_start, cpu_start;
+	uint64_t *latency;
+	uint64_t total;
+	unsigned int i;
+
+	if (filter && !strstr(name, filter))
+		return;
+
+	total = iterations * repeat;
+	latency = malloc(total * sizeof(*latency));
+	if (!latency) {
+		fprintf(stderr, "%s: out of memory\n", name);
+		return;
+	}
+
+	func(iterations / 10 ? : 1, latency, user_data);
+
+	for (i = 0; i < repeat; i++) {
+		bench_get_allocs(&count_start, &bytes_start);
+		wall_start = clock_ns(CLOCK_MONOTONIC);
+		cpu_start = clock_ns(CLOCK_THREAD_CPUTIME_ID);
+
+		func(iterations, latency + i * iterations, user_data);
+
+		cpu[i] = clock_ns(CLOCK_THREAD_CPUTIME_ID) - cpu_start;
+		wall[i] = clock_ns(CLOCK_MONOTONIC) - wall_start;
+		bench_get_allocs(&count, &bytes);
+	}
+
+	qsort(wall, repeat, sizeof(wall[0]), compare_u64);
+	qsort(cpu, repeat, sizeof(cpu[0]), compare_u64);
+	qsort(latency, total, sizeof(latency[0]), compare_u64);
+
+	if (columns != BENCH_COLUMNS_LATENCY) {
+		printf("%-36s %10s %12s %10s %10s %12s %10s\n", "# benchmark",
+		       "iters", "msgs/s", "p50-us", "p99-us", "cpu-ns/op",
+		       "allocs/op");
+		columns = BENCH_COLUMNS_LATENCY;
+	}
+
+	printf("%-36s %10" PRIu64 " %12.0f %10.1f %10.1f %12.1f %10.2f\n",
+	       name, iterations,
+	       iterations * 1e9 / wall[repeat / 2],
+	       latency[total / 2] / 1e3,
+	       latency[total * 99 / 100] / 1e3,
+	       (double) cpu[repeat / 2] / iterations,
+	       (double) (count - count_start) / iterations);
+	fflush(stdout);
+
+	result_add(name, (double) cpu[repeat / 2] / iterations,
+		   (double) (count - count_start) / iterations,
+		   (double) (bytes - bytes_start) / iterations);
+
+	free(latency);
+}
@@ -0,0 +1,37 @@
+/**
+ * This file is part of the KNOT Project
+ *
+ * Copyright (c) 2019, CESAR. All rights reserved.
+ *
+ *  This library is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU Lesser General Public
+ *  License as published by the Free Software Foundation; either
+ *  version 2.1 of the License, or (at your option) any later version.
+ *
+ *  This library is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Lesser General Public License for more details.
+ */
+
+/**
+ *  Benchmark harness header file
+ *
+ *  Each benchmark runs a fixed number of iterations, repeated a few times.
+ *  The median of the repetitions is reported, along with the allocations
+ *  made per iteration, which don't depend on the machine. The results can
+ *  be compared with a baseline file of a previous run.
+ */
+
+typedef void (*bench_func_t) (uint64_t iterations, void *user_data);
+/* Fills @latency_ns with the latency of each iteration */
+typedef void (*bench_latency_func_t) (uint64_t iterations,
+				      uint64_t *latency_ns, void *user_data);
+
+int bench_init(int argc, char *argv[]);
+int bench_exit(void);
+void bench_run(const char *name, bench_func_t func, void *user_data);
+void bench_run_latency(const char *name, bench_latency_func_t func,
+		       void *user_data);
+void bench_get_allocs(uint64_t *count, uint64_t *bytes);
+void bench_exclude_thread(void);
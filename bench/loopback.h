@@ -0,0 +1,48 @@
+/**
+ * This file is part of the KNOT Project
+ *
+ * Copyright (c) 2019, CESAR. All rights reserved.
+ *
+ *  This library is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU Lesser General Public
+ *  License as published by the Free Software Foundation; either
+ *  version 2.1 of the License, or (at your option) any later version.
+ *
+ *  This library is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Lesser General Public License for more details.
+ */
+
+/**
+ *  Loopback AMQP broker header file
+ *
+ *  Minimal AMQP 0-9-1 server listening on 127.0.0.1, run on its own thread.
+ *  Used by the benchmarks and tools only, it stands in for a real broker so
+ *  their numbers measure the SDK.
+ */
+
+struct loopback_msg {
+	const char *exchange;
+	const char *routing_key;
+	const char *correlation_id; // NULL if not set
+	const char *reply_to; // NULL if not set
+	const void *body;
+	size_t len;
+};
+
+/*
+ * Called on the broker thread for every message published, by a client or
+ * by loopback_inject().
+ */
+typedef void (*loopback_publish_cb_t) (const struct loopback_msg *msg,
+				       void *user_data);
+
+struct loopback;
+
+struct loopback *loopback_new(loopback_publish_cb_t publish_cb,
+			      void *user_data);
+void loopback_free(struct loopback *loopback);
+const char *loopback_get_url(struct loopback *loopback);
+int loopback_inject(struct loopback *loopback,
+		    const struct loopback_msg *msg);
@@ -0,0 +1,372 @@
+/**
+ * This file is part of the KNOT Project
+ *
+ * Copyright (c) 2019, CESAR. All rights reserved.
+ *
+ *  This library is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU Lesser General Public
+ *  License as published by the Free Software Foundation; either
+ *  version 2.1 of the License, or (at your option) any later version.
+ *
+ *  This library is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Lesser General Public License for more details.
+ */
+
+/**
+ *  Allocation accounting source file
+ *
+ *  The glibc allocator is wrapped, so the allocations made by ell, json-c
+ *  and librabbitmq on behalf of the SDK are counted too. Each thread counts
+ *  its own allocations, the message paths take the difference between
+ *  entering and leaving them. The live heap is tracked for the whole
+ *  process through malloc_usable_size().
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <malloc.h>
+
+#include "alloc.h"
+
+#ifdef HAVE_ALLOC_STATS
+
+/* Paths entered from another one, e.g. a publish from the read handler */
+#define ALLOC_SITE_DEPTH_MAX 8
+
+/*
+ * Initial exec TLS is reached without __tls_get_addr(), which may allocate,
+ * so it is safe to use from the allocator itself.
+ */
+#define ALLOC_TLS __thread __attribute__((tls_model("initial-exec")))
+
+void *__libc_malloc(size_t size);
+void *__libc_calloc(size_t nmemb, size_t size);
+void *__libc_realloc(void *ptr, size_t size);
+void *__libc_memalign(size_t alignment, size_t size);
+void *__libc_valloc(size_t size);
+void *__libc_pvalloc(size_t size);
+void __libc_free(void *ptr);
+
+struct alloc_frame {
+	enum alloc_site site;
+	/* Allocations of the thread when entered, minus the inner paths */
+	uint64_t count;
+	uint64_t bytes;
+};
+
+static ALLOC_TLS bool thread_excluded;
+static ALLOC_TLS uint64_t thread_count;
+static ALLOC_TLS uint64_t thread_bytes;
+static ALLOC_TLS struct alloc_frame frames[ALLOC_SITE_DEPTH_MAX];
+static ALLOC_TLS unsigned int depth;
+
+static struct alloc_site_stats sites[ALLOC_SITES];
+static uint64_t total_count;
+static uint64_t total_bytes;
+/* Signed, blocks allocated before the library was loaded may be freed */
+static int64_t live_bytes;
+static int64_t peak_bytes;
+
+static const char * const site_names[] = {
+	[ALLOC_SITE_OTHER] = "other",
+	[ALLOC_SITE_PUBLISH_DATA] = "publish-data",
+	[ALLOC_SITE_REGISTER] = "register",
+	[ALLOC_SITE_UNREGISTER] = "unregister",
+	[ALLOC_SITE_AUTH] = "auth",
+	[ALLOC_SITE_SCHEMA_CREATE] = "schema-create",
+	[ALLOC_SITE_RECEIVE] = "receive",
+	[ALLOC_SITE_RECEIVE_UPDATE] = "receive-update",
+	[ALLOC_SITE_RECEIVE_REQUEST] = "receive-request",
+	[ALLOC_SITE_RECEIVE_EVENT] = "receive-event",
+	[ALLOC_SITE_READ_HANDLER] = "read-handler",
+};
+
+static void account_alloc(void *ptr, size_t size)
+{
+	int64_t live, peak;
+
+	if (!ptr)
+		return;
+
+	live = __atomic_add_fetch(&live_bytes, malloc_usable_size(ptr),
+				  __ATOMIC_RELAXED);
+	peak = __atomic_load_n(&peak_bytes, __ATOMIC_RELAXED);
+	while (live > peak &&
+			!__atomic_compare_exchange_n(&peak_bytes, &peak, live,
+						     true, __ATOMIC_RELAXED,
+						     __ATOMIC_RELAXED))
+		;
+
+	if (thread_excluded)
+		return;
+
+	__atomic_fetch_add(&total_count, 1, __ATOMIC_RELAXED);
+	__atomic_fetch_add(&total_bytes, size, __ATOMIC_RELAXED);
+	thread_count++;
+	thread_bytes += size;
+}
+
+static void account_free(void *ptr)
+{
+	if (ptr)
+		__atomic_fetch_sub(&live_bytes, malloc_usable_size(ptr),
+				   __ATOMIC_RELAXED);
+}
+
+void *malloc(size_t size)
+{
+	void *ptr = __libc_malloc(size);
+
+	account_alloc(ptr, size);
+
+	return ptr;
+}
+
+void *calloc(size_t nmemb, size_t size)
+{
+	void *ptr = __libc_calloc(nmemb, size);
+
+	account_alloc(ptr, nmemb * size);
+
+	return ptr;
+}
+
+void *realloc(void *ptr, size_t size)
+{
+	size_t old_size = ptr ? malloc_usable_size(ptr) : 0;
+	void *new_ptr = __libc_realloc(ptr, size);
+
+	/* On failure the block is left untouched */
+	if (!new_ptr && size)
+		return NULL;
+
+	__atomic_fetch_sub(&live_bytes, old_size, __ATOMIC_RELAXED);
+	account_alloc(new_ptr, size);
+
+	return new_ptr;
+}
+
+void *memalign(size_t alignment, size_t size)
+{
+	void *ptr = __libc_memalign(alignment, size);
+
+	account_alloc(ptr, size);
+
+	return ptr;
+}
+
+void *aligned_alloc(size_t alignment, size_t size)
+{
+	return memalign(alignment, size);
+}
+
+int posix_memalign(void **memptr, size_t alignment, size_t size)
+{
+	void *ptr;
+
+	if (!alignment || alignment % sizeof(void *) ||
+			alignment & (alignment - 1))
+		return EINVAL;
+
+	ptr = memalign(alignment, size);
+	if (!ptr)
+		return ENOMEM;
+
+	*memptr = ptr;
+
+	return 0;
+}
+
+void *valloc(size_t size)
+{
+	void *ptr = __libc_valloc(size);
+
+	account_alloc(ptr, size);
+
+	return ptr;
+}
+
+void *pvalloc(size_t size)
+{
+	void *ptr = __libc_pvalloc(size);
+
+	account_alloc(ptr, size);
+
+	return ptr;
+}
+
+void free(void *ptr)
+{
+	account_free(ptr);
+	__libc_free(ptr);
+}
+
+/**
+ * alloc_site_enter:
+ * @site: message path entered by the calling thread
+ *
+ * Allocations made by the thread until alloc_site_leave() are attributed
+ * to @site. Paths entered meanwhile count their own allocations, not
+ * @site.
+ */
+void alloc_site_enter(enum alloc_site site)
+{
+	struct alloc_frame *frame;
+
+	if (depth++ >= ALLOC_SITE_DEPTH_MAX)
+		return;
+
+	frame = &frames[depth - 1];
+	frame->site = site;
+	frame->count = thread_count;
+	frame->bytes = thread_bytes;
+}
+
+/**
+ * alloc_site_set:
+ * @site: message path found out
+ *
+ * Changes the path of the calling thread, e.g. once a message received is
+ * routed. Allocations made since entering it are attributed to @site too.
+ */
+void alloc_site_set(enum alloc_site site)
+{
+	if (depth && depth <= ALLOC_SITE_DEPTH_MAX)
+		frames[depth - 1].site = site;
+}
+
+/**
+ * alloc_site_leave:
+ *
+ * Leaves the path entered last by the calling thread, counting a message.
+ * Setting ALLOC_SITE_OTHER before leaving counts no message, e.g. when
+ * nothing was received.
+ */
+void alloc_site_leave(void)
+{
+	struct alloc_frame *frame;
+	struct alloc_site_stats *stats;
+	uint64_t count, bytes;
+
+	if (!depth || depth-- > ALLOC_SITE_DEPTH_MAX)
+		return;
+
+	frame = &frames[depth];
+	count = thread_count - frame->count;
+	bytes = thread_bytes - frame->bytes;
+
+	/* The enclosing path doesn't count these */
+	if (depth) {
+		frames[depth - 1].count += count;
+		frames[depth - 1].bytes += bytes;
+	}
+
+	if (frame->site == ALLOC_SITE_OTHER)
+		return;
+
+	stats = &sites[frame->site];
+	__atomic_fetch_add(&stats->messages, 1, __ATOMIC_RELAXED);
+	__atomic_fetch_add(&stats->allocs, count, __ATOMIC_RELAXED);
+	__atomic_fetch_add(&stats->bytes, bytes, __ATOMIC_RELAXED);
+}
+
+/**
+ * alloc_site_name:
+ * @site: message path
+ *
+ * Returns: the name of @site, e.g. "publish-data".
+ */
+const char *alloc_site_name(enum alloc_site site)
+{
+	return site_names[site];
+}
+
+/**
+ * alloc_get_site:
+ * @site: message path
+ * @stats: filled with the messages and allocations of @site so far
+ *
+ * Allocations out of every path are reported by ALLOC_SITE_OTHER, without
+ * messages.
+ */
+void alloc_get_site(enum alloc_site site, struct alloc_site_stats *stats)
+{
+	unsigned int i;
+
+	if (site != ALLOC_SITE_OTHER) {
+		stats->messages = __atomic_load_n(&sites[site].messages,
+						  __ATOMIC_RELAXED);
+		stats->allocs = __atomic_load_n(&sites[site].allocs,
+						__ATOMIC_RELAXED);
+		stats->bytes = __atomic_load_n(&sites[site].bytes,
+					       __ATOMIC_RELAXED);
+		return;
+	}
+
+	alloc_get_totals(&stats->allocs, &stats->bytes);
+	stats->messages = 0;
+
+	for (i = ALLOC_SITE_OTHER + 1; i < ALLOC_SITES; i++) {
+		stats->allocs -= __atomic_load_n(&sites[i].allocs,
+						 __ATOMIC_RELAXED);
+		stats->bytes -= __atomic_load_n(&sites[i].bytes,
+						__ATOMIC_RELAXED);
+	}
+}
+
+/**
+ * alloc_get_heap:
+ * @live: filled with the bytes allocated and not freed yet
+ * @peak: filled with the highest @live so far
+ *
+ * Covers every thread of the process, including allocator overhead within
+ * the blocks.
+ */
+void alloc_get_heap(uint64_t *live, uint64_t *peak)
+{
+	int64_t value;
+
+	value = __atomic_load_n(&live_bytes, __ATOMIC_RELAXED);
+	*live = value > 0 ? value : 0;
+
+	value = __atomic_load_n(&peak_bytes, __ATOMIC_RELAXED);
+	*peak = value > 0 ? value : 0;
+}
+
+/**
+ * alloc_get_totals:
+ * @count: filled with the allocations made so far
+ * @bytes: filled with the bytes requested so far
+ *
+ * Threads excluded by alloc_exclude_thread() are not counted.
+ */
+void alloc_get_totals(uint64_t *count, uint64_t *bytes)
+{
+	*count = __atomic_load_n(&total_count, __ATOMIC_RELAXED);
+	*bytes = __atomic_load_n(&total_bytes, __ATOMIC_RELAXED);
+}
+
+/**
+ * alloc_exclude_thread:
+ *
+ * Stops counting the allocations made by the calling thread. Its blocks
+ * still count in the live heap.
+ */
+void alloc_exclude_thread(void)
+{
+	thread_excluded = true;
+}
+
+#endif
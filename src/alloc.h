@@ -0,0 +1,59 @@
+/**
+ * This file is part of the KNOT Project
+ *
+ * Copyright (c) 2019, CESAR. All rights reserved.
+ *
+ *  This library is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU Lesser General Public
+ *  License as published by the Free Software Foundation; either
+ *  version 2.1 of the License, or (at your option) any later version.
+ *
+ *  This library is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Lesser General Public License for more details.
+ */
+
+/**
+ *  Allocation accounting header file
+ *
+ *  Built with --enable-alloc-stats only, otherwise the calls marking the
+ *  message paths compile to nothing.
+ */
+
+enum alloc_site {
+	ALLOC_SITE_OTHER,		/* Outside of the paths below */
+	ALLOC_SITE_PUBLISH_DATA,
+	ALLOC_SITE_REGISTER,
+	ALLOC_SITE_UNREGISTER,
+	ALLOC_SITE_AUTH,
+	ALLOC_SITE_SCHEMA_CREATE,
+	ALLOC_SITE_RECEIVE,		/* Received, not routed or unusable */
+	ALLOC_SITE_RECEIVE_UPDATE,
+	ALLOC_SITE_RECEIVE_REQUEST,
+	ALLOC_SITE_RECEIVE_EVENT,	/* Replies and device events */
+	ALLOC_SITE_READ_HANDLER,	/* Made by the application */
+	ALLOC_SITES
+};
+
+struct alloc_site_stats {
+	uint64_t messages;
+	uint64_t allocs;
+	uint64_t bytes;
+};
+
+#ifdef HAVE_ALLOC_STATS
+void alloc_site_enter(enum alloc_site site);
+void alloc_site_set(enum alloc_site site);
+void alloc_site_leave(void);
+
+const char *alloc_site_name(enum alloc_site site);
+void alloc_get_site(enum alloc_site site, struct alloc_site_stats *stats);
+void alloc_get_heap(uint64_t *live, uint64_t *peak);
+void alloc_get_totals(uint64_t *count, uint64_t *bytes);
+void alloc_exclude_thread(void);
+#else
+#define alloc_site_enter(site) do { (void) (site); } while (0)
+#define alloc_site_set(site) do { (void) (site); } while (0)
+#define alloc_site_leave() do { } while (0)
+#endif
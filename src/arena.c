@@ -0,0 +1,237 @@
+/**
+ * This file is part of the KNOT Project
+ *
+ * Copyright (c) 2019, CESAR. All rights reserved.
+ *
+ *  This library is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU Lesser General Public
+ *  License as published by the Free Software Foundation; either
+ *  version 2.1 of the License, or (at your option) any later version.
+ *
+ *  This library is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Lesser General Public License for more details.
+ */
+
+/**
+ *  Bump arena source file
+ *
+ *  Memory is handed out by advancing an offset inside fixed size blocks and
+ *  is only given back all at once, either by arena_reset() (blocks are kept
+ *  to be reused) or by arena_free().
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <stdint.h>
+#include <string.h>
+#include <ell/ell.h>
+
+#include "arena.h"
+
+#define ARENA_ALIGN sizeof(uint64_t)
+#define ARENA_ALIGN_UP(x) (((x) + ARENA_ALIGN - 1) & ~(ARENA_ALIGN - 1))
+
+struct arena_block {
+	struct arena_block *next;
+	size_t size;
+	size_t used;
+	uint64_t data[];
+};
+
+struct arena {
+	int ref_count;
+	struct arena_block *head;
+	struct arena_block *tail;
+	struct arena_block *current;
+	size_t block_size;
+};
+
+static struct arena_block *arena_block_new(size_t size)
+{
+	struct arena_block *block;
+
+	block = l_malloc(sizeof(*block) + size);
+	block->next = NULL;
+	block->size = size;
+	block->used = 0;
+
+	return block;
+}
+
+/**
+ * arena_new:
+ * @block_size: size of each block or 0 to use ARENA_DEFAULT_BLOCK_SIZE
+ *
+ * Creates an empty arena. Blocks are only allocated on demand.
+ *
+ * Returns: a new arena.
+ */
+struct arena *arena_new(size_t block_size)
+{
+	struct arena *arena = l_new(struct arena, 1);
+
+	arena->ref_count = 1;
+	arena->block_size = ARENA_ALIGN_UP(block_size ? block_size :
+					   ARENA_DEFAULT_BLOCK_SIZE);
+
+	return arena;
+}
+
+/**
+ * arena_free:
+ * @arena: arena to be freed
+ *
+ * Releases the arena and every block owned by it at once.
+ */
+void arena_free(struct arena *arena)
+{
+	struct arena_block *block, *next;
+
+	if (!arena)
+		return;
+
+	for (block = arena->head; block; block = next) {
+		next = block->next;
+		l_free(block);
+	}
+
+	l_free(arena);
+}
+
+/**
+ * arena_ref:
+ * @arena: arena to be referenced
+ *
+ * Takes a reference to keep the arena memory alive after its owner is done
+ * with it, e.g. while a message is handed over to another thread.
+ *
+ * Returns: @arena
+ */
+struct arena *arena_ref(struct arena *arena)
+{
+	if (!arena)
+		return NULL;
+
+	__sync_fetch_and_add(&arena->ref_count, 1);
+
+	return arena;
+}
+
+/**
+ * arena_unref:
+ * @arena: arena to be unreferenced
+ *
+ * Drops a reference taken by arena_new() or arena_ref(). The memory is not
+ * released here, it is up to the caller to reset or free the arena once the
+ * last reference is gone.
+ *
+ * Returns: true if it was the last reference and false otherwise.
+ */
+bool arena_unref(struct arena *arena)
+{
+	if (!arena)
+		return false;
+
+	if (__sync_sub_and_fetch(&arena->ref_count, 1))
+		return false;
+
+	return true;
+}
+
+/**
+ * arena_reset:
+ * @arena: arena to be reset
+ *
+ * Invalidates every allocation made from @arena while keeping its blocks,
+ * so the next allocations don't touch the system allocator.
+ */
+void arena_reset(struct arena *arena)
+{
+	struct arena_block *block;
+
+	if (!arena)
+		return;
+
+	for (block = arena->head; block; block = block->next)
+		block->used = 0;
+
+	arena->current = arena->head;
+	arena->ref_count = 1;
+}
+
+static void *arena_bump(struct arena *arena, size_t size)
+{
+	struct arena_block *block;
+	void *mem;
+
+	size = ARENA_ALIGN_UP(size ? size : 1);
+
+	for (block = arena->current; block; block = block->next) {
+		if (block->size - block->used >= size)
+			break;
+	}
+
+	if (!block) {
+		block = arena_block_new(size > arena->block_size ?
+					size : arena->block_size);
+		if (arena->tail)
+			arena->tail->next = block;
+		else
+			arena->head = block;
+
+		arena->tail = block;
+	}
+
+	arena->current = block;
+
+	mem = (uint8_t *) block->data + block->used;
+	block->used += size;
+
+	return mem;
+}
+
+/**
+ * arena_alloc:
+ * @arena: arena to allocate from
+ * @size: number of bytes
+ *
+ * Allocates @size zeroed bytes aligned to 8 bytes. Requests bigger than the
+ * arena block size get a dedicated block.
+ *
+ * Returns: pointer to the memory, valid until the arena is reset or freed.
+ */
+void *arena_alloc(struct arena *arena, size_t size)
+{
+	return memset(arena_bump(arena, size), 0, size);
+}
+
+void *arena_memdup(struct arena *arena, const void *mem, size_t size)
+{
+	void *dup = arena_bump(arena, size);
+
+	memcpy(dup, mem, size);
+
+	return dup;
+}
+
+/**
+ * arena_strndup:
+ * @arena: arena to allocate from
+ * @str: string, not necessarily NUL terminated
+ * @len: number of bytes to copy from @str
+ *
+ * Returns: a NUL terminated copy of @str allocated from @arena.
+ */
+char *arena_strndup(struct arena *arena, const char *str, size_t len)
+{
+	char *dup = arena_bump(arena, len + 1);
+
+	memcpy(dup, str, len);
+	dup[len] = '\0';
+
+	return dup;
+}
@@ -0,0 +1,33 @@
+/**
+ * This file is part of the KNOT Project
+ *
+ * Copyright (c) 2019, CESAR. All rights reserved.
+ *
+ *  This library is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU Lesser General Public
+ *  License as published by the Free Software Foundation; either
+ *  version 2.1 of the License, or (at your option) any later version.
+ *
+ *  This library is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Lesser General Public License for more details.
+ */
+
+/**
+ *  Bump arena header file
+ */
+
+#define ARENA_DEFAULT_BLOCK_SIZE 4096
+
+struct arena;
+
+struct arena *arena_new(size_t block_size);
+void arena_free(struct arena *arena);
+struct arena *arena_ref(struct arena *arena);
+bool arena_unref(struct arena *arena);
+void arena_reset(struct arena *arena);
+
+void *arena_alloc(struct arena *arena, size_t size);
+void *arena_memdup(struct arena *arena, const void *mem, size_t size);
+char *arena_strndup(struct arena *arena, const char *str, size_t len);
@@ -0,0 +1,138 @@
+/**
+ * This file is part of the KNOT Project
+ *
+ * Copyright (c) 2019, CESAR. All rights reserved.
+ *
+ *  This library is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU Lesser General Public
+ *  License as published by the Free Software Foundation; either
+ *  version 2.1 of the License, or (at your option) any later version.
+ *
+ *  This library is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Lesser General Public License for more details.
+ */
+
+/**
+ *  Base64 codec source file
+ *
+ *  Encodes and decodes the standard alphabet into buffers of the caller, so
+ *  raw sensor values need no temporary allocation in either direction.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "base64.h"
+
+static const char encode_table[] =
+	"ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+
+/* Value of each character plus one, zero for the invalid ones */
+static const uint8_t decode_table[256] = {
+	['A'] = 1, ['B'] = 2, ['C'] = 3, ['D'] = 4, ['E'] = 5, ['F'] = 6,
+	['G'] = 7, ['H'] = 8, ['I'] = 9, ['J'] = 10, ['K'] = 11, ['L'] = 12,
+	['M'] = 13, ['N'] = 14, ['O'] = 15, ['P'] = 16, ['Q'] = 17, ['R'] = 18,
+	['S'] = 19, ['T'] = 20, ['U'] = 21, ['V'] = 22, ['W'] = 23, ['X'] = 24,
+	['Y'] = 25, ['Z'] = 26, ['a'] = 27, ['b'] = 28, ['c'] = 29, ['d'] = 30,
+	['e'] = 31, ['f'] = 32, ['g'] = 33, ['h'] = 34, ['i'] = 35, ['j'] = 36,
+	['k'] = 37, ['l'] = 38, ['m'] = 39, ['n'] = 40, ['o'] = 41, ['p'] = 42,
+	['q'] = 43, ['r'] = 44, ['s'] = 45, ['t'] = 46, ['u'] = 47, ['v'] = 48,
+	['w'] = 49, ['x'] = 50, ['y'] = 51, ['z'] = 52, ['0'] = 53, ['1'] = 54,
+	['2'] = 55, ['3'] = 56, ['4'] = 57, ['5'] = 58, ['6'] = 59, ['7'] = 60,
+	['8'] = 61, ['9'] = 62, ['+'] = 63, ['/'] = 64,
+};
+
+/**
+ * base64_encode:
+ * @in: bytes to encode
+ * @len: number of bytes in @in
+ * @out: buffer of at least BASE64_ENCODED_LEN(@len) characters
+ *
+ * Encodes @in padded with '=' and without line breaks. @out isn't NUL
+ * terminated.
+ *
+ * Returns: the number of characters written.
+ */
+size_t base64_encode(const void *in, size_t len, char *out)
+{
+	const uint8_t *src = in;
+	char *dst = out;
+	uint32_t block;
+	size_t i;
+
+	for (i = 0; i + 3 <= len; i += 3) {
+		block = src[i] << 16 | src[i + 1] << 8 | src[i + 2];
+		*dst++ = encode_table[block >> 18];
+		*dst++ = encode_table[block >> 12 & 0x3f];
+		*dst++ = encode_table[block >> 6 & 0x3f];
+		*dst++ = encode_table[block & 0x3f];
+	}
+
+	if (i < len) {
+		block = src[i] << 16;
+		if (i + 1 < len)
+			block |= src[i + 1] << 8;
+
+		*dst++ = encode_table[block >> 18];
+		*dst++ = encode_table[block >> 12 & 0x3f];
+		*dst++ = i + 1 < len ? encode_table[block >> 6 & 0x3f] : '=';
+		*dst++ = '=';
+	}
+
+	return dst - out;
+}
+
+/**
+ * base64_decode:
+ * @in: characters to decode, not necessarily NUL terminated
+ * @len: number of characters in @in
+ * @out: buffer the bytes are written to
+ * @size: size of @out
+ *
+ * Decodes @in, with or without padding. The whole input is validated, but
+ * only the first @size bytes are written and the rest is dropped.
+ *
+ * Returns: the number of bytes written, at most @size, or -1 if @in isn't
+ * valid base64.
+ */
+int base64_decode(const char *in, size_t len, void *out, size_t size)
+{
+	uint8_t *dst = out;
+	size_t i, n, written = 0;
+	unsigned int j, pad = 0;
+	uint32_t block;
+	uint8_t value;
+
+	while (len && in[len - 1] == '=' && pad < 2) {
+		len--;
+		pad++;
+	}
+
+	if ((pad && (len + pad) % 4) || len % 4 == 1)
+		return -1;
+
+	/* Every group of 2 to 4 characters gives one byte less */
+	for (i = 0; i < len; i += 4) {
+		n = len - i < 4 ? len - i : 4;
+		block = 0;
+
+		for (j = 0; j < 4; j++) {
+			value = j < n ? decode_table[(uint8_t) in[i + j]] : 1;
+			if (!value)
+				return -1;
+
+			block = block << 6 | (value - 1);
+		}
+
+		for (j = 0; j < n - 1 && written < size; j++)
+			dst[written++] = block >> (16 - 8 * j);
+	}
+
+	return written;
+}
@@ -0,0 +1,25 @@
+/**
+ * This file is part of the KNOT Project
+ *
+ * Copyright (c) 2019, CESAR. All rights reserved.
+ *
+ *  This library is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU Lesser General Public
+ *  License as published by the Free Software Foundation; either
+ *  version 2.1 of the License, or (at your option) any later version.
+ *
+ *  This library is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Lesser General Public License for more details.
+ */
+
+/**
+ *  Base64 codec header file
+ */
+
+/* Characters written by base64_encode(), the terminating NUL left out */
+#define BASE64_ENCODED_LEN(len) (((len) + 2) / 3 * 4)
+
+size_t base64_encode(const void *in, size_t len, char *out);
+int base64_decode(const char *in, size_t len, void *out, size_t size);
@@ -0,0 +1,411 @@
+/**
+ * This file is part of the KNOT Project
+ *
+ * Copyright (c) 2019, CESAR. All rights reserved.
+ *
+ *  This library is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU Lesser General Public
+ *  License as published by the Free Software Foundation; either
+ *  version 2.1 of the License, or (at your option) any later version.
+ *
+ *  This library is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Lesser General Public License for more details.
+ */
+
+/**
+ *  Traffic capture source file
+ *
+ *  Captures start with the magic "KNOTCAP", a version byte and the wall
+ *  clock time of the start in microseconds since the epoch, little endian.
+ *  Each record follows:
+ *
+ *	u8	direction
+ *	u8	flags, CAPTURE_* plus the optional fields present
+ *	varint	microseconds since the previous record
+ *	varint	expiration in milliseconds
+ *	string	exchange
+ *	string	routing key
+ *	string	correlation id, if present
+ *	string	reply to, if present
+ *	string	body
+ *
+ *  Varints are unsigned LEB128 and strings a varint length followed by the
+ *  bytes, without terminator.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
+#include <stdio.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <ell/ell.h>
+
+#include "capture.h"
+
+#define CAPTURE_MAGIC "KNOTCAP"
+#define CAPTURE_VERSION 1
+#define CAPTURE_HEADER_LEN (sizeof(CAPTURE_MAGIC) + sizeof(uint64_t))
+#define CAPTURE_BUFFER_SIZE (64 * 1024)
+
+/* Larger fields mean a corrupted capture */
+#define CAPTURE_FIELD_MAX (16 * 1024 * 1024)
+
+#define CAPTURE_HAS_CORRELATION_ID	0x40
+#define CAPTURE_HAS_REPLY_TO		0x80
+
+struct capture {
+	FILE *file;
+	char *buffer;
+	/* Monotonic time of the start and of the last record */
+	uint64_t origin_us;
+	uint64_t last_us;
+	bool failed;
+};
+
+/* Fields of a record, in the order they are stored */
+enum capture_field {
+	CAPTURE_FIELD_EXCHANGE,
+	CAPTURE_FIELD_ROUTING_KEY,
+	CAPTURE_FIELD_CORRELATION_ID,
+	CAPTURE_FIELD_REPLY_TO,
+	CAPTURE_FIELD_BODY,
+	CAPTURE_FIELDS
+};
+
+struct capture_reader {
+	FILE *file;
+	uint64_t start_us;
+	uint64_t time_us;
+	char *buffer;
+	size_t buffer_size;
+};
+
+static uint64_t capture_wallclock_us(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_REALTIME, &ts);
+
+	return (uint64_t) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static void put_varint(FILE *file, uint64_t value)
+{
+	while (value >= 0x80) {
+		putc_unlocked((value & 0x7f) | 0x80, file);
+		value >>= 7;
+	}
+
+	putc_unlocked(value, file);
+}
+
+static void put_string(FILE *file, const char *str, size_t len)
+{
+	put_varint(file, len);
+	fwrite_unlocked(str, 1, len, file);
+}
+
+static int get_varint(FILE *file, uint64_t *value)
+{
+	unsigned int shift;
+	int c;
+
+	*value = 0;
+
+	for (shift = 0; shift < 64; shift += 7) {
+		c = getc_unlocked(file);
+		if (c == EOF)
+			return -1;
+
+		*value |= (uint64_t) (c & 0x7f) << shift;
+		if (!(c & 0x80))
+			return 0;
+	}
+
+	return -1;
+}
+
+/**
+ * capture_new:
+ * @path: file created, or truncated if it exists
+ *
+ * Starts a capture. Writes are buffered, the file is complete once the
+ * capture is freed. Not thread safe.
+ *
+ * Returns: the capture or NULL on error.
+ */
+struct capture *capture_new(const char *path)
+{
+	struct capture *capture;
+	uint8_t start[sizeof(uint64_t)];
+	uint64_t start_us;
+	size_t i;
+
+	capture = l_new(struct capture, 1);
+	capture->file = fopen(path, "we");
+	if (!capture->file) {
+		l_error("Error on open capture %s: %s", path, strerror(errno));
+		l_free(capture);
+		return NULL;
+	}
+
+	capture->buffer = l_malloc(CAPTURE_BUFFER_SIZE);
+	setvbuf(capture->file, capture->buffer, _IOFBF, CAPTURE_BUFFER_SIZE);
+
+	capture->origin_us = l_time_now();
+	capture->last_us = capture->origin_us;
+
+	start_us = capture_wallclock_us();
+	for (i = 0; i < sizeof(start); i++)
+		start[i] = start_us >> (i * 8);
+
+	fwrite(CAPTURE_MAGIC, 1, strlen(CAPTURE_MAGIC), capture->file);
+	putc(CAPTURE_VERSION, capture->file);
+	fwrite(start, 1, sizeof(start), capture->file);
+
+	return capture;
+}
+
+/**
+ * capture_free:
+ * @capture: capture created by capture_new()
+ *
+ * Flushes and closes the capture file.
+ */
+void capture_free(struct capture *capture)
+{
+	if (!capture)
+		return;
+
+	if (fclose(capture->file))
+		l_error("Error on close capture: %s", strerror(errno));
+
+	l_free(capture->buffer);
+	l_free(capture);
+}
+
+/**
+ * capture_write:
+ * @capture: capture created by capture_new()
+ * @record: message appended, its time is set to now
+ *
+ * Appends a message to the capture. Once a write fails, the capture stops
+ * and the next records are dropped.
+ *
+ * Returns: 0 if successful and -1 otherwise.
+ */
+int capture_write(struct capture *capture, struct capture_record *record)
+{
+	FILE *file = capture->file;
+	uint64_t now = l_time_now();
+	uint8_t flags = record->flags;
+
+	if (capture->failed)
+		return -1;
+
+	record->time_us = now - capture->origin_us;
+
+	if (record->correlation_id)
+		flags |= CAPTURE_HAS_CORRELATION_ID;
+
+	if (record->reply_to)
+		flags |= CAPTURE_HAS_REPLY_TO;
+
+	putc_unlocked(record->direction, file);
+	putc_unlocked(flags, file);
+	put_varint(file, now - capture->last_us);
+	put_varint(file, record->expiration_ms);
+	put_string(file, record->exchange, strlen(record->exchange));
+	put_string(file, record->routing_key, strlen(record->routing_key));
+
+	if (record->correlation_id)
+		put_string(file, record->correlation_id,
+			   strlen(record->correlation_id));
+
+	if (record->reply_to)
+		put_string(file, record->reply_to, strlen(record->reply_to));
+
+	put_string(file, record->body, record->body_len);
+
+	capture->last_us = now;
+
+	if (ferror(file)) {
+		l_error("Error on write capture, stopping it");
+		capture->failed = true;
+		return -1;
+	}
+
+	return 0;
+}
+
+static int read_header(struct capture_reader *reader)
+{
+	uint8_t header[CAPTURE_HEADER_LEN];
+	const uint8_t *start = header + sizeof(CAPTURE_MAGIC);
+	size_t i;
+
+	if (fread(header, 1, sizeof(header), reader->file) != sizeof(header))
+		return -1;
+
+	if (memcmp(header, CAPTURE_MAGIC, strlen(CAPTURE_MAGIC)) ||
+			header[strlen(CAPTURE_MAGIC)] != CAPTURE_VERSION)
+		return -1;
+
+	reader->start_us = 0;
+	for (i = 0; i < sizeof(uint64_t); i++)
+		reader->start_us |= (uint64_t) start[i] << (i * 8);
+
+	reader->time_us = 0;
+
+	return 0;
+}
+
+/**
+ * capture_reader_new:
+ * @path: capture written by capture_new()
+ *
+ * Opens a capture to read its records in order.
+ *
+ * Returns: the reader or NULL on error.
+ */
+struct capture_reader *capture_reader_new(const char *path)
+{
+	struct capture_reader *reader;
+
+	reader = l_new(struct capture_reader, 1);
+	reader->file = fopen(path, "re");
+	if (!reader->file) {
+		l_error("Error on open capture %s: %s", path, strerror(errno));
+		l_free(reader);
+		return NULL;
+	}
+
+	if (read_header(reader)) {
+		l_error("%s is not a capture", path);
+		capture_reader_free(reader);
+		return NULL;
+	}
+
+	return reader;
+}
+
+/**
+ * capture_reader_free:
+ * @reader: reader created by capture_reader_new()
+ */
+void capture_reader_free(struct capture_reader *reader)
+{
+	if (!reader)
+		return;
+
+	fclose(reader->file);
+	l_free(reader->buffer);
+	l_free(reader);
+}
+
+/**
+ * capture_reader_get_start:
+ * @reader: reader created by capture_reader_new()
+ *
+ * Returns: the wall clock time the capture started, in microseconds since
+ * the epoch.
+ */
+uint64_t capture_reader_get_start(struct capture_reader *reader)
+{
+	return reader->start_us;
+}
+
+/**
+ * capture_reader_next:
+ * @reader: reader created by capture_reader_new()
+ * @record: filled with the next record
+ *
+ * Reads the next record. Its strings are NUL terminated, the body included,
+ * and valid until the next call.
+ *
+ * Returns: 1 if a record was read, 0 at the end of the capture and -1 if
+ * the capture is truncated or corrupted.
+ */
+int capture_reader_next(struct capture_reader *reader,
+			struct capture_record *record)
+{
+	size_t offsets[CAPTURE_FIELDS] = { 0 };
+	size_t used = 0;
+	uint64_t delta, len;
+	int direction, flags;
+	unsigned int field;
+
+	direction = getc_unlocked(reader->file);
+	if (direction == EOF)
+		return 0;
+
+	flags = getc_unlocked(reader->file);
+	if (flags == EOF || (direction != CAPTURE_IN &&
+			     direction != CAPTURE_OUT))
+		return -1;
+
+	if (get_varint(reader->file, &delta) ||
+			get_varint(reader->file, &record->expiration_ms))
+		return -1;
+
+	for (field = 0; field < CAPTURE_FIELDS; field++) {
+		if (field == CAPTURE_FIELD_CORRELATION_ID &&
+				!(flags & CAPTURE_HAS_CORRELATION_ID))
+			continue;
+
+		if (field == CAPTURE_FIELD_REPLY_TO &&
+				!(flags & CAPTURE_HAS_REPLY_TO))
+			continue;
+
+		if (get_varint(reader->file, &len) || len > CAPTURE_FIELD_MAX)
+			return -1;
+
+		if (used + len + 1 > reader->buffer_size) {
+			reader->buffer_size = (used + len + 1) * 2;
+			reader->buffer = l_realloc(reader->buffer,
+						   reader->buffer_size);
+		}
+
+		if (fread_unlocked(reader->buffer + used, 1, len,
+				   reader->file) != len)
+			return -1;
+
+		/* Offsets are stored plus one, 0 means absent */
+		offsets[field] = used + 1;
+		used += len;
+		reader->buffer[used++] = '\0';
+
+		if (field == CAPTURE_FIELD_BODY)
+			record->body_len = len;
+	}
+
+	/* Pointers are set last, the buffer may have moved meanwhile */
+	record->exchange = reader->buffer + offsets[CAPTURE_FIELD_EXCHANGE] - 1;
+	record->routing_key = reader->buffer +
+				offsets[CAPTURE_FIELD_ROUTING_KEY] - 1;
+	record->correlation_id = offsets[CAPTURE_FIELD_CORRELATION_ID] ?
+		reader->buffer + offsets[CAPTURE_FIELD_CORRELATION_ID] - 1 :
+		NULL;
+	record->reply_to = offsets[CAPTURE_FIELD_REPLY_TO] ?
+		reader->buffer + offsets[CAPTURE_FIELD_REPLY_TO] - 1 : NULL;
+	record->body = reader->buffer + offsets[CAPTURE_FIELD_BODY] - 1;
+
+	reader->time_us += delta;
+	record->time_us = reader->time_us;
+	record->direction = direction;
+	record->flags = flags & ~(CAPTURE_HAS_CORRELATION_ID |
+				  CAPTURE_HAS_REPLY_TO);
+
+	return 1;
+}
@@ -0,0 +1,54 @@
+/**
+ * This file is part of the KNOT Project
+ *
+ * Copyright (c) 2019, CESAR. All rights reserved.
+ *
+ *  This library is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU Lesser General Public
+ *  License as published by the Free Software Foundation; either
+ *  version 2.1 of the License, or (at your option) any later version.
+ *
+ *  This library is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Lesser General Public License for more details.
+ */
+
+/**
+ *  Traffic capture header file
+ */
+
+enum capture_direction {
+	CAPTURE_IN,	/* Consumed from a queue */
+	CAPTURE_OUT	/* Published */
+};
+
+#define CAPTURE_FANOUT		0x01	/* Published to a fanout exchange */
+#define CAPTURE_REDELIVERED	0x02
+
+struct capture_record {
+	enum capture_direction direction;
+	uint8_t flags;
+	/* Since the capture started, set by capture_write() */
+	uint64_t time_us;
+	const char *exchange;
+	const char *routing_key;
+	const char *correlation_id;	/* NULL if not set */
+	const char *reply_to;		/* NULL if not set */
+	uint64_t expiration_ms;		/* 0 if no expiration */
+	const char *body;
+	size_t body_len;
+};
+
+struct capture;
+struct capture_reader;
+
+struct capture *capture_new(const char *path);
+void capture_free(struct capture *capture);
+int capture_write(struct capture *capture, struct capture_record *record);
+
+struct capture_reader *capture_reader_new(const char *path);
+void capture_reader_free(struct capture_reader *reader);
+uint64_t capture_reader_get_start(struct capture_reader *reader);
+int capture_reader_next(struct capture_reader *reader,
+			struct capture_record *record);
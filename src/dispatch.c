@@ -0,0 +1,274 @@
+/**
+ * This file is part of the KNOT Project
+ *
+ * Copyright (c) 2019, CESAR. All rights reserved.
+ *
+ *  This library is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU Lesser General Public
+ *  License as published by the Free Software Foundation; either
+ *  version 2.1 of the License, or (at your option) any later version.
+ *
+ *  This library is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Lesser General Public License for more details.
+ */
+
+/**
+ *  Worker pool dispatcher source file
+ *
+ *  Jobs are hash-partitioned by key over the workers, each one owning a FIFO
+ *  queue, so jobs sharing a key are processed in the order they were pushed
+ *  while different keys run in parallel. Processed jobs are handed back to
+ *  the main loop through an eventfd.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/eventfd.h>
+#include <ell/ell.h>
+
+#include "dispatch.h"
+
+struct dispatch_worker {
+	struct dispatch *dispatch;
+	pthread_t thread;
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	struct l_queue *jobs;
+	bool quit;
+};
+
+struct dispatch {
+	struct dispatch_worker *workers;
+	unsigned int num_workers;
+	dispatch_work_cb_t work_cb;
+	dispatch_done_cb_t done_cb;
+	void *user_data;
+	pthread_mutex_t done_lock;
+	struct l_queue *done;
+	struct l_io *done_io;
+};
+
+static void dispatch_flush_done(struct dispatch *dispatch)
+{
+	struct l_queue *done;
+	void *job;
+
+	pthread_mutex_lock(&dispatch->done_lock);
+	done = dispatch->done;
+	dispatch->done = l_queue_new();
+	pthread_mutex_unlock(&dispatch->done_lock);
+
+	for (job = l_queue_pop_head(done); job; job = l_queue_pop_head(done))
+		dispatch->done_cb(job, dispatch->user_data);
+
+	l_queue_destroy(done, NULL);
+}
+
+static bool on_done_notify(struct l_io *io, void *user_data)
+{
+	struct dispatch *dispatch = user_data;
+	uint64_t count;
+
+	if (read(l_io_get_fd(io), &count, sizeof(count)) < 0)
+		return true;
+
+	dispatch_flush_done(dispatch);
+
+	return true;
+}
+
+static void *worker_thread(void *data)
+{
+	struct dispatch_worker *worker = data;
+	struct dispatch *dispatch = worker->dispatch;
+	uint64_t notify = 1;
+	void *job;
+
+	pthread_mutex_lock(&worker->lock);
+
+	while (true) {
+		job = l_queue_pop_head(worker->jobs);
+		if (!job) {
+			if (worker->quit)
+				break;
+
+			pthread_cond_wait(&worker->cond, &worker->lock);
+			continue;
+		}
+
+		pthread_mutex_unlock(&worker->lock);
+
+		dispatch->work_cb(job, dispatch->user_data);
+
+		pthread_mutex_lock(&dispatch->done_lock);
+		l_queue_push_tail(dispatch->done, job);
+		pthread_mutex_unlock(&dispatch->done_lock);
+
+		if (write(l_io_get_fd(dispatch->done_io), &notify,
+			  sizeof(notify)) < 0)
+			l_error("Error on notify processed job");
+
+		pthread_mutex_lock(&worker->lock);
+	}
+
+	pthread_mutex_unlock(&worker->lock);
+
+	return NULL;
+}
+
+static void stop_workers(struct dispatch *dispatch, unsigned int count)
+{
+	struct dispatch_worker *worker;
+	unsigned int i;
+
+	for (i = 0; i < count; i++) {
+		worker = &dispatch->workers[i];
+
+		pthread_mutex_lock(&worker->lock);
+		worker->quit = true;
+		pthread_cond_signal(&worker->cond);
+		pthread_mutex_unlock(&worker->lock);
+
+		pthread_join(worker->thread, NULL);
+
+		pthread_cond_destroy(&worker->cond);
+		pthread_mutex_destroy(&worker->lock);
+		l_queue_destroy(worker->jobs, NULL);
+	}
+}
+
+/**
+ * dispatch_new:
+ * @num_workers: number of worker threads
+ * @work_cb: callback to process a job on a worker thread
+ * @done_cb: callback called on the main loop after the job is processed
+ * @user_data: user data provided to callbacks
+ *
+ * Starts a pool of @num_workers threads.
+ *
+ * Returns: the dispatcher or NULL otherwise.
+ */
+struct dispatch *dispatch_new(unsigned int num_workers,
+			      dispatch_work_cb_t work_cb,
+			      dispatch_done_cb_t done_cb,
+			      void *user_data)
+{
+	struct dispatch *dispatch;
+	struct dispatch_worker *worker;
+	unsigned int i;
+	int fd;
+
+	if (!num_workers || !work_cb || !done_cb)
+		return NULL;
+
+	fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+	if (fd < 0) {
+		l_error("Error on create dispatcher eventfd");
+		return NULL;
+	}
+
+	dispatch = l_new(struct dispatch, 1);
+	dispatch->num_workers = num_workers;
+	dispatch->work_cb = work_cb;
+	dispatch->done_cb = done_cb;
+	dispatch->user_data = user_data;
+	dispatch->done = l_queue_new();
+	pthread_mutex_init(&dispatch->done_lock, NULL);
+
+	dispatch->done_io = l_io_new(fd);
+	l_io_set_close_on_destroy(dispatch->done_io, true);
+	if (!l_io_set_read_handler(dispatch->done_io, on_done_notify,
+				   dispatch, NULL)) {
+		l_error("Error on set up dispatcher read handler");
+		goto fail;
+	}
+
+	dispatch->workers = l_new(struct dispatch_worker, num_workers);
+
+	for (i = 0; i < num_workers; i++) {
+		worker = &dispatch->workers[i];
+		worker->dispatch = dispatch;
+		worker->jobs = l_queue_new();
+		pthread_mutex_init(&worker->lock, NULL);
+		pthread_cond_init(&worker->cond, NULL);
+
+		if (pthread_create(&worker->thread, NULL, worker_thread,
+				   worker)) {
+			l_error("Error on start dispatcher worker");
+			pthread_cond_destroy(&worker->cond);
+			pthread_mutex_destroy(&worker->lock);
+			l_queue_destroy(worker->jobs, NULL);
+			stop_workers(dispatch, i);
+			goto fail;
+		}
+	}
+
+	return dispatch;
+
+fail:
+	l_io_destroy(dispatch->done_io);
+	l_queue_destroy(dispatch->done, NULL);
+	pthread_mutex_destroy(&dispatch->done_lock);
+	l_free(dispatch->workers);
+	l_free(dispatch);
+	return NULL;
+}
+
+/**
+ * dispatch_free:
+ * @dispatch: dispatcher to be freed
+ *
+ * Waits for the workers to process every pending job, completes them on the
+ * calling thread and stops the pool.
+ */
+void dispatch_free(struct dispatch *dispatch)
+{
+	if (!dispatch)
+		return;
+
+	stop_workers(dispatch, dispatch->num_workers);
+	dispatch_flush_done(dispatch);
+
+	l_io_destroy(dispatch->done_io);
+	l_queue_destroy(dispatch->done, NULL);
+	pthread_mutex_destroy(&dispatch->done_lock);
+	l_free(dispatch->workers);
+	l_free(dispatch);
+}
+
+/**
+ * dispatch_push:
+ * @dispatch: dispatcher
+ * @key: ordering key, jobs with the same key are processed in order
+ * @job: job to be processed
+ *
+ * Queues @job on the worker owning @key.
+ *
+ * Returns: true if successful and false otherwise.
+ */
+bool dispatch_push(struct dispatch *dispatch, const char *key, void *job)
+{
+	struct dispatch_worker *worker;
+	bool queued;
+
+	worker = &dispatch->workers[l_str_hash(key) % dispatch->num_workers];
+
+	pthread_mutex_lock(&worker->lock);
+	queued = l_queue_push_tail(worker->jobs, job);
+	pthread_cond_signal(&worker->cond);
+	pthread_mutex_unlock(&worker->lock);
+
+	return queued;
+}
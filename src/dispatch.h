@@ -0,0 +1,33 @@
+/**
+ * This file is part of the KNOT Project
+ *
+ * Copyright (c) 2019, CESAR. All rights reserved.
+ *
+ *  This library is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU Lesser General Public
+ *  License as published by the Free Software Foundation; either
+ *  version 2.1 of the License, or (at your option) any later version.
+ *
+ *  This library is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Lesser General Public License for more details.
+ */
+
+/**
+ *  Worker pool dispatcher header file
+ */
+
+/* Called on a worker thread */
+typedef void (*dispatch_work_cb_t) (void *job, void *user_data);
+/* Called on the main loop once the job has been processed */
+typedef void (*dispatch_done_cb_t) (void *job, void *user_data);
+
+struct dispatch;
+
+struct dispatch *dispatch_new(unsigned int num_workers,
+			      dispatch_work_cb_t work_cb,
+			      dispatch_done_cb_t done_cb,
+			      void *user_data);
+void dispatch_free(struct dispatch *dispatch);
+bool dispatch_push(struct dispatch *dispatch, const char *key, void *job);
@@ -27,39 +27,44 @@
 #define _GNU_SOURCE
 #endif
 
+#include <errno.h>
 #include <stdbool.h>
 #include <stdint.h>
+#include <inttypes.h>
 #include <stdio.h>
+#include <string.h>
 #include <ell/ell.h>
 #include <json-c/json.h>
 #include <amqp.h>
 
 #include <knot/knot_protocol.h>
 
+#include "alloc.h"
+#include "arena.h"
+#include "dispatch.h"
+#include "log.h"
+#include "stats.h"
+#include "tls.h"
 #include "mq.h"
 #include "parser.h"
+#include "rpc.h"
 #include "knot_cloud.h"
-
-#define MQ_QUEUE_FOG_OUT "thingd-fogOut"
-#define MQ_QUEUE_REPLY "thingd-reply"
-
-/* Exchanges */
-#define MQ_EXCHANGE_DEVICE "device"
-#define MQ_EXCHANGE_DATA_SENT "data.sent"
+#include "knot_cloud_internal.h"
 
 /* Headers */
 #define MQ_AUTHORIZATION_HEADER "Authorization"
 
 #define MQ_MSG_EXPIRATION_TIME_MS 2000
 
- /* Southbound traffic (commands) */
-#define MQ_EVENT_PREFIX_DEVICE "device"
-#define MQ_EVENT_POSTFIX_DATA_UPDATE "data.update"
-#define MQ_EVENT_POSTFIX_DATA_REQUEST "data.request"
+/* Time to wait for the replies of a bulk request */
+#define KNOT_CLOUD_BULK_TIMEOUT_MS 30000
 
-#define MQ_EVENT_DEVICE_REGISTERED "device.registered"
-#define MQ_EVENT_DEVICE_UNREGISTERED "device.unregistered"
-#define MQ_EVENT_DEVICE_SCHEMA_UPDATED "device.schema.updated"
+/*
+ * Schema cache file group, followed by the hash of the cloud, and delay to
+ * write changes to it
+ */
+#define KNOT_CLOUD_SCHEMA_CACHE_GROUP "Schema"
+#define KNOT_CLOUD_SCHEMA_CACHE_SAVE_MS 1000
 
  /* Northbound traffic (control, measurements) */
 #define MQ_CMD_DEVICE_REGISTER "device.register"
@@ -67,52 +72,141 @@
 #define MQ_CMD_DEVICE_AUTH "device.auth"
 #define MQ_CMD_SCHEMA_SENT "device.schema.sent"
 
-knot_cloud_cb_t knot_cloud_cb;
-amqp_bytes_t queue_reply;
-amqp_bytes_t queue_fog;
-char *user_auth_token;
-char *knot_cloud_events[MSG_TYPES_LENGTH];
-amqp_table_entry_t headers[1];
+struct knot_cloud {
+	struct mq_context *mq;
+	knot_cloud_cb_t read_cb;
+	void *read_data;
+	amqp_bytes_t queue_reply;
+	/* Reply queue or direct reply-to pseudo queue used on auth */
+	amqp_bytes_t reply_to;
+	bool direct_reply;
+	amqp_bytes_t queue_fog;
+	char *user_auth_token;
+	/* Routing key to message type (plus one) of every event consumed */
+	struct l_hashmap *routes;
+	amqp_table_entry_t headers[1];
+	json_tokener *tokener;
+	struct dispatch *dispatcher;
+	knot_cloud_state_cb_t state_cb;
+	void *state_data;
+	/* Bulk requests waiting for replies */
+	struct l_queue *bulks;
+	/* Requests waiting for a reply matched by correlation id */
+	struct rpc *rpc;
+	/* Thing id of the queues set up by knot_cloud_read_start() */
+	char *session_id;
+	/* Devices authenticated on the cloud, kept across reconnections */
+	struct l_hashmap *authenticated;
+	/* Hash of the last schema acknowledged by the cloud per device */
+	struct l_settings *schema_cache;
+	char *schema_cache_path;
+	/* Group of the cloud started, a cache file can be shared by many */
+	char *schema_cache_group;
+	struct l_timeout *schema_cache_save;
+	/* Hash of the schema sent per device, until the cloud replies */
+	struct l_hashmap *schema_sent;
+	/* Devices whose schema update is completed from the cache */
+	struct l_queue *schema_cached;
+	struct l_idle *schema_cached_idle;
+	/* Durations in microseconds, see knot_cloud_session_get_stats() */
+	struct stats_histogram serialize;
+	struct stats_histogram parse;
+	struct stats_histogram callback;
+	/* Messages received and not settled yet */
+	unsigned int pending_msgs;
+	/* Deferred messages returned by their handler and not completed yet */
+	struct l_queue *deferred;
+	struct l_timeout *stats_timeout;
+	unsigned int stats_interval_ms;
+	knot_cloud_stats_cb_t stats_cb;
+	void *stats_data;
+};
+
+/* Requests published at once and completed when every reply is received */
+struct knot_cloud_bulk {
+	struct knot_cloud *cloud;
+	int msg_type;
+	struct knot_cloud_bulk_result *results;
+	size_t count;
+	size_t pending;
+	/* Device id to its result, for the replies not received yet */
+	struct l_hashmap *pending_ids;
+	struct l_timeout *timeout;
+	knot_cloud_bulk_cb_t cb;
+	void *user_data;
+};
+
+/* Instance used by the API without an explicit handle */
+static struct knot_cloud *default_cloud;
+
+/*
+ * Received message kept alive, in its delivery arena, while it is handled by
+ * a worker thread or until the application completes a deferred message.
+ */
+struct knot_cloud_msg_token {
+	struct knot_cloud_msg msg; /* Must be the first member */
+	json_object *jso;
+	struct mq_delivery delivery;
+	/* Cleared when the session stops before the message is completed */
+	struct knot_cloud *cloud;
+	void *user_data;
+	/* Read handler duration, measured on the worker thread */
+	uint64_t callback_us;
+	bool consumed;
+	bool in_flight;
+	bool deferred;
+	bool completed;
+	bool complete_ok;
+};
 
+/*
+ * The message and its list items live in the delivery arena, only the list
+ * itself needs to be released here.
+ */
 static void knot_cloud_msg_destroy(struct knot_cloud_msg *msg)
 {
 	if (msg->type == UPDATE_MSG || msg->type == REQUEST_MSG)
-		l_queue_destroy(msg->list, l_free);
-
-	l_free(msg);
+		l_queue_destroy(msg->list, NULL);
 }
 
-static int map_routing_key_to_msg_type(const char *routing_key)
+static int map_routing_key_to_msg_type(struct knot_cloud *cloud,
+				       const char *routing_key)
 {
-	int msg_type;
+	void *route = l_hashmap_lookup(cloud->routes, routing_key);
 
-	for (msg_type = UPDATE_MSG; msg_type < MSG_TYPES_LENGTH; msg_type++) {
-		if (!strcmp(routing_key, knot_cloud_events[msg_type]))
-			return msg_type;
-	}
+	/* Only auth replies are sent to the direct reply-to pseudo queue */
+	if (!strncmp(routing_key, MQ_DIRECT_REPLY_TO,
+		     strlen(MQ_DIRECT_REPLY_TO)))
+		return AUTH_MSG;
+
+	if (!route)
+		return -1;
 
-	return -1;
+	return L_PTR_TO_INT(route) - 1;
 }
 
-static struct knot_cloud_msg *create_msg(const char *routing_key,
-					 json_object *jso)
+static struct knot_cloud_msg *create_msg(struct knot_cloud *cloud,
+					 const char *routing_key,
+					 json_object *jso,
+					 struct arena *arena)
 {
-	struct knot_cloud_msg *msg = l_new(struct knot_cloud_msg, 1);
+	struct knot_cloud_msg_token *token = arena_alloc(arena, sizeof(*token));
+	struct knot_cloud_msg *msg = &token->msg;
 
-	msg->type = map_routing_key_to_msg_type(routing_key);
+	msg->type = map_routing_key_to_msg_type(cloud, routing_key);
 
 	switch (msg->type) {
 	case UPDATE_MSG:
 		msg->error = NULL;
 		msg->device_id = parser_get_key_str_from_json_obj(jso, "id");
 		if (!msg->device_id) {
-			l_error("Malformed JSON message");
+			log_error_ratelimit("Malformed JSON message");
 			goto err;
 		}
 
-		msg->list = parser_update_to_list(jso);
+		msg->list = parser_update_to_list(jso, arena);
 		if (!msg->list) {
-			l_error("Malformed JSON message");
+			log_error_ratelimit("Malformed JSON message");
 			goto err;
 		}
 
@@ -121,13 +215,13 @@ static struct knot_cloud_msg *create_msg(const char *routing_key,
 		msg->error = NULL;
 		msg->device_id = parser_get_key_str_from_json_obj(jso, "id");
 		if (!msg->device_id) {
-			l_error("Malformed JSON message");
+			log_error_ratelimit("Malformed JSON message");
 			goto err;
 		}
 
-		msg->list = parser_request_to_list(jso);
+		msg->list = parser_request_to_list(jso, arena);
 		if (!msg->list) {
-			l_error("Malformed JSON message");
+			log_error_ratelimit("Malformed JSON message");
 			goto err;
 		}
 
@@ -136,13 +230,13 @@ static struct knot_cloud_msg *create_msg(const char *routing_key,
 		msg->device_id = parser_get_key_str_from_json_obj(jso, "id");
 		if (!msg->device_id ||
 				!parser_is_key_str_or_null(jso, "error")) {
-			l_error("Malformed JSON message");
+			log_error_ratelimit("Malformed JSON message");
 			goto err;
 		}
 
 		msg->token = parser_get_key_str_from_json_obj(jso, "token");
 		if (!msg->token) {
-			l_error("Malformed JSON message");
+			log_error_ratelimit("Malformed JSON message");
 			goto err;
 		}
 
@@ -152,7 +246,7 @@ static struct knot_cloud_msg *create_msg(const char *routing_key,
 		msg->device_id = parser_get_key_str_from_json_obj(jso, "id");
 		if (!msg->device_id ||
 				!parser_is_key_str_or_null(jso, "error")) {
-			l_error("Malformed JSON message");
+			log_error_ratelimit("Malformed JSON message");
 			goto err;
 		}
 
@@ -162,7 +256,7 @@ static struct knot_cloud_msg *create_msg(const char *routing_key,
 		msg->device_id = parser_get_key_str_from_json_obj(jso, "id");
 		if (!msg->device_id ||
 				!parser_is_key_str_or_null(jso, "error")) {
-			l_error("Malformed JSON message");
+			log_error_ratelimit("Malformed JSON message");
 			goto err;
 		}
 
@@ -172,7 +266,7 @@ static struct knot_cloud_msg *create_msg(const char *routing_key,
 		msg->device_id = parser_get_key_str_from_json_obj(jso, "id");
 		if (!msg->device_id ||
 				!parser_is_key_str_or_null(jso, "error")) {
-			l_error("Malformed JSON message");
+			log_error_ratelimit("Malformed JSON message");
 			goto err;
 		}
 
@@ -190,62 +284,552 @@ err:
 	return NULL;
 }
 
+/*
+ * Acknowledges the message according to the handler result and releases it,
+ * including the token itself which lives in the delivery arena.
+ */
+static void msg_token_finish(struct knot_cloud_msg_token *token)
+{
+	struct knot_cloud *cloud = token->cloud;
+	bool consumed = token->deferred ? token->complete_ok : token->consumed;
+
+	if (!consumed)
+		log_trace("Message from %s not consumed", token->msg.device_id);
+
+	/* Messages completed from the schema cache have no delivery */
+	if (token->jso) {
+		mq_settle(cloud->mq, &token->delivery,
+			  consumed ? MQ_READ_ACK : MQ_READ_REQUEUE);
+		cloud->pending_msgs--;
+	}
+
+	if (token->deferred)
+		l_queue_remove(cloud->deferred, token);
+
+	knot_cloud_msg_destroy(&token->msg);
+	json_object_put(token->jso);
+	mq_arena_release(cloud->mq, token->delivery.arena);
+}
+
+/*
+ * Queues again the deferred messages not completed when the session stops.
+ * The tokens are detached from the session and only released by a late
+ * knot_cloud_msg_complete(), which doesn't reach the session anymore.
+ */
+static void msg_tokens_detach(struct knot_cloud *cloud)
+{
+	struct knot_cloud_msg_token *token;
+
+	while ((token = l_queue_pop_head(cloud->deferred))) {
+		if (token->jso) {
+			mq_settle(cloud->mq, &token->delivery,
+				  MQ_READ_REQUEUE);
+			cloud->pending_msgs--;
+		}
+
+		token->cloud = NULL;
+	}
+}
+
+static void msg_token_release_detached(struct knot_cloud_msg_token *token)
+{
+	struct arena *arena = token->delivery.arena;
+
+	knot_cloud_msg_destroy(&token->msg);
+	json_object_put(token->jso);
+
+	if (arena_unref(arena))
+		arena_free(arena);
+}
+
+/*
+ * Called on the main loop once the read handler returned. Deferred messages
+ * are kept until knot_cloud_msg_complete() is called.
+ */
+static void msg_token_handled(struct knot_cloud_msg_token *token)
+{
+	token->in_flight = false;
+
+	if (token->deferred && !token->completed) {
+		l_queue_push_tail(token->cloud->deferred, token);
+		return;
+	}
+
+	msg_token_finish(token);
+}
+
+static void bulk_free(struct knot_cloud_bulk *bulk)
+{
+	size_t i;
+
+	for (i = 0; i < bulk->count; i++) {
+		l_free((char *) bulk->results[i].id);
+		l_free((char *) bulk->results[i].token);
+		l_free((char *) bulk->results[i].error);
+	}
+
+	l_timeout_remove(bulk->timeout);
+	l_hashmap_destroy(bulk->pending_ids, NULL);
+	l_free(bulk->results);
+	l_free(bulk);
+}
+
+static void bulk_set_pending_status(const void *key, void *value,
+				    void *user_data)
+{
+	struct knot_cloud_bulk_result *result = value;
+
+	result->status = L_PTR_TO_INT(user_data);
+}
+
+/* Devices without a reply yet are completed with @status */
+static void bulk_complete(struct knot_cloud_bulk *bulk, int status)
+{
+	l_queue_remove(bulk->cloud->bulks, bulk);
+
+	l_hashmap_foreach(bulk->pending_ids, bulk_set_pending_status,
+			  L_INT_TO_PTR(status));
+
+	if (bulk->cb)
+		bulk->cb(bulk->results, bulk->count, bulk->user_data);
+
+	bulk_free(bulk);
+}
+
+static void on_bulk_timeout(struct l_timeout *timeout, void *user_data)
+{
+	struct knot_cloud_bulk *bulk = user_data;
+
+	if (bulk->pending)
+		l_error("Bulk request: %zu replies not received",
+			bulk->pending);
+
+	bulk_complete(bulk, -ETIMEDOUT);
+}
+
+static bool bulk_match(const void *data, const void *user_data)
+{
+	const struct knot_cloud_bulk *bulk = data;
+	const struct knot_cloud_msg *msg = user_data;
+
+	return (int) msg->type == bulk->msg_type &&
+		l_hashmap_lookup(bulk->pending_ids, msg->device_id);
+}
+
+/*
+ * Replies to a bulk request are stored on its results instead of being
+ * handed to the read handler.
+ *
+ * Returns true if @msg was consumed by a bulk request.
+ */
+static bool bulk_consume(struct knot_cloud *cloud,
+			 const struct knot_cloud_msg *msg)
+{
+	struct knot_cloud_bulk *bulk;
+	struct knot_cloud_bulk_result *result;
+
+	bulk = l_queue_find(cloud->bulks, bulk_match, msg);
+	if (!bulk)
+		return false;
+
+	result = l_hashmap_remove(bulk->pending_ids, msg->device_id);
+	result->status = msg->error ? KNOT_ERR_CLOUD_FAILURE : 0;
+	result->error = l_strdup(msg->error);
+	if (msg->type == REGISTER_MSG)
+		result->token = l_strdup(msg->token);
+
+	if (--bulk->pending == 0)
+		bulk_complete(bulk, 0);
+
+	return true;
+}
+
+static void track_authenticated(struct knot_cloud *cloud,
+				const struct knot_cloud_msg *msg)
+{
+	if (msg->type == AUTH_MSG && !msg->error) {
+		if (!cloud->authenticated)
+			cloud->authenticated = l_hashmap_string_new();
+
+		l_hashmap_insert(cloud->authenticated, msg->device_id,
+				 L_UINT_TO_PTR(1));
+	} else if (msg->type == UNREGISTER_MSG && !msg->error) {
+		l_hashmap_remove(cloud->authenticated, msg->device_id);
+	}
+}
+
+static void schema_cache_write(struct knot_cloud *cloud)
+{
+	char *data;
+	char *tmp_path;
+	size_t len;
+	FILE *fp;
+	bool ok;
+
+	if (!cloud->schema_cache_path)
+		return;
+
+	data = l_settings_to_data(cloud->schema_cache, &len);
+	if (!data)
+		return;
+
+	/* Replaced at once, a crash doesn't leave a truncated cache */
+	tmp_path = l_strdup_printf("%s.tmp", cloud->schema_cache_path);
+
+	fp = fopen(tmp_path, "w");
+	if (!fp) {
+		l_error("Error on write schema cache %s", tmp_path);
+		goto done;
+	}
+
+	ok = fwrite(data, 1, len, fp) == len;
+	ok = !fclose(fp) && ok;
+
+	if (!ok || rename(tmp_path, cloud->schema_cache_path) < 0) {
+		l_error("Error on write schema cache %s",
+			cloud->schema_cache_path);
+		remove(tmp_path);
+	}
+
+done:
+	l_free(tmp_path);
+	l_free(data);
+}
+
+static void on_schema_cache_save(struct l_timeout *timeout, void *user_data)
+{
+	struct knot_cloud *cloud = user_data;
+
+	l_timeout_remove(cloud->schema_cache_save);
+	cloud->schema_cache_save = NULL;
+
+	schema_cache_write(cloud);
+}
+
+/* Changes are written together, many schemas are acknowledged in bursts */
+static void schema_cache_changed(struct knot_cloud *cloud)
+{
+	if (!cloud->schema_cache_path || cloud->schema_cache_save)
+		return;
+
+	cloud->schema_cache_save = l_timeout_create_ms(
+					KNOT_CLOUD_SCHEMA_CACHE_SAVE_MS,
+					on_schema_cache_save, cloud, NULL);
+}
+
+static void schema_cache_flush(struct knot_cloud *cloud)
+{
+	if (!cloud->schema_cache_save)
+		return;
+
+	l_timeout_remove(cloud->schema_cache_save);
+	cloud->schema_cache_save = NULL;
+
+	schema_cache_write(cloud);
+}
+
+static const char *schema_cache_group(struct knot_cloud *cloud)
+{
+	return cloud->schema_cache_group ? : KNOT_CLOUD_SCHEMA_CACHE_GROUP;
+}
+
+static bool schema_cache_match(struct knot_cloud *cloud, const char *id,
+			       const char *hash)
+{
+	char *cached;
+	bool match;
+
+	if (!cloud->schema_cache)
+		return false;
+
+	cached = l_settings_get_string(cloud->schema_cache,
+				       schema_cache_group(cloud), id);
+	match = cached && !strcmp(cached, hash);
+	l_free(cached);
+
+	return match;
+}
+
+static void schema_sent_set(struct knot_cloud *cloud, const char *id,
+			    const char *hash)
+{
+	void *old = NULL;
+
+	if (!cloud->schema_sent)
+		cloud->schema_sent = l_hashmap_string_new();
+
+	l_hashmap_replace(cloud->schema_sent, id, l_strdup(hash), &old);
+	l_free(old);
+}
+
+/*
+ * Stores the hash of the schema sent once the cloud acknowledges it. The
+ * cloud drops the schema of an unregistered device, so does the cache.
+ */
+static void track_schema(struct knot_cloud *cloud,
+			 const struct knot_cloud_msg *msg)
+{
+	char *hash;
+
+	if (msg->type == UNREGISTER_MSG && !msg->error) {
+		l_free(l_hashmap_remove(cloud->schema_sent, msg->device_id));
+
+		if (cloud->schema_cache &&
+				l_settings_remove_key(cloud->schema_cache,
+						      schema_cache_group(cloud),
+						      msg->device_id))
+			schema_cache_changed(cloud);
+
+		return;
+	}
+
+	if (msg->type != SCHEMA_MSG)
+		return;
+
+	hash = l_hashmap_remove(cloud->schema_sent, msg->device_id);
+	if (!hash)
+		return;
+
+	if (!cloud->schema_cache) {
+		l_free(hash);
+		return;
+	}
+
+	if (!msg->error)
+		l_settings_set_string(cloud->schema_cache,
+				      schema_cache_group(cloud),
+				      msg->device_id, hash);
+	else
+		l_settings_remove_key(cloud->schema_cache,
+				      schema_cache_group(cloud),
+				      msg->device_id);
+
+	schema_cache_changed(cloud);
+	l_free(hash);
+}
+
+/*
+ * Completes a schema update from the cache as if the cloud had replied, in
+ * a message without delivery living in its own arena.
+ */
+static void deliver_cached_schema(struct knot_cloud *cloud, const char *id)
+{
+	struct arena *arena = arena_new(0);
+	struct knot_cloud_msg_token *token = arena_alloc(arena,
+							 sizeof(*token));
+
+	token->msg.type = SCHEMA_MSG;
+	token->msg.device_id = arena_strndup(arena, id, strlen(id));
+	token->msg.error = NULL;
+	token->delivery.arena = arena;
+	token->cloud = cloud;
+	token->user_data = cloud->read_data;
+	token->in_flight = true;
+
+	if (bulk_consume(cloud, &token->msg) || !cloud->read_cb) {
+		mq_arena_release(cloud->mq, arena);
+		return;
+	}
+
+	token->consumed = cloud->read_cb(&token->msg, cloud->read_data);
+	msg_token_handled(token);
+}
+
+static void on_schema_cached_idle(struct l_idle *idle, void *user_data)
+{
+	struct knot_cloud *cloud = user_data;
+	char *id;
+
+	l_idle_remove(cloud->schema_cached_idle);
+	cloud->schema_cached_idle = NULL;
+
+	while ((id = l_queue_pop_head(cloud->schema_cached))) {
+		deliver_cached_schema(cloud, id);
+		l_free(id);
+	}
+}
+
+static void schema_cached_push(struct knot_cloud *cloud, const char *id)
+{
+	if (!cloud->schema_cached)
+		cloud->schema_cached = l_queue_new();
+
+	l_queue_push_tail(cloud->schema_cached, l_strdup(id));
+
+	if (!cloud->schema_cached_idle)
+		cloud->schema_cached_idle = l_idle_create(
+						on_schema_cached_idle,
+						cloud, NULL);
+}
+
+/* Runs on a worker thread */
+static void on_job_work(void *data, void *user_data)
+{
+	struct knot_cloud_msg_token *token = data;
+	uint64_t start = l_time_now();
+
+	alloc_site_enter(ALLOC_SITE_READ_HANDLER);
+	token->consumed = token->cloud->read_cb(&token->msg,
+						token->user_data);
+	alloc_site_leave();
+	token->callback_us = l_time_now() - start;
+}
+
+/* Runs on the main loop once the handler returned */
+static void on_job_done(void *data, void *user_data)
+{
+	struct knot_cloud_msg_token *token = data;
+
+	stats_histogram_add(&token->cloud->callback, token->callback_us);
+	msg_token_handled(token);
+}
+
+static enum alloc_site msg_alloc_site(const struct knot_cloud_msg *msg)
+{
+	switch (msg->type) {
+	case UPDATE_MSG:
+		return ALLOC_SITE_RECEIVE_UPDATE;
+	case REQUEST_MSG:
+		return ALLOC_SITE_RECEIVE_REQUEST;
+	case REGISTER_MSG:
+	case UNREGISTER_MSG:
+	case AUTH_MSG:
+	case SCHEMA_MSG:
+	case MSG_TYPES_LENGTH:
+	default:
+		return ALLOC_SITE_RECEIVE_EVENT;
+	}
+}
+
 /**
  * Callback function to consume and parse the received message from AMQP queue
- * and call the respective handling callback function. In case of a error on
- * parse, the message is consumed, but not used.
+ * and call the respective handling callback function, inline or on a worker
+ * thread. In case of a error on parse, the message is consumed, but not used.
  *
- * Returns true if the message envelope was consumed or returns false otherwise.
+ * Returns the result of the message handling or MQ_READ_PENDING if the
+ * message is still being handled.
  */
-static bool on_amqp_receive_message(const char *exchange,
-				    const char *routing_key,
-				    const char *body, void *user_data)
+static enum mq_read_result on_amqp_receive_message(
+					const struct mq_delivery *delivery,
+					void *user_data)
 {
+	struct knot_cloud *cloud = user_data;
+	struct knot_cloud_msg_token *token;
 	struct knot_cloud_msg *msg;
-	bool consumed = true;
 	json_object *jso;
+	uint64_t start = l_time_now();
+
+	/* The tokener is kept across messages to avoid allocating one each */
+	if (!cloud->tokener)
+		cloud->tokener = json_tokener_new();
+	else
+		json_tokener_reset(cloud->tokener);
 
-	jso = json_tokener_parse(body);
+	jso = json_tokener_parse_ex(cloud->tokener, delivery->body,
+				    strlen(delivery->body));
 	if (!jso) {
-		l_error("Error on parse JSON object");
-		return false;
+		log_error_ratelimit("Error on parse JSON object");
+		return MQ_READ_REJECT;
+	}
+
+	msg = create_msg(cloud, delivery->routing_key, jso, delivery->arena);
+	stats_histogram_add(&cloud->parse, l_time_now() - start);
+
+	if (!msg) {
+		rpc_complete(cloud->rpc, delivery->correlation_id, NULL,
+			     -EBADMSG);
+		json_object_put(jso);
+		return MQ_READ_ACK;
+	}
+
+	msg->lag_us = delivery->lag_us;
+	alloc_site_set(msg_alloc_site(msg));
+
+	track_authenticated(cloud, msg);
+	track_schema(cloud, msg);
+
+	/* Replies to an asynchronous request go to its own callback */
+	if (rpc_complete(cloud->rpc, delivery->correlation_id, msg, 0)) {
+		knot_cloud_msg_destroy(msg);
+		json_object_put(jso);
+		return MQ_READ_ACK;
 	}
 
-	msg = create_msg(routing_key, jso);
-	if (msg) {
-		consumed = knot_cloud_cb(msg, user_data);
+	if (bulk_consume(cloud, msg)) {
 		knot_cloud_msg_destroy(msg);
+		json_object_put(jso);
+		return MQ_READ_ACK;
+	}
+
+	/* The message now owns the JSON object and a reference to its arena */
+	token = (struct knot_cloud_msg_token *) msg;
+	token->jso = jso;
+	token->delivery = *delivery;
+	token->cloud = cloud;
+	token->user_data = cloud->read_data;
+	token->in_flight = true;
+	arena_ref(delivery->arena);
+	cloud->pending_msgs++;
+
+	/* Messages of the same device are handled in order by one worker */
+	if (cloud->dispatcher) {
+		if (dispatch_push(cloud->dispatcher, msg->device_id, token))
+			return MQ_READ_PENDING;
+
+		l_error("Error on dispatch message, handling it inline");
 	}
 
-	json_object_put(jso);
+	start = l_time_now();
+	alloc_site_enter(ALLOC_SITE_READ_HANDLER);
+	token->consumed = cloud->read_cb(msg, cloud->read_data);
+	alloc_site_leave();
+	stats_histogram_add(&cloud->callback, l_time_now() - start);
+
+	msg_token_handled(token);
+
+	/* Settled by msg_token_finish() */
+	return MQ_READ_PENDING;
+}
+
+struct bind_route_data {
+	struct knot_cloud *cloud;
+	int err;
+};
+
+static void bind_route(const void *key, void *value, void *user_data)
+{
+	struct bind_route_data *data = user_data;
+
+	if (data->err)
+		return;
 
-	return consumed;
+	data->err = mq_prepare_direct_queue(data->cloud->mq,
+					    data->cloud->queue_fog,
+					    MQ_EXCHANGE_DEVICE, key);
 }
-static int create_fog_queue(const char *id)
+
+static int create_fog_queue(struct knot_cloud *cloud, const char *id)
 {
 	char queue_fog_name[100];
-	int msg_type;
+	struct bind_route_data data = { .cloud = cloud };
 	int err;
 
 	snprintf(queue_fog_name, sizeof(queue_fog_name), "%s-%s",
 		 MQ_QUEUE_FOG_OUT, id);
 
-	queue_fog = mq_declare_new_queue(queue_fog_name);
-	if (queue_fog.bytes == NULL) {
+	cloud->queue_fog = mq_declare_new_queue(cloud->mq, queue_fog_name);
+	if (cloud->queue_fog.bytes == NULL) {
 		l_error("Error on declare a new queue");
 		return -1;
 	}
 
-	for (msg_type = UPDATE_MSG; msg_type < MSG_TYPES_LENGTH; msg_type++) {
-		err = mq_prepare_direct_queue(queue_fog, MQ_EXCHANGE_DEVICE,
-					      knot_cloud_events[msg_type]);
-		if (err) {
-			l_error("Error on set up queue to consume");
-			return -1;
-		}
+	l_hashmap_foreach(cloud->routes, bind_route, &data);
+	if (data.err) {
+		l_error("Error on set up queue to consume");
+		return -1;
 	}
 
-	err = mq_consumer_queue(queue_fog);
+	err = mq_consumer_queue(cloud->mq, cloud->queue_fog);
 	if (err) {
 		l_error("Error on start a queue consumer");
 		return -1;
@@ -254,116 +838,143 @@ static int create_fog_queue(const char *id)
 	return 0;
 }
 
-static int create_reply_queue(const char *id)
+static int create_reply_queue(struct knot_cloud *cloud, const char *id)
 {
 	char queue_reply_name[100];
 
+	if (cloud->direct_reply) {
+		if (mq_consume_direct_reply(cloud->mq)) {
+			l_error("Error on start direct reply-to consumer");
+			return -1;
+		}
+
+		cloud->reply_to = amqp_cstring_bytes(MQ_DIRECT_REPLY_TO);
+		return 0;
+	}
+
 	snprintf(queue_reply_name, sizeof(queue_reply_name), "%s-%s",
 		 MQ_QUEUE_REPLY, id);
 
-	queue_reply = mq_declare_new_queue(queue_reply_name);
-	if (queue_reply.bytes == NULL) {
+	cloud->queue_reply = mq_declare_new_queue(cloud->mq,
+						  queue_reply_name);
+	if (cloud->queue_reply.bytes == NULL) {
 		l_error("Error on declare a new queue");
 		return -1;
 	}
 
-	if (mq_consumer_queue(queue_reply)) {
+	if (mq_consumer_queue(cloud->mq, cloud->queue_reply)) {
 		l_error("Error on start a queue consumer");
 		return -1;
 	}
 
+	cloud->reply_to = cloud->queue_reply;
+
 	return 0;
 }
 
-static void destroy_knot_cloud_queues(void)
+static void destroy_knot_cloud_queues(struct knot_cloud *cloud)
 {
-	if (queue_reply.bytes) {
-		if (mq_delete_queue(queue_reply))
+	cloud->reply_to = amqp_empty_bytes;
+
+	if (cloud->queue_reply.bytes) {
+		if (mq_delete_queue(cloud->mq, cloud->queue_reply))
 			l_error("Error when delete Reply Queue");
 
-		amqp_bytes_free(queue_reply);
-		queue_reply = amqp_empty_bytes;
+		amqp_bytes_free(cloud->queue_reply);
+		cloud->queue_reply = amqp_empty_bytes;
 	}
 
-	if (queue_fog.bytes) {
-		if (mq_delete_queue(queue_fog))
+	if (cloud->queue_fog.bytes) {
+		if (mq_delete_queue(cloud->mq, cloud->queue_fog))
 			l_error("Error when delete Fog Queue");
 
-		amqp_bytes_free(queue_fog);
-		queue_fog = amqp_empty_bytes;
+		amqp_bytes_free(cloud->queue_fog);
+		cloud->queue_fog = amqp_empty_bytes;
 	}
 }
 
-static void destroy_knot_cloud_events(void)
+static void destroy_knot_cloud_events(struct knot_cloud *cloud)
 {
-	int msg_type;
+	l_hashmap_destroy(cloud->routes, NULL);
+	cloud->routes = NULL;
+}
 
-	for (msg_type = UPDATE_MSG; msg_type < MSG_TYPES_LENGTH; msg_type++) {
-		if (knot_cloud_events[msg_type] != NULL) {
-			l_free(knot_cloud_events[msg_type]);
-			knot_cloud_events[msg_type] = NULL;
-		}
-	}
+static void add_route(struct knot_cloud *cloud, const char *routing_key,
+		      int msg_type)
+{
+	l_hashmap_insert(cloud->routes, routing_key,
+			 L_INT_TO_PTR(msg_type + 1));
 }
 
-static int set_knot_cloud_events(const char *id)
+/*
+ * Events not related to a single device, they are bound once to the fog
+ * queue shared by every device.
+ */
+static int set_knot_cloud_events(struct knot_cloud *cloud, const char *id)
 {
 	char binding_key_reply[100];
-	char binding_key_update[100];
-	char binding_key_request[100];
 
 	snprintf(binding_key_reply, sizeof(binding_key_reply), "%s-%s",
 		 MQ_QUEUE_REPLY, id);
 
-	snprintf(binding_key_update, sizeof(binding_key_update), "%s.%s.%s",
-		 MQ_EVENT_PREFIX_DEVICE, id, MQ_EVENT_POSTFIX_DATA_UPDATE);
+	/* Free routes if already allocated */
+	destroy_knot_cloud_events(cloud);
 
-	snprintf(binding_key_request, sizeof(binding_key_request), "%s.%s.%s",
-		 MQ_EVENT_PREFIX_DEVICE, id, MQ_EVENT_POSTFIX_DATA_REQUEST);
+	cloud->routes = l_hashmap_string_new();
 
-	/* Free knot_cloud_events if already allocated */
-	destroy_knot_cloud_events();
-
-	knot_cloud_events[UPDATE_MSG] =
-				l_strdup(binding_key_update);
-	knot_cloud_events[REQUEST_MSG] =
-				l_strdup(binding_key_request);
-	knot_cloud_events[REGISTER_MSG] =
-				l_strdup(MQ_EVENT_DEVICE_REGISTERED);
-	knot_cloud_events[UNREGISTER_MSG] =
-				l_strdup(MQ_EVENT_DEVICE_UNREGISTERED);
-	knot_cloud_events[AUTH_MSG] =
-				l_strdup(binding_key_reply);
-	knot_cloud_events[SCHEMA_MSG] =
-				l_strdup(MQ_EVENT_DEVICE_SCHEMA_UPDATED);
+	add_route(cloud, MQ_EVENT_DEVICE_REGISTERED, REGISTER_MSG);
+	add_route(cloud, MQ_EVENT_DEVICE_UNREGISTERED, UNREGISTER_MSG);
+	add_route(cloud, binding_key_reply, AUTH_MSG);
+	add_route(cloud, MQ_EVENT_DEVICE_SCHEMA_UPDATED, SCHEMA_MSG);
 
 	return 0;
 }
 
+static void device_binding_keys(const char *id, char *update_key,
+				char *request_key, size_t len)
+{
+	snprintf(update_key, len, "%s.%s.%s",
+		 MQ_EVENT_PREFIX_DEVICE, id, MQ_EVENT_POSTFIX_DATA_UPDATE);
+
+	snprintf(request_key, len, "%s.%s.%s",
+		 MQ_EVENT_PREFIX_DEVICE, id, MQ_EVENT_POSTFIX_DATA_REQUEST);
+}
+
 /**
- * knot_cloud_register_device:
+ * knot_cloud_session_register_device:
+ * @cloud: cloud instance
  * @id: device id
  * @name: device name
  *
  * Requests cloud to add a device.
  * The confirmation that the cloud received the message comes from a callback
- * set in function knot_cloud_read_start with message type REGISTER_MSG.
+ * set in function knot_cloud_session_read_start with message type
+ * REGISTER_MSG.
  *
  * Returns: 0 if successful and a KNoT error otherwise.
  */
-int knot_cloud_register_device(const char *id, const char *name)
+int knot_cloud_session_register_device(struct knot_cloud *cloud,
+				       const char *id, const char *name)
 {
 	json_object *jobj_device;
+	uint64_t start;
 	const char *json_str;
 	int result;
 
+	alloc_site_enter(ALLOC_SITE_REGISTER);
+
+	start = l_time_now();
 	jobj_device = parser_device_json_create(id, name);
-	if (!jobj_device)
+	if (!jobj_device) {
+		alloc_site_leave();
 		return KNOT_ERR_CLOUD_FAILURE;
+	}
 
 	json_str = json_object_to_json_string(jobj_device);
+	stats_histogram_add(&cloud->serialize, l_time_now() - start);
 
-	headers[0].value.value.bytes = amqp_cstring_bytes(user_auth_token);
+	cloud->headers[0].value.value.bytes =
+				amqp_cstring_bytes(cloud->user_auth_token);
 
 	/**
 	 * Exchange
@@ -376,42 +987,54 @@ int knot_cloud_register_device(const char *id, const char *name)
 	 * Expiration
 	 *	2000 ms
 	 */
-	result = mq_publish_direct_message(MQ_EXCHANGE_DEVICE,
+	result = mq_publish_direct_message(cloud->mq, MQ_EXCHANGE_DEVICE,
 					   MQ_CMD_DEVICE_REGISTER,
-					   headers, 1,
+					   cloud->headers, 1,
 					   MQ_MSG_EXPIRATION_TIME_MS,
 					   json_str);
 	if (result < 0)
 		result = KNOT_ERR_CLOUD_FAILURE;
 
 	json_object_put(jobj_device);
+	alloc_site_leave();
 
 	return result;
 }
 
 /**
- * knot_cloud_unregister_device:
+ * knot_cloud_session_unregister_device:
+ * @cloud: cloud instance
  * @id: device id
  *
  * Requests cloud to remove a device.
  * The confirmation that the cloud received the message comes from a callback
- * set in function knot_cloud_read_start  with message type UNREGISTER_MSG.
+ * set in function knot_cloud_session_read_start with message type
+ * UNREGISTER_MSG.
  *
  * Returns: 0 if successful and a KNoT error otherwise.
  */
-int knot_cloud_unregister_device(const char *id)
+int knot_cloud_session_unregister_device(struct knot_cloud *cloud,
+					 const char *id)
 {
 	json_object *jobj_unreg;
+	uint64_t start;
 	const char *json_str;
 	int result;
 
+	alloc_site_enter(ALLOC_SITE_UNREGISTER);
+
+	start = l_time_now();
 	jobj_unreg = parser_unregister_json_create(id);
-	if (!jobj_unreg)
+	if (!jobj_unreg) {
+		alloc_site_leave();
 		return KNOT_ERR_CLOUD_FAILURE;
+	}
 
 	json_str = json_object_to_json_string(jobj_unreg);
+	stats_histogram_add(&cloud->serialize, l_time_now() - start);
 
-	headers[0].value.value.bytes = amqp_cstring_bytes(user_auth_token);
+	cloud->headers[0].value.value.bytes =
+				amqp_cstring_bytes(cloud->user_auth_token);
 
 	/**
 	 * Exchange
@@ -424,48 +1047,47 @@ int knot_cloud_unregister_device(const char *id)
 	 * Expiration
 	 *	2000 ms
 	 */
-	result = mq_publish_direct_message(MQ_EXCHANGE_DEVICE,
+	result = mq_publish_direct_message(cloud->mq, MQ_EXCHANGE_DEVICE,
 					   MQ_CMD_DEVICE_UNREGISTER,
-					   headers, 1,
+					   cloud->headers, 1,
 					   MQ_MSG_EXPIRATION_TIME_MS,
 					   json_str);
 	if (result < 0)
-		return KNOT_ERR_CLOUD_FAILURE;
+		result = KNOT_ERR_CLOUD_FAILURE;
 
 	json_object_put(jobj_unreg);
+	alloc_site_leave();
 
-	return 0;
+	return result;
 }
 
-/**
- * knot_cloud_auth_device:
- * @id: device id
- * @token: device token
- *
- * Requests cloud to auth a device.
- * The confirmation that the cloud received the message comes from a callback
- * set in function knot_cloud_read_start.
- *
- * Returns: 0 if successful and a KNoT error otherwise.
- */
-int knot_cloud_auth_device(const char *id, const char *token)
+static int auth_device_publish(struct knot_cloud *cloud, const char *id,
+			       const char *token, const char *correlation_id)
 {
 	json_object *jobj_auth;
+	uint64_t start;
 	const char *json_str;
 	int result;
 
-	if (!queue_reply.bytes) {
+	if (!cloud->reply_to.bytes) {
 		l_error("Reply queue not declared");
 		return KNOT_ERR_CLOUD_FAILURE;
 	}
 
+	alloc_site_enter(ALLOC_SITE_AUTH);
+
+	start = l_time_now();
 	jobj_auth = parser_auth_json_create(id, token);
-	if (!jobj_auth)
+	if (!jobj_auth) {
+		alloc_site_leave();
 		return KNOT_ERR_CLOUD_FAILURE;
+	}
 
 	json_str = json_object_to_json_string(jobj_auth);
+	stats_histogram_add(&cloud->serialize, l_time_now() - start);
 
-	headers[0].value.value.bytes = amqp_cstring_bytes(user_auth_token);
+	cloud->headers[0].value.value.bytes =
+				amqp_cstring_bytes(cloud->user_auth_token);
 
 	/**
 	 * Exchange
@@ -478,42 +1100,152 @@ int knot_cloud_auth_device(const char *id, const char *token)
 	 * Expiration
 	 *	2000 ms
 	 */
-	result = mq_publish_direct_message_rpc(MQ_EXCHANGE_DEVICE,
+	result = mq_publish_direct_message_rpc(cloud->mq, MQ_EXCHANGE_DEVICE,
 					       MQ_CMD_DEVICE_AUTH,
-					       headers, 1,
+					       cloud->headers, 1,
 					       MQ_MSG_EXPIRATION_TIME_MS,
-					       queue_reply, id,
-					       json_str);
+					       cloud->reply_to,
+					       correlation_id, json_str);
 	if (result < 0)
 		result = KNOT_ERR_CLOUD_FAILURE;
 
 	json_object_put(jobj_auth);
+	alloc_site_leave();
 
 	return result;
 }
 
 /**
- * knot_cloud_update_schema:
+ * knot_cloud_session_auth_device:
+ * @cloud: cloud instance
+ * @id: device id
+ * @token: device token
  *
- * Requests cloud to update the device schema.
+ * Requests cloud to auth a device.
  * The confirmation that the cloud received the message comes from a callback
- * set in function knot_cloud_read_start with message type SCHEMA_MSG.
+ * set in function knot_cloud_session_read_start.
  *
  * Returns: 0 if successful and a KNoT error otherwise.
  */
-int knot_cloud_update_schema(const char *id, struct l_queue *schema_list)
+int knot_cloud_session_auth_device(struct knot_cloud *cloud, const char *id,
+				   const char *token)
 {
-	json_object *jobj_schema;
-	const char *json_str;
-	int result;
+	return auth_device_publish(cloud, id, token, id);
+}
 
-	jobj_schema = parser_schema_create_object(id, schema_list);
-	if (!jobj_schema)
+struct reply_request {
+	knot_cloud_reply_cb_t reply_cb;
+	void *user_data;
+};
+
+static void on_reply_complete(const void *reply, int err, void *user_data)
+{
+	struct reply_request *request = user_data;
+
+	if (request->reply_cb)
+		request->reply_cb(reply, err, request->user_data);
+
+	l_free(request);
+}
+
+/**
+ * knot_cloud_session_auth_device_async:
+ * @cloud: cloud instance
+ * @id: device id
+ * @token: device token
+ * @timeout_ms: time to wait for the reply
+ * @reply_cb: callback called once with the reply
+ * @user_data: user data provided to @reply_cb
+ *
+ * Requests cloud to auth a device, like knot_cloud_session_auth_device(),
+ * but the reply is matched to this request by a unique correlation id and
+ * delivered to @reply_cb instead of the read handler. Many requests, even
+ * for the same device, can be waiting for their replies at the same time.
+ * The message is only valid while @reply_cb runs. @reply_cb gets a NULL
+ * message and -ETIMEDOUT if no reply arrives within @timeout_ms, -ECANCELED
+ * if the instance is stopped or -EBADMSG if the reply is malformed.
+ *
+ * Returns: 0 if successful and a KNoT error otherwise, in which case
+ * @reply_cb is not called.
+ */
+int knot_cloud_session_auth_device_async(struct knot_cloud *cloud,
+					 const char *id, const char *token,
+					 unsigned int timeout_ms,
+					 knot_cloud_reply_cb_t reply_cb,
+					 void *user_data)
+{
+	struct reply_request *request;
+	const char *correlation_id;
+	int result;
+
+	if (!reply_cb)
 		return KNOT_ERR_CLOUD_FAILURE;
 
+	request = l_new(struct reply_request, 1);
+	request->reply_cb = reply_cb;
+	request->user_data = user_data;
+
+	correlation_id = rpc_add(cloud->rpc, timeout_ms, on_reply_complete,
+				 request);
+
+	result = auth_device_publish(cloud, id, token, correlation_id);
+	if (result) {
+		/* Not sent, released without calling back */
+		request->reply_cb = NULL;
+		rpc_complete(cloud->rpc, correlation_id, NULL, result);
+	}
+
+	return result;
+}
+
+/**
+ * knot_cloud_session_update_schema:
+ * @cloud: cloud instance
+ *
+ * Requests cloud to update the device schema.
+ * The confirmation that the cloud received the message comes from a callback
+ * set in function knot_cloud_session_read_start with message type
+ * SCHEMA_MSG. When the schema cache is enabled and the cloud already
+ * acknowledged the same schema, the confirmation comes from the cache
+ * without sending anything.
+ *
+ * Returns: 0 if successful and a KNoT error otherwise.
+ */
+int knot_cloud_session_update_schema(struct knot_cloud *cloud, const char *id,
+				     struct l_queue *schema_list)
+{
+	json_object *jobj_schema;
+	uint64_t start;
+	const char *json_str;
+	char hash[17];
+	int result;
+
+	/* Only hashed to be compared with the cache */
+	if (cloud->schema_cache) {
+		snprintf(hash, sizeof(hash), "%016" PRIx64,
+			 parser_schema_hash(schema_list));
+
+		if (schema_cache_match(cloud, id, hash)) {
+			l_debug("Schema of %s not changed", id);
+			schema_cached_push(cloud, id);
+			return 0;
+		}
+	}
+
+	alloc_site_enter(ALLOC_SITE_SCHEMA_CREATE);
+
+	start = l_time_now();
+	jobj_schema = parser_schema_create_object(id, schema_list);
+	if (!jobj_schema) {
+		alloc_site_leave();
+		return KNOT_ERR_CLOUD_FAILURE;
+	}
+
 	json_str = json_object_to_json_string(jobj_schema);
+	stats_histogram_add(&cloud->serialize, l_time_now() - start);
 
-	headers[0].value.value.bytes = amqp_cstring_bytes(user_auth_token);
+	cloud->headers[0].value.value.bytes =
+				amqp_cstring_bytes(cloud->user_auth_token);
 
 	/**
 	 * Exchange
@@ -526,21 +1258,25 @@ int knot_cloud_update_schema(const char *id, struct l_queue *schema_list)
 	 * Expiration
 	 *	2000 ms
 	 */
-	result = mq_publish_direct_message(MQ_EXCHANGE_DEVICE,
+	result = mq_publish_direct_message(cloud->mq, MQ_EXCHANGE_DEVICE,
 					   MQ_CMD_SCHEMA_SENT,
-					   headers, 1,
+					   cloud->headers, 1,
 					   MQ_MSG_EXPIRATION_TIME_MS,
 					   json_str);
 	if (result < 0)
 		result = KNOT_ERR_CLOUD_FAILURE;
+	else if (cloud->schema_cache)
+		schema_sent_set(cloud, id, hash);
 
 	json_object_put(jobj_schema);
+	alloc_site_leave();
 
 	return result;
 }
 
 /**
- * knot_cloud_publish_data:
+ * knot_cloud_session_publish_data:
+ * @cloud: cloud instance
  * @id: device id
  * @sensor_id: schema sensor id
  * @value_type: schema value type defined in KNoT protocol
@@ -551,22 +1287,31 @@ int knot_cloud_update_schema(const char *id, struct l_queue *schema_list)
  *
  * Returns: 0 if successful and a KNoT error otherwise.
  */
-int knot_cloud_publish_data(const char *id, uint8_t sensor_id,
-			    uint8_t value_type, const knot_value_type *value,
-			    uint8_t kval_len)
+int knot_cloud_session_publish_data(struct knot_cloud *cloud, const char *id,
+				    uint8_t sensor_id, uint8_t value_type,
+				    const knot_value_type *value,
+				    uint8_t kval_len)
 {
 	json_object *jobj_data;
+	uint64_t start;
 	const char *json_str;
 	int result;
 
+	alloc_site_enter(ALLOC_SITE_PUBLISH_DATA);
+
+	start = l_time_now();
 	jobj_data = parser_data_create_object(id, sensor_id, value_type, value,
 					      kval_len);
-	if (!jobj_data)
+	if (!jobj_data) {
+		alloc_site_leave();
 		return KNOT_ERR_CLOUD_FAILURE;
+	}
 
 	json_str = json_object_to_json_string(jobj_data);
+	stats_histogram_add(&cloud->serialize, l_time_now() - start);
 
-	headers[0].value.value.bytes = amqp_cstring_bytes(user_auth_token);
+	cloud->headers[0].value.value.bytes =
+				amqp_cstring_bytes(cloud->user_auth_token);
 
 	/**
 	 * Exchange
@@ -577,46 +1322,306 @@ int knot_cloud_publish_data(const char *id, uint8_t sensor_id,
 	 * Expiration
 	 *	2000 ms
 	 */
-	result = mq_publish_fanout_message(MQ_EXCHANGE_DATA_SENT,
-					   headers, 1,
+	result = mq_publish_fanout_message(cloud->mq, MQ_EXCHANGE_DATA_SENT,
+					   cloud->headers, 1,
 					   MQ_MSG_EXPIRATION_TIME_MS,
 					   json_str);
 	if (result < 0)
 		result = KNOT_ERR_CLOUD_FAILURE;
 
 	json_object_put(jobj_data);
+	alloc_site_leave();
 
 	return result;
 }
 
+typedef int (*bulk_publish_t)(struct knot_cloud *cloud,
+			      const struct knot_cloud_device_info *device);
+
+static int bulk_publish_register(struct knot_cloud *cloud,
+				 const struct knot_cloud_device_info *device)
+{
+	return knot_cloud_session_register_device(cloud, device->id,
+						  device->name);
+}
+
+static int bulk_publish_auth(struct knot_cloud *cloud,
+			     const struct knot_cloud_device_info *device)
+{
+	return knot_cloud_session_auth_device(cloud, device->id,
+					      device->token);
+}
+
+static int bulk_publish_schema(struct knot_cloud *cloud,
+			       const struct knot_cloud_device_info *device)
+{
+	return knot_cloud_session_update_schema(cloud, device->id,
+						device->schema_list);
+}
+
+/*
+ * Every request is published without waiting for the replies, which are
+ * matched by device id as they arrive.
+ */
+static int bulk_start(struct knot_cloud *cloud, int msg_type,
+		      bulk_publish_t publish,
+		      const struct knot_cloud_device_info *devices,
+		      size_t count, knot_cloud_bulk_cb_t bulk_cb,
+		      void *user_data)
+{
+	struct knot_cloud_bulk *bulk;
+	struct knot_cloud_bulk_result *result;
+	size_t i;
+
+	if (!devices && count)
+		return -1;
+
+	bulk = l_new(struct knot_cloud_bulk, 1);
+	bulk->cloud = cloud;
+	bulk->msg_type = msg_type;
+	bulk->results = l_new(struct knot_cloud_bulk_result, count);
+	bulk->count = count;
+	bulk->pending_ids = l_hashmap_string_new();
+	bulk->cb = bulk_cb;
+	bulk->user_data = user_data;
+
+	for (i = 0; i < count; i++) {
+		result = &bulk->results[i];
+		result->id = l_strdup(devices[i].id);
+
+		if (!result->id ||
+			l_hashmap_lookup(bulk->pending_ids, result->id)) {
+			l_error("Bulk request: invalid or duplicated device");
+			result->status = -EINVAL;
+			continue;
+		}
+
+		result->status = publish(cloud, &devices[i]);
+		if (result->status)
+			continue;
+
+		l_hashmap_insert(bulk->pending_ids, result->id, result);
+		bulk->pending++;
+	}
+
+	if (!cloud->bulks)
+		cloud->bulks = l_queue_new();
+
+	l_queue_push_tail(cloud->bulks, bulk);
+
+	/*
+	 * Completed from the main loop even if nothing was published. Zero
+	 * disables an ell timeout, so the shortest one is used instead.
+	 */
+	bulk->timeout = l_timeout_create_ms(bulk->pending ?
+					    KNOT_CLOUD_BULK_TIMEOUT_MS : 1,
+					    on_bulk_timeout, bulk, NULL);
+
+	return 0;
+}
+
+/**
+ * knot_cloud_session_bulk_register:
+ * @cloud: cloud instance
+ * @devices: devices to register, @id and @name are used
+ * @count: number of devices
+ * @bulk_cb: callback called once every device is completed
+ * @user_data: user data provided to @bulk_cb
+ *
+ * Requests cloud to add many devices at once. The requests are published
+ * back to back and the replies are collected into one result per device,
+ * in the order of @devices, instead of being delivered to the read handler.
+ * Devices without a reply after a while are completed with -ETIMEDOUT.
+ *
+ * Returns: 0 if successful and -1 otherwise.
+ */
+int knot_cloud_session_bulk_register(struct knot_cloud *cloud,
+				const struct knot_cloud_device_info *devices,
+				size_t count, knot_cloud_bulk_cb_t bulk_cb,
+				void *user_data)
+{
+	return bulk_start(cloud, REGISTER_MSG, bulk_publish_register,
+			  devices, count, bulk_cb, user_data);
+}
+
+/**
+ * knot_cloud_session_bulk_auth:
+ * @cloud: cloud instance
+ * @devices: devices to authenticate, @id and @token are used
+ * @count: number of devices
+ * @bulk_cb: callback called once every device is completed
+ * @user_data: user data provided to @bulk_cb
+ *
+ * Requests cloud to auth many devices at once, see
+ * knot_cloud_session_bulk_register().
+ *
+ * Returns: 0 if successful and -1 otherwise.
+ */
+int knot_cloud_session_bulk_auth(struct knot_cloud *cloud,
+				 const struct knot_cloud_device_info *devices,
+				 size_t count, knot_cloud_bulk_cb_t bulk_cb,
+				 void *user_data)
+{
+	return bulk_start(cloud, AUTH_MSG, bulk_publish_auth, devices, count,
+			  bulk_cb, user_data);
+}
+
 /**
- * knot_cloud_read_start:
+ * knot_cloud_session_bulk_update_schema:
+ * @cloud: cloud instance
+ * @devices: devices to update, @id and @schema_list are used
+ * @count: number of devices
+ * @bulk_cb: callback called once every device is completed
+ * @user_data: user data provided to @bulk_cb
+ *
+ * Requests cloud to update the schema of many devices at once, see
+ * knot_cloud_session_bulk_register().
+ *
+ * Returns: 0 if successful and -1 otherwise.
+ */
+int knot_cloud_session_bulk_update_schema(struct knot_cloud *cloud,
+				const struct knot_cloud_device_info *devices,
+				size_t count, knot_cloud_bulk_cb_t bulk_cb,
+				void *user_data)
+{
+	return bulk_start(cloud, SCHEMA_MSG, bulk_publish_schema, devices,
+			  count, bulk_cb, user_data);
+}
+
+/**
+ * knot_cloud_session_device_add:
+ * @cloud: cloud instance
+ * @id: device id
+ *
+ * Starts consuming the commands sent to the device @id on the queue shared by
+ * every device. Must be called after knot_cloud_read_start(), messages are
+ * received on the same read handler. The bindings are pipelined, so adding
+ * many devices doesn't wait for the broker on each one.
+ *
+ * Returns: 0 if successful and -1 otherwise.
+ */
+int knot_cloud_session_device_add(struct knot_cloud *cloud, const char *id)
+{
+	char update_key[100];
+	char request_key[100];
+
+	if (!cloud->queue_fog.bytes) {
+		l_error("Fog queue not declared");
+		return -1;
+	}
+
+	device_binding_keys(id, update_key, request_key, sizeof(update_key));
+
+	if (l_hashmap_lookup(cloud->routes, update_key))
+		return 0;
+
+	if (mq_prepare_direct_queue(cloud->mq, cloud->queue_fog,
+				    MQ_EXCHANGE_DEVICE, update_key) ||
+			mq_prepare_direct_queue(cloud->mq, cloud->queue_fog,
+						MQ_EXCHANGE_DEVICE,
+						request_key)) {
+		l_error("Error on bind device %s", id);
+		return -1;
+	}
+
+	add_route(cloud, update_key, UPDATE_MSG);
+	add_route(cloud, request_key, REQUEST_MSG);
+
+	return 0;
+}
+
+/**
+ * knot_cloud_session_device_remove:
+ * @cloud: cloud instance
+ * @id: device id
+ *
+ * Stops consuming the commands sent to the device @id. Other devices are not
+ * affected.
+ *
+ * Returns: 0 if successful and -1 otherwise.
+ */
+int knot_cloud_session_device_remove(struct knot_cloud *cloud,
+				     const char *id)
+{
+	char update_key[100];
+	char request_key[100];
+	int err = 0;
+
+	device_binding_keys(id, update_key, request_key, sizeof(update_key));
+
+	if (!l_hashmap_remove(cloud->routes, update_key))
+		return -1;
+
+	l_hashmap_remove(cloud->routes, request_key);
+
+	if (mq_unbind_queue(cloud->mq, cloud->queue_fog, MQ_EXCHANGE_DEVICE,
+			    update_key))
+		err = -1;
+
+	if (mq_unbind_queue(cloud->mq, cloud->queue_fog, MQ_EXCHANGE_DEVICE,
+			    request_key))
+		err = -1;
+
+	if (err)
+		l_error("Error on unbind device %s", id);
+
+	return err;
+}
+
+/**
+ * knot_cloud_session_read_start:
+ * @cloud: cloud instance
  * @id: thing id
  * @read_handler_cb: callback to handle message received from cloud
  * @user_data: user data provided to callbacks
  *
- * Start Cloud to receive messages on read_handler_cb function.
+ * Start Cloud to receive messages on read_handler_cb function. More devices
+ * can be added to the same queue with knot_cloud_session_device_add().
+ * The queues and bindings are restored by the SDK when the connection is
+ * lost, calling it again with the same @id only replaces the handler.
  *
  * Returns: 0 if successful and -1 otherwise.
  */
-int knot_cloud_read_start(const char *id, knot_cloud_cb_t read_handler_cb,
-			  void *user_data)
+int knot_cloud_session_read_start(struct knot_cloud *cloud, const char *id,
+				  knot_cloud_cb_t read_handler_cb,
+				  void *user_data)
 {
-	knot_cloud_cb = read_handler_cb;
+	cloud->read_cb = read_handler_cb;
+	cloud->read_data = user_data;
+
+	/*
+	 * Queues of the same thing are restored on reconnection, deleting
+	 * them would drop the commands not delivered yet.
+	 */
+	if (cloud->session_id && !strcmp(cloud->session_id, id) &&
+			cloud->queue_fog.bytes && cloud->reply_to.bytes)
+		goto done;
 
 	/* Delete queues if already declared */
-	destroy_knot_cloud_queues();
+	destroy_knot_cloud_queues(cloud);
+	l_free(cloud->session_id);
+	cloud->session_id = NULL;
+
+	if (set_knot_cloud_events(cloud, id))
+		return -1;
 
-	if (set_knot_cloud_events(id))
+	if (create_fog_queue(cloud, id))
 		return -1;
 
-	if (create_fog_queue(id))
+	if (knot_cloud_session_device_add(cloud, id))
 		return -1;
 
-	if (create_reply_queue(id))
+	if (create_reply_queue(cloud, id))
 		return -1;
 
-	if (mq_set_read_cb(on_amqp_receive_message, user_data)) {
+	/* Everything above was pipelined, wait for the broker once */
+	if (mq_sync(cloud->mq))
+		return -1;
+
+	cloud->session_id = l_strdup(id);
+
+done:
+	if (mq_set_read_cb(cloud->mq, on_amqp_receive_message, cloud)) {
 		l_error("Error on set up read callback");
 		return -1;
 	}
@@ -624,23 +1629,820 @@ int knot_cloud_read_start(const char *id, knot_cloud_cb_t read_handler_cb,
 	return 0;
 }
 
+/**
+ * knot_cloud_session_start:
+ * @cloud: cloud instance
+ * @url: AMQP broker url, or a comma separated list of broker urls
+ * @user_token: token used to authorize the messages sent to cloud
+ * @connected_cb: callback called when the connection is up
+ * @disconnected_cb: callback called when the connection is lost
+ * @user_data: user data provided to callbacks
+ *
+ * Starts connecting @cloud to the broker. Each instance owns its connection,
+ * so instances are independent from each other.
+ *
+ * Given a list, the broker with the lowest connect latency is preferred and
+ * the others are tried right away when it fails.
+ *
+ * Returns: 0 if successful and -1 otherwise.
+ */
+int knot_cloud_session_start(struct knot_cloud *cloud, const char *url,
+			     const char *user_token,
+			     knot_cloud_connected_cb_t connected_cb,
+			     knot_cloud_disconnected_cb_t disconnected_cb,
+			     void *user_data)
+{
+	char *cloud_id;
+
+	l_free(cloud->user_auth_token);
+	cloud->user_auth_token = l_strdup(user_token);
+	cloud->headers[0].value.value.bytes =
+				amqp_cstring_bytes(cloud->user_auth_token);
+
+	/* Schemas cached for another cloud or user aren't known to this one */
+	cloud_id = l_strdup_printf("%s\n%s", url, user_token);
+	l_free(cloud->schema_cache_group);
+	cloud->schema_cache_group = l_strdup_printf("%s %016" PRIx64,
+					KNOT_CLOUD_SCHEMA_CACHE_GROUP,
+					parser_string_hash(cloud_id));
+	l_free(cloud_id);
+
+	return mq_start(cloud->mq, url, connected_cb, disconnected_cb,
+			user_data);
+}
+
+static void on_mq_state(enum mq_state state, uint64_t delay_ms,
+			void *user_data)
+{
+	struct knot_cloud *cloud = user_data;
+	enum knot_cloud_state cloud_state;
+
+	switch (state) {
+	case MQ_STATE_CONNECTING:
+		cloud_state = KNOT_CLOUD_CONNECTING;
+		break;
+	case MQ_STATE_AUTHENTICATING:
+		cloud_state = KNOT_CLOUD_AUTHENTICATING;
+		break;
+	case MQ_STATE_READY:
+		cloud_state = KNOT_CLOUD_READY;
+		break;
+	case MQ_STATE_BACKING_OFF:
+		cloud_state = KNOT_CLOUD_BACKING_OFF;
+		break;
+	case MQ_STATE_DISCONNECTED:
+	default:
+		cloud_state = KNOT_CLOUD_DISCONNECTED;
+		break;
+	}
+
+	if (cloud->state_cb)
+		cloud->state_cb(cloud_state, delay_ms, cloud->state_data);
+}
+
+/**
+ * knot_cloud_session_set_state_cb:
+ * @cloud: cloud instance
+ * @state_cb: callback called when the connection state changes
+ * @user_data: user data provided to @state_cb
+ *
+ * Reports the connection state machine of @cloud. A lost connection is
+ * retried after an exponential backoff with jitter, whose delay is given
+ * to @state_cb along with KNOT_CLOUD_BACKING_OFF.
+ */
+void knot_cloud_session_set_state_cb(struct knot_cloud *cloud,
+				     knot_cloud_state_cb_t state_cb,
+				     void *user_data)
+{
+	cloud->state_cb = state_cb;
+	cloud->state_data = user_data;
+}
+
+/**
+ * knot_cloud_session_set_tls:
+ * @cloud: cloud instance
+ * @config: TLS settings
+ *
+ * Sets the TLS settings used when the broker url is an amqps one. Without
+ * them, the broker certificate is verified against the system CAs. TLS
+ * sessions are resumed on reconnection, avoiding a full handshake each
+ * time. Takes effect on the next connection attempt.
+ */
+void knot_cloud_session_set_tls(struct knot_cloud *cloud,
+				const struct knot_cloud_tls_config *config)
+{
+	struct tls_config tls = {
+		.ca_cert = config->ca_cert,
+		.cert = config->cert,
+		.key = config->key,
+		.ciphers = config->ciphers,
+		.verify_peer = config->verify_peer,
+	};
+
+	mq_set_tls(cloud->mq, &tls);
+}
+
+/**
+ * knot_cloud_session_get_tls_stats:
+ * @cloud: cloud instance
+ * @stats: filled with the TLS handshakes done so far
+ *
+ * Reports the TLS handshakes cost, and how many of them resumed a session.
+ */
+void knot_cloud_session_get_tls_stats(struct knot_cloud *cloud,
+				      struct knot_cloud_tls_stats *stats)
+{
+	struct tls_stats tls;
+
+	mq_get_tls_stats(cloud->mq, &tls);
+
+	stats->handshakes = tls.handshakes;
+	stats->resumed = tls.resumed;
+	stats->last_handshake_us = tls.last_handshake_us;
+	stats->total_handshake_us = tls.total_handshake_us;
+}
+
+static void copy_histogram(struct knot_cloud_histogram *dst,
+			   const struct stats_histogram *src)
+{
+	dst->count = src->count;
+	dst->sum_us = src->sum;
+	dst->max_us = src->max;
+	memcpy(dst->buckets, src->buckets, sizeof(dst->buckets));
+}
+
+static void bulk_add_pending(void *data, void *user_data)
+{
+	struct knot_cloud_bulk *bulk = data;
+	unsigned int *pending = user_data;
+
+	*pending += bulk->pending;
+}
+
+/**
+ * knot_cloud_session_get_stats:
+ * @cloud: cloud instance
+ * @stats: filled with the counters and histograms of @cloud
+ *
+ * Counters are kept since @cloud was created, across reconnections.
+ */
+void knot_cloud_session_get_stats(struct knot_cloud *cloud,
+				  struct knot_cloud_stats *stats)
+{
+	struct mq_stats mq;
+	struct tls_stats tls;
+
+	mq_get_stats(cloud->mq, &mq);
+	mq_get_tls_stats(cloud->mq, &tls);
+
+	memset(stats, 0, sizeof(*stats));
+	stats->publish_calls = mq.publish_calls;
+	stats->publish_errors = mq.publish_errors;
+	stats->bytes_out = mq.bytes_out;
+	stats->messages_in = mq.messages_in;
+	stats->bytes_in = mq.bytes_in;
+	stats->reconnects = mq.reconnects;
+	stats->disconnected_us = mq.disconnected_us;
+	stats->tls_handshakes = tls.handshakes;
+	stats->tls_resumed = tls.resumed;
+
+	stats->pending_messages = cloud->pending_msgs;
+	stats->pending_requests = rpc_pending(cloud->rpc);
+	l_queue_foreach(cloud->bulks, bulk_add_pending,
+			&stats->pending_requests);
+
+	copy_histogram(&stats->serialize, &cloud->serialize);
+	copy_histogram(&stats->publish, &mq.publish);
+	copy_histogram(&stats->parse, &cloud->parse);
+	copy_histogram(&stats->callback, &cloud->callback);
+	copy_histogram(&stats->tls_handshake, &tls.handshake);
+	copy_histogram(&stats->delivery_lag, &mq.delivery_lag);
+}
+
+/**
+ * knot_cloud_session_set_trace:
+ * @cloud: cloud instance
+ * @enable: true to add trace headers to the messages sent
+ *
+ * Messages sent always carry the AMQP timestamp property. Tracing adds the
+ * x-timestamp-us header, the send time in microseconds since the epoch,
+ * and the x-trace-id header, unique per message.
+ *
+ * The lag of the messages received is computed from the same header, or
+ * from the timestamp property with a resolution of a second. It relies on
+ * the clocks of both ends being in sync.
+ */
+void knot_cloud_session_set_trace(struct knot_cloud *cloud, bool enable)
+{
+	mq_set_trace(cloud->mq, enable);
+}
+
+/**
+ * knot_cloud_session_set_capture:
+ * @cloud: cloud instance
+ * @path: capture file, truncated if it exists, or NULL to stop capturing
+ *
+ * Records the messages received and sent by @cloud, with their timing, to
+ * be replayed by knot-cloud-replay. Message bodies are stored as is, device
+ * tokens included, so captures must be kept private. A previous capture is
+ * completed first.
+ *
+ * Returns: 0 if successful and -1 otherwise.
+ */
+int knot_cloud_session_set_capture(struct knot_cloud *cloud, const char *path)
+{
+	return mq_set_capture(cloud->mq, path);
+}
+
+/**
+ * knot_cloud_get_alloc_stats:
+ * @stats: filled with the allocations per message path
+ *
+ * Reports the allocations made on each message path since the start, with
+ * the number of messages, from which the allocations and bytes per message
+ * are derived. Allocations made by ell, json-c and librabbitmq on behalf of
+ * the SDK are counted, those of the read handler are reported apart. The
+ * "other" path counts everything else, including the application.
+ *
+ * Available only when the library is built with --enable-alloc-stats,
+ * which wraps the allocator of the whole process.
+ *
+ * Returns: 0 if successful and -ENOTSUP otherwise.
+ */
+int knot_cloud_get_alloc_stats(struct knot_cloud_alloc_stats *stats)
+{
+#ifdef HAVE_ALLOC_STATS
+	struct alloc_site_stats site_stats;
+	struct knot_cloud_alloc_site *site;
+	unsigned int i;
+
+	memset(stats, 0, sizeof(*stats));
+
+	for (i = 0; i < ALLOC_SITES && i < KNOT_CLOUD_ALLOC_SITES_MAX; i++) {
+		alloc_get_site(i, &site_stats);
+
+		site = &stats->sites[stats->num_sites++];
+		site->name = alloc_site_name(i);
+		site->messages = site_stats.messages;
+		site->allocs = site_stats.allocs;
+		site->bytes = site_stats.bytes;
+	}
+
+	alloc_get_heap(&stats->live_bytes, &stats->peak_bytes);
+
+	return 0;
+#else
+	memset(stats, 0, sizeof(*stats));
+
+	return -ENOTSUP;
+#endif
+}
+
+static void on_stats_timeout(struct l_timeout *timeout, void *user_data)
+{
+	struct knot_cloud *cloud = user_data;
+	struct knot_cloud_stats stats;
+
+	knot_cloud_session_get_stats(cloud, &stats);
+	cloud->stats_cb(&stats, cloud->stats_data);
+
+	l_timeout_modify_ms(timeout, cloud->stats_interval_ms);
+}
+
+/**
+ * knot_cloud_session_set_stats_cb:
+ * @cloud: cloud instance
+ * @interval_ms: time between snapshots
+ * @stats_cb: callback called with a snapshot of the stats, NULL to disable
+ * @user_data: user data provided to @stats_cb
+ *
+ * Reports the stats of @cloud periodically, whether it is started or not.
+ *
+ * Returns: 0 if successful and -EINVAL if @interval_ms is 0.
+ */
+int knot_cloud_session_set_stats_cb(struct knot_cloud *cloud,
+				    unsigned int interval_ms,
+				    knot_cloud_stats_cb_t stats_cb,
+				    void *user_data)
+{
+	l_timeout_remove(cloud->stats_timeout);
+	cloud->stats_timeout = NULL;
+
+	cloud->stats_cb = stats_cb;
+	cloud->stats_data = user_data;
+
+	if (!stats_cb)
+		return 0;
+
+	if (!interval_ms)
+		return -EINVAL;
+
+	cloud->stats_interval_ms = interval_ms;
+	cloud->stats_timeout = l_timeout_create_ms(interval_ms,
+						   on_stats_timeout, cloud,
+						   NULL);
+
+	return 0;
+}
+
+/**
+ * knot_cloud_session_set_msg_arena_retain:
+ * @cloud: cloud instance
+ * @retain: true to keep the received message memory between messages
+ *
+ * Every message received is processed in a per delivery arena released once
+ * the read handler returns. Retaining keeps that memory to serve the next
+ * message, removing malloc/free from the steady-state receive path.
+ */
+void knot_cloud_session_set_msg_arena_retain(struct knot_cloud *cloud,
+					     bool retain)
+{
+	mq_set_arena_retain(cloud->mq, retain);
+}
+
+/**
+ * knot_cloud_msg_defer:
+ * @msg: message received on the read handler
+ *
+ * Defers the completion of @msg. Must be called from the read handler, whose
+ * return value is then ignored. The message, including its content, stays
+ * valid and unacknowledged until knot_cloud_msg_complete() is called with
+ * the returned token. If the session is stopped first, the message is queued
+ * again and the token only releases it.
+ *
+ * Returns: the completion token.
+ */
+struct knot_cloud_msg_token *knot_cloud_msg_defer(
+					const struct knot_cloud_msg *msg)
+{
+	struct knot_cloud_msg_token *token;
+
+	if (!msg)
+		return NULL;
+
+	token = (struct knot_cloud_msg_token *) msg;
+	token->deferred = true;
+
+	return token;
+}
+
+/**
+ * knot_cloud_msg_complete:
+ * @token: token returned by knot_cloud_msg_defer()
+ * @ok: true if the message was consumed and false otherwise
+ *
+ * Completes a deferred message. Consumed messages are acknowledged to the
+ * cloud, otherwise they are queued again once. The message is released and
+ * @token must not be used anymore. Must be called from the main loop, once
+ * per token, even after the session is stopped or released.
+ *
+ * Returns: 0 if successful and -1 otherwise, including when the session was
+ * stopped and the message already queued again.
+ */
+int knot_cloud_msg_complete(struct knot_cloud_msg_token *token, bool ok)
+{
+	if (!token || !token->deferred || token->completed)
+		return -1;
+
+	if (!token->cloud) {
+		msg_token_release_detached(token);
+		return -1;
+	}
+
+	token->completed = true;
+	token->complete_ok = ok;
+
+	/* Finished when the read handler returns */
+	if (token->in_flight)
+		return 0;
+
+	msg_token_finish(token);
+
+	return 0;
+}
+
+/**
+ * knot_cloud_session_is_authenticated:
+ * @cloud: cloud instance
+ * @id: device id
+ *
+ * Devices authenticated stay authenticated when the connection is restored,
+ * there is no need to authenticate them again after a reconnection.
+ *
+ * Returns: true if the cloud replied successfully to the authentication of
+ * @id since the instance was started and false otherwise.
+ */
+bool knot_cloud_session_is_authenticated(struct knot_cloud *cloud,
+					 const char *id)
+{
+	return l_hashmap_lookup(cloud->authenticated, id) != NULL;
+}
+
+/**
+ * knot_cloud_session_set_direct_reply:
+ * @cloud: cloud instance
+ * @enable: true to receive auth replies without a reply queue
+ *
+ * Uses the RabbitMQ direct reply-to pseudo queue for the replies to auth
+ * requests, instead of declaring a durable reply queue per thing. Replies
+ * are then received by a single consumer of the connection. It takes effect
+ * on the next call to knot_cloud_session_read_start().
+ */
+void knot_cloud_session_set_direct_reply(struct knot_cloud *cloud,
+					 bool enable)
+{
+	if (cloud->direct_reply == enable)
+		return;
+
+	cloud->direct_reply = enable;
+
+	/* Queues are set up again by the next read start */
+	l_free(cloud->session_id);
+	cloud->session_id = NULL;
+}
+
+/**
+ * knot_cloud_session_set_schema_cache:
+ * @cloud: cloud instance
+ * @path: file keeping the cache or NULL to keep it only in memory
+ *
+ * Enables the schema cache. The hash of every schema acknowledged by the
+ * cloud is kept per device, so an update with the same schema is completed
+ * right away instead of being sent again. Entries are kept apart per broker
+ * URL and user token, and dropped when the device is unregistered. The cache
+ * file is loaded if it exists and is kept up to date while the instance is
+ * in use.
+ *
+ * Returns: 0 if successful and -1 otherwise.
+ */
+int knot_cloud_session_set_schema_cache(struct knot_cloud *cloud,
+					const char *path)
+{
+	schema_cache_flush(cloud);
+	l_settings_free(cloud->schema_cache);
+	l_free(cloud->schema_cache_path);
+
+	cloud->schema_cache = l_settings_new();
+	cloud->schema_cache_path = l_strdup(path);
+
+	if (path && !l_settings_load_from_file(cloud->schema_cache, path))
+		l_debug("Schema cache %s not loaded, starting empty", path);
+
+	return 0;
+}
+
+/**
+ * knot_cloud_session_set_workers:
+ * @cloud: cloud instance
+ * @num_workers: number of worker threads or 0 to handle messages inline
+ *
+ * Hands received messages over to a pool of worker threads, calling the read
+ * handler from them. Messages of the same device are still handled in the
+ * order they were received, while different devices are handled in
+ * parallel. Changing the number of workers waits for the pending messages.
+ *
+ * The read handler must be thread safe when workers are enabled. The SDK
+ * itself isn't: the handler must not call any SDK function, e.g.
+ * knot_cloud_publish_data() to answer a REQUEST_MSG. Such a handler defers
+ * the message with knot_cloud_msg_defer(), hands it over to the main loop
+ * and answers it there, then completes it with knot_cloud_msg_complete().
+ *
+ * Returns: 0 if successful and -1 otherwise.
+ */
+int knot_cloud_session_set_workers(struct knot_cloud *cloud,
+				   unsigned int num_workers)
+{
+	dispatch_free(cloud->dispatcher);
+	cloud->dispatcher = NULL;
+
+	if (!num_workers)
+		return 0;
+
+	cloud->dispatcher = dispatch_new(num_workers, on_job_work, on_job_done,
+					 cloud);
+	if (!cloud->dispatcher) {
+		l_error("Error on start message workers");
+		return -1;
+	}
+
+	return 0;
+}
+
+/**
+ * knot_cloud_session_stop:
+ * @cloud: cloud instance
+ *
+ * Deletes the queues declared and closes the connection of @cloud. Deferred
+ * messages not completed yet are queued again. The instance can be started
+ * again.
+ */
+void knot_cloud_session_stop(struct knot_cloud *cloud)
+{
+	struct knot_cloud_bulk *bulk;
+
+	dispatch_free(cloud->dispatcher);
+	cloud->dispatcher = NULL;
+
+	/* No handler is running anymore, deferred messages are all queued */
+	msg_tokens_detach(cloud);
+
+	while ((bulk = l_queue_peek_head(cloud->bulks)))
+		bulk_complete(bulk, -ECANCELED);
+
+	rpc_cancel_all(cloud->rpc, -ECANCELED);
+
+	l_queue_destroy(cloud->bulks, NULL);
+	cloud->bulks = NULL;
+
+	destroy_knot_cloud_queues(cloud);
+
+	destroy_knot_cloud_events(cloud);
+	mq_stop(cloud->mq);
+
+	l_free(cloud->session_id);
+	cloud->session_id = NULL;
+	l_hashmap_destroy(cloud->authenticated, NULL);
+	cloud->authenticated = NULL;
+
+	/* The cache itself is kept until the instance is released */
+	l_idle_remove(cloud->schema_cached_idle);
+	cloud->schema_cached_idle = NULL;
+	l_queue_destroy(cloud->schema_cached, l_free);
+	cloud->schema_cached = NULL;
+	l_hashmap_destroy(cloud->schema_sent, l_free);
+	cloud->schema_sent = NULL;
+	schema_cache_flush(cloud);
+
+	if (cloud->tokener) {
+		json_tokener_free(cloud->tokener);
+		cloud->tokener = NULL;
+	}
+}
+
+/*
+ * Internals of a session reached by the benchmarks and tools, see
+ * knot_cloud_internal.h.
+ */
+struct knot_cloud_msg *cloud_internal_create_msg(struct knot_cloud *cloud,
+						 const char *routing_key,
+						 json_object *jso,
+						 struct arena *arena)
+{
+	return create_msg(cloud, routing_key, jso, arena);
+}
+
+void cloud_internal_destroy_msg(struct knot_cloud_msg *msg)
+{
+	knot_cloud_msg_destroy(msg);
+}
+
+/* Routes messages without binding any queue, no connection is needed */
+void cloud_internal_set_routes(struct knot_cloud *cloud,
+			       const char *session_id,
+			       const char *device_id)
+{
+	char update_key[100];
+	char request_key[100];
+
+	set_knot_cloud_events(cloud, session_id);
+
+	device_binding_keys(device_id, update_key, request_key,
+			    sizeof(update_key));
+	add_route(cloud, update_key, UPDATE_MSG);
+	add_route(cloud, request_key, REQUEST_MSG);
+}
+
+struct mq_context *cloud_internal_get_mq(struct knot_cloud *cloud)
+{
+	return cloud->mq;
+}
+
+/* Headers carrying the user token, as sent with every message */
+amqp_table_entry_t *cloud_internal_get_headers(struct knot_cloud *cloud)
+{
+	cloud->headers[0].value.value.bytes =
+				amqp_cstring_bytes(cloud->user_auth_token);
+
+	return cloud->headers;
+}
+
+/**
+ * knot_cloud_session_new:
+ *
+ * Creates an independent cloud instance, with its own connection, queues and
+ * callbacks. Many instances can be used in the same process.
+ *
+ * Returns: the instance created.
+ */
+struct knot_cloud *knot_cloud_session_new(void)
+{
+	struct knot_cloud *cloud = l_new(struct knot_cloud, 1);
+
+	cloud->mq = mq_new();
+	mq_set_state_cb(cloud->mq, on_mq_state, cloud);
+	cloud->rpc = rpc_new();
+	cloud->deferred = l_queue_new();
+	cloud->headers[0].key = amqp_cstring_bytes(MQ_AUTHORIZATION_HEADER);
+	cloud->headers[0].value.kind = AMQP_FIELD_KIND_UTF8;
+
+	return cloud;
+}
+
+/**
+ * knot_cloud_session_free:
+ * @cloud: cloud instance
+ *
+ * Stops and releases @cloud.
+ */
+void knot_cloud_session_free(struct knot_cloud *cloud)
+{
+	if (!cloud)
+		return;
+
+	knot_cloud_session_stop(cloud);
+	l_timeout_remove(cloud->stats_timeout);
+	rpc_free(cloud->rpc);
+	l_queue_destroy(cloud->deferred, NULL);
+	mq_free(cloud->mq);
+	l_settings_free(cloud->schema_cache);
+	l_free(cloud->schema_cache_path);
+	l_free(cloud->schema_cache_group);
+	l_free(cloud->user_auth_token);
+	l_free(cloud);
+}
+
+/*
+ * The API below works on a default instance, created on demand and released
+ * by knot_cloud_stop().
+ */
+static struct knot_cloud *get_default_cloud(void)
+{
+	if (!default_cloud)
+		default_cloud = knot_cloud_session_new();
+
+	return default_cloud;
+}
+
+int knot_cloud_register_device(const char *id, const char *name)
+{
+	return knot_cloud_session_register_device(get_default_cloud(), id,
+						  name);
+}
+
+int knot_cloud_unregister_device(const char *id)
+{
+	return knot_cloud_session_unregister_device(get_default_cloud(), id);
+}
+
+int knot_cloud_auth_device(const char *id, const char *token)
+{
+	return knot_cloud_session_auth_device(get_default_cloud(), id, token);
+}
+
+int knot_cloud_auth_device_async(const char *id, const char *token,
+				 unsigned int timeout_ms,
+				 knot_cloud_reply_cb_t reply_cb,
+				 void *user_data)
+{
+	return knot_cloud_session_auth_device_async(get_default_cloud(), id,
+						    token, timeout_ms,
+						    reply_cb, user_data);
+}
+
+int knot_cloud_update_schema(const char *id, struct l_queue *schema_list)
+{
+	return knot_cloud_session_update_schema(get_default_cloud(), id,
+						schema_list);
+}
+
+int knot_cloud_publish_data(const char *id, uint8_t sensor_id,
+			    uint8_t value_type, const knot_value_type *value,
+			    uint8_t kval_len)
+{
+	return knot_cloud_session_publish_data(get_default_cloud(), id,
+					       sensor_id, value_type, value,
+					       kval_len);
+}
+
+int knot_cloud_bulk_register(const struct knot_cloud_device_info *devices,
+			     size_t count, knot_cloud_bulk_cb_t bulk_cb,
+			     void *user_data)
+{
+	return knot_cloud_session_bulk_register(get_default_cloud(), devices,
+						count, bulk_cb, user_data);
+}
+
+int knot_cloud_bulk_auth(const struct knot_cloud_device_info *devices,
+			 size_t count, knot_cloud_bulk_cb_t bulk_cb,
+			 void *user_data)
+{
+	return knot_cloud_session_bulk_auth(get_default_cloud(), devices,
+					    count, bulk_cb, user_data);
+}
+
+int knot_cloud_bulk_update_schema(const struct knot_cloud_device_info *devices,
+				  size_t count, knot_cloud_bulk_cb_t bulk_cb,
+				  void *user_data)
+{
+	return knot_cloud_session_bulk_update_schema(get_default_cloud(),
+						     devices, count, bulk_cb,
+						     user_data);
+}
+
+int knot_cloud_device_add(const char *id)
+{
+	return knot_cloud_session_device_add(get_default_cloud(), id);
+}
+
+int knot_cloud_device_remove(const char *id)
+{
+	return knot_cloud_session_device_remove(get_default_cloud(), id);
+}
+
+int knot_cloud_read_start(const char *id, knot_cloud_cb_t read_handler_cb,
+			  void *user_data)
+{
+	return knot_cloud_session_read_start(get_default_cloud(), id,
+					     read_handler_cb, user_data);
+}
+
 int knot_cloud_start(char *url, char *user_token,
 		     knot_cloud_connected_cb_t connected_cb,
 		     knot_cloud_disconnected_cb_t disconnected_cb,
 		     void *user_data)
 {
-	user_auth_token = l_strdup(user_token);
-	headers[0].key = amqp_cstring_bytes(MQ_AUTHORIZATION_HEADER);
-	headers[0].value.kind = AMQP_FIELD_KIND_UTF8;
-	headers[0].value.value.bytes = amqp_cstring_bytes(user_token);
+	return knot_cloud_session_start(get_default_cloud(), url, user_token,
+					connected_cb, disconnected_cb,
+					user_data);
+}
 
-	return mq_start(url, connected_cb, disconnected_cb, user_data);
+void knot_cloud_set_state_cb(knot_cloud_state_cb_t state_cb, void *user_data)
+{
+	knot_cloud_session_set_state_cb(get_default_cloud(), state_cb,
+					user_data);
 }
 
-void knot_cloud_stop(void)
+void knot_cloud_set_tls(const struct knot_cloud_tls_config *config)
+{
+	knot_cloud_session_set_tls(get_default_cloud(), config);
+}
+
+void knot_cloud_get_tls_stats(struct knot_cloud_tls_stats *stats)
+{
+	knot_cloud_session_get_tls_stats(get_default_cloud(), stats);
+}
+
+void knot_cloud_get_stats(struct knot_cloud_stats *stats)
+{
+	knot_cloud_session_get_stats(get_default_cloud(), stats);
+}
+
+void knot_cloud_set_trace(bool enable)
+{
+	knot_cloud_session_set_trace(get_default_cloud(), enable);
+}
+
+int knot_cloud_set_capture(const char *path)
 {
-	destroy_knot_cloud_queues();
+	return knot_cloud_session_set_capture(get_default_cloud(), path);
+}
+
+int knot_cloud_set_stats_cb(unsigned int interval_ms,
+			    knot_cloud_stats_cb_t stats_cb, void *user_data)
+{
+	return knot_cloud_session_set_stats_cb(get_default_cloud(),
+					       interval_ms, stats_cb,
+					       user_data);
+}
+
+void knot_cloud_set_msg_arena_retain(bool retain)
+{
+	knot_cloud_session_set_msg_arena_retain(get_default_cloud(), retain);
+}
 
-	destroy_knot_cloud_events();
-	mq_stop();
+bool knot_cloud_is_authenticated(const char *id)
+{
+	return knot_cloud_session_is_authenticated(get_default_cloud(), id);
+}
+
+void knot_cloud_set_direct_reply(bool enable)
+{
+	knot_cloud_session_set_direct_reply(get_default_cloud(), enable);
+}
+
+int knot_cloud_set_schema_cache(const char *path)
+{
+	return knot_cloud_session_set_schema_cache(get_default_cloud(), path);
+}
+
+int knot_cloud_set_workers(unsigned int num_workers)
+{
+	return knot_cloud_session_set_workers(get_default_cloud(),
+					      num_workers);
+}
+
+void knot_cloud_stop(void)
+{
+	knot_cloud_session_free(default_cloud);
+	default_cloud = NULL;
 }
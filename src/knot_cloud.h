@@ -35,24 +35,227 @@ struct knot_cloud_msg {
 		const char *token; // used when type is REGISTER
 		struct l_queue *list; // used when type is UPDATE/REQUEST/LIST
 	};
+	uint64_t lag_us; // time from the sender, 0 if unknown
+};
+
+struct knot_cloud;
+struct knot_cloud_msg_token;
+
+struct knot_cloud_tls_config {
+	const char *ca_cert; // NULL to use the system CAs
+	const char *cert; // client certificate, optional
+	const char *key;
+	const char *ciphers; // OpenSSL cipher list, NULL for default
+	bool verify_peer;
+};
+
+struct knot_cloud_tls_stats {
+	uint64_t handshakes;
+	uint64_t resumed;
+	uint64_t last_handshake_us;
+	uint64_t total_handshake_us;
+};
+
+/*
+ * Durations in microseconds. Bucket 0 counts zeros and bucket i the values
+ * from 2^(i - 1) to 2^i - 1, the last one also counts everything above.
+ */
+#define KNOT_CLOUD_HISTOGRAM_BUCKETS 32
+
+struct knot_cloud_histogram {
+	uint64_t count;
+	uint64_t sum_us;
+	uint64_t max_us;
+	uint64_t buckets[KNOT_CLOUD_HISTOGRAM_BUCKETS];
+};
+
+struct knot_cloud_stats {
+	uint64_t publish_calls;
+	uint64_t publish_errors;
+	uint64_t bytes_out; // message bodies only
+	uint64_t messages_in;
+	uint64_t bytes_in;
+	uint64_t reconnects;
+	uint64_t disconnected_us;
+	uint64_t tls_handshakes;
+	uint64_t tls_resumed;
+	unsigned int pending_messages; // received, not acknowledged yet
+	unsigned int pending_requests; // waiting for a reply
+	struct knot_cloud_histogram serialize; // JSON message creation
+	struct knot_cloud_histogram publish; // amqp_basic_publish()
+	struct knot_cloud_histogram parse; // inbound message parsing
+	struct knot_cloud_histogram callback; // read handler
+	struct knot_cloud_histogram tls_handshake;
+	struct knot_cloud_histogram delivery_lag; // messages stamped only
+};
+
+/* Allocations of a message path, see knot_cloud_get_alloc_stats() */
+struct knot_cloud_alloc_site {
+	const char *name; // e.g. "publish-data" or "receive-update"
+	uint64_t messages;
+	uint64_t allocs;
+	uint64_t bytes; // requested
+};
+
+#define KNOT_CLOUD_ALLOC_SITES_MAX 16
+
+struct knot_cloud_alloc_stats {
+	struct knot_cloud_alloc_site sites[KNOT_CLOUD_ALLOC_SITES_MAX];
+	unsigned int num_sites;
+	uint64_t live_bytes; // whole process
+	uint64_t peak_bytes;
+};
+
+enum knot_cloud_state {
+	KNOT_CLOUD_DISCONNECTED,
+	KNOT_CLOUD_CONNECTING,
+	KNOT_CLOUD_AUTHENTICATING,
+	KNOT_CLOUD_READY,
+	KNOT_CLOUD_BACKING_OFF
+};
+
+/* Device of a bulk request, only the fields used by the request are read */
+struct knot_cloud_device_info {
+	const char *id;
+	const char *name;
+	const char *token;
+	struct l_queue *schema_list;
+};
+
+struct knot_cloud_bulk_result {
+	const char *id;
+	const char *token; // set on register when successful
+	const char *error;
+	int status; // 0 if successful, KNoT error or negative errno otherwise
 };
 
 typedef bool (*knot_cloud_cb_t) (const struct knot_cloud_msg *msg,
 				 void *user_data);
 typedef void (*knot_cloud_connected_cb_t) (void *user_data);
 typedef void (*knot_cloud_disconnected_cb_t) (void *user_data);
+/* @retry_ms is the delay until the next attempt when backing off */
+typedef void (*knot_cloud_state_cb_t) (enum knot_cloud_state state,
+				       uint64_t retry_ms, void *user_data);
+typedef void (*knot_cloud_reply_cb_t) (const struct knot_cloud_msg *msg,
+				       int err, void *user_data);
+typedef void (*knot_cloud_stats_cb_t) (const struct knot_cloud_stats *stats,
+				       void *user_data);
+typedef void (*knot_cloud_bulk_cb_t) (
+				const struct knot_cloud_bulk_result *results,
+				size_t count, void *user_data);
 
 int knot_cloud_read_start(const char *id, knot_cloud_cb_t read_handler_cb,
 			  void *user_data);
+int knot_cloud_device_add(const char *id);
+int knot_cloud_device_remove(const char *id);
 int knot_cloud_start(char *url, char *user_token,
 		     knot_cloud_connected_cb_t connected_cb,
 		     knot_cloud_disconnected_cb_t disconnected_cb,
 		     void *user_data);
 void knot_cloud_stop(void);
+void knot_cloud_set_state_cb(knot_cloud_state_cb_t state_cb, void *user_data);
+void knot_cloud_set_tls(const struct knot_cloud_tls_config *config);
+void knot_cloud_get_tls_stats(struct knot_cloud_tls_stats *stats);
+void knot_cloud_get_stats(struct knot_cloud_stats *stats);
+void knot_cloud_set_trace(bool enable);
+int knot_cloud_set_capture(const char *path);
+int knot_cloud_get_alloc_stats(struct knot_cloud_alloc_stats *stats);
+int knot_cloud_set_stats_cb(unsigned int interval_ms,
+			    knot_cloud_stats_cb_t stats_cb, void *user_data);
+void knot_cloud_set_msg_arena_retain(bool retain);
+int knot_cloud_set_workers(unsigned int num_workers);
+bool knot_cloud_is_authenticated(const char *id);
+int knot_cloud_set_schema_cache(const char *path);
+void knot_cloud_set_direct_reply(bool enable);
+struct knot_cloud_msg_token *knot_cloud_msg_defer(
+					const struct knot_cloud_msg *msg);
+int knot_cloud_msg_complete(struct knot_cloud_msg_token *token, bool ok);
 int knot_cloud_publish_data(const char *id, uint8_t sensor_id,
 			    uint8_t value_type, const knot_value_type *value,
 			    uint8_t kval_len);
 int knot_cloud_register_device(const char *id, const char *name);
 int knot_cloud_unregister_device(const char *id);
 int knot_cloud_auth_device(const char *id, const char *token);
+int knot_cloud_auth_device_async(const char *id, const char *token,
+				 unsigned int timeout_ms,
+				 knot_cloud_reply_cb_t reply_cb,
+				 void *user_data);
 int knot_cloud_update_schema(const char *id, struct l_queue *schema_list);
+int knot_cloud_bulk_register(const struct knot_cloud_device_info *devices,
+			     size_t count, knot_cloud_bulk_cb_t bulk_cb,
+			     void *user_data);
+int knot_cloud_bulk_auth(const struct knot_cloud_device_info *devices,
+			 size_t count, knot_cloud_bulk_cb_t bulk_cb,
+			 void *user_data);
+int knot_cloud_bulk_update_schema(const struct knot_cloud_device_info *devices,
+				  size_t count, knot_cloud_bulk_cb_t bulk_cb,
+				  void *user_data);
+
+struct knot_cloud *knot_cloud_session_new(void);
+void knot_cloud_session_free(struct knot_cloud *cloud);
+int knot_cloud_session_read_start(struct knot_cloud *cloud, const char *id,
+				  knot_cloud_cb_t read_handler_cb,
+				  void *user_data);
+int knot_cloud_session_device_add(struct knot_cloud *cloud, const char *id);
+int knot_cloud_session_device_remove(struct knot_cloud *cloud,
+				     const char *id);
+int knot_cloud_session_start(struct knot_cloud *cloud, const char *url,
+			     const char *user_token,
+			     knot_cloud_connected_cb_t connected_cb,
+			     knot_cloud_disconnected_cb_t disconnected_cb,
+			     void *user_data);
+void knot_cloud_session_stop(struct knot_cloud *cloud);
+void knot_cloud_session_set_state_cb(struct knot_cloud *cloud,
+				     knot_cloud_state_cb_t state_cb,
+				     void *user_data);
+void knot_cloud_session_set_tls(struct knot_cloud *cloud,
+				const struct knot_cloud_tls_config *config);
+void knot_cloud_session_get_tls_stats(struct knot_cloud *cloud,
+				      struct knot_cloud_tls_stats *stats);
+void knot_cloud_session_get_stats(struct knot_cloud *cloud,
+				  struct knot_cloud_stats *stats);
+void knot_cloud_session_set_trace(struct knot_cloud *cloud, bool enable);
+int knot_cloud_session_set_capture(struct knot_cloud *cloud, const char *path);
+int knot_cloud_session_set_stats_cb(struct knot_cloud *cloud,
+				    unsigned int interval_ms,
+				    knot_cloud_stats_cb_t stats_cb,
+				    void *user_data);
+void knot_cloud_session_set_msg_arena_retain(struct knot_cloud *cloud,
+					     bool retain);
+int knot_cloud_session_set_workers(struct knot_cloud *cloud,
+				   unsigned int num_workers);
+bool knot_cloud_session_is_authenticated(struct knot_cloud *cloud,
+					 const char *id);
+int knot_cloud_session_set_schema_cache(struct knot_cloud *cloud,
+					const char *path);
+void knot_cloud_session_set_direct_reply(struct knot_cloud *cloud,
+					 bool enable);
+int knot_cloud_session_publish_data(struct knot_cloud *cloud, const char *id,
+				    uint8_t sensor_id, uint8_t value_type,
+				    const knot_value_type *value,
+				    uint8_t kval_len);
+int knot_cloud_session_register_device(struct knot_cloud *cloud,
+				       const char *id, const char *name);
+int knot_cloud_session_unregister_device(struct knot_cloud *cloud,
+					 const char *id);
+int knot_cloud_session_auth_device(struct knot_cloud *cloud, const char *id,
+				   const char *token);
+int knot_cloud_session_auth_device_async(struct knot_cloud *cloud,
+					 const char *id, const char *token,
+					 unsigned int timeout_ms,
+					 knot_cloud_reply_cb_t reply_cb,
+					 void *user_data);
+int knot_cloud_session_update_schema(struct knot_cloud *cloud, const char *id,
+				     struct l_queue *schema_list);
+int knot_cloud_session_bulk_register(struct knot_cloud *cloud,
+				const struct knot_cloud_device_info *devices,
+				size_t count, knot_cloud_bulk_cb_t bulk_cb,
+				void *user_data);
+int knot_cloud_session_bulk_auth(struct knot_cloud *cloud,
+				 const struct knot_cloud_device_info *devices,
+				 size_t count, knot_cloud_bulk_cb_t bulk_cb,
+				 void *user_data);
+int knot_cloud_session_bulk_update_schema(struct knot_cloud *cloud,
+				const struct knot_cloud_device_info *devices,
+				size_t count, knot_cloud_bulk_cb_t bulk_cb,
+				void *user_data);
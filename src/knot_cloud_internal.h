@@ -0,0 +1,50 @@
+/**
+ * This file is part of the KNOT Project
+ *
+ * Copyright (c) 2019, CESAR. All rights reserved.
+ *
+ *  This library is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU Lesser General Public
+ *  License as published by the Free Software Foundation; either
+ *  version 2.1 of the License, or (at your option) any later version.
+ *
+ *  This library is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Lesser General Public License for more details.
+ */
+
+/**
+ *  Session internals header file
+ *
+ *  Not installed. Lets the benchmarks and tools reach the receive path and
+ *  the connection of a session, linking the core library. The symbols are
+ *  not exported by the shared library.
+ */
+
+#define MQ_QUEUE_FOG_OUT "thingd-fogOut"
+#define MQ_QUEUE_REPLY "thingd-reply"
+
+/* Exchanges */
+#define MQ_EXCHANGE_DEVICE "device"
+#define MQ_EXCHANGE_DATA_SENT "data.sent"
+
+ /* Southbound traffic (commands) */
+#define MQ_EVENT_PREFIX_DEVICE "device"
+#define MQ_EVENT_POSTFIX_DATA_UPDATE "data.update"
+#define MQ_EVENT_POSTFIX_DATA_REQUEST "data.request"
+
+#define MQ_EVENT_DEVICE_REGISTERED "device.registered"
+#define MQ_EVENT_DEVICE_UNREGISTERED "device.unregistered"
+#define MQ_EVENT_DEVICE_SCHEMA_UPDATED "device.schema.updated"
+
+struct knot_cloud_msg *cloud_internal_create_msg(struct knot_cloud *cloud,
+						 const char *routing_key,
+						 json_object *jso,
+						 struct arena *arena);
+void cloud_internal_destroy_msg(struct knot_cloud_msg *msg);
+void cloud_internal_set_routes(struct knot_cloud *cloud,
+			       const char *session_id,
+			       const char *device_id);
+struct mq_context *cloud_internal_get_mq(struct knot_cloud *cloud);
+amqp_table_entry_t *cloud_internal_get_headers(struct knot_cloud *cloud);
@@ -0,0 +1,68 @@
+/**
+ * This file is part of the KNOT Project
+ *
+ * Copyright (c) 2019, CESAR. All rights reserved.
+ *
+ *  This library is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU Lesser General Public
+ *  License as published by the Free Software Foundation; either
+ *  version 2.1 of the License, or (at your option) any later version.
+ *
+ *  This library is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Lesser General Public License for more details.
+ */
+
+
+/**
+ *  Logging source file
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <ell/ell.h>
+
+#include "log.h"
+
+/**
+ * log_ratelimit_check:
+ * @ratelimit: state of the call site
+ *
+ * Reports the messages suppressed in the previous interval, if any, when a
+ * new interval starts.
+ *
+ * Returns: true if the message can be logged and false otherwise.
+ */
+bool log_ratelimit_check(struct log_ratelimit *ratelimit)
+{
+	uint64_t now = l_time_now();
+
+	if (now - ratelimit->start >= LOG_RATELIMIT_INTERVAL_MS * 1000) {
+		if (ratelimit->suppressed)
+			l_warn("%u similar errors suppressed",
+			       ratelimit->suppressed);
+
+		ratelimit->start = now;
+		ratelimit->count = 0;
+		ratelimit->suppressed = 0;
+	}
+
+	if (ratelimit->count < LOG_RATELIMIT_BURST) {
+		ratelimit->count++;
+		return true;
+	}
+
+	ratelimit->suppressed++;
+
+	return false;
+}
+
+/* Type checks the arguments of the logging removed at build time */
+void log_discard(const char *format, ...)
+{
+}
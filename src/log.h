@@ -0,0 +1,66 @@
+/**
+ * This file is part of the KNOT Project
+ *
+ * Copyright (c) 2019, CESAR. All rights reserved.
+ *
+ *  This library is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU Lesser General Public
+ *  License as published by the Free Software Foundation; either
+ *  version 2.1 of the License, or (at your option) any later version.
+ *
+ *  This library is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Lesser General Public License for more details.
+ */
+
+
+/**
+ *  Logging header file
+ */
+
+/* Bytes of a message body logged at most */
+#define LOG_PAYLOAD_MAX 128
+
+#define LOG_PAYLOAD_LEN(len) \
+	((int) ((len) < LOG_PAYLOAD_MAX ? (len) : LOG_PAYLOAD_MAX))
+
+/*
+ * Per message logging. It is removed at build time by --disable-trace.
+ * Otherwise it is an l_debug(), checked at runtime: the arguments are only
+ * evaluated and formatted if the debug output of the call site is enabled.
+ */
+#ifdef HAVE_TRACE_LOG
+#define log_trace(format, ...) l_debug(format, ##__VA_ARGS__)
+#else
+#define log_trace(format, ...)						\
+	do {								\
+		if (0)							\
+			log_discard(format, ##__VA_ARGS__);		\
+	} while (0)
+#endif
+
+/*
+ * Errors repeated on every message, e.g. while the broker is down, are
+ * logged up to LOG_RATELIMIT_BURST times per LOG_RATELIMIT_INTERVAL_MS on
+ * each call site. Main loop only.
+ */
+#define LOG_RATELIMIT_BURST 10
+#define LOG_RATELIMIT_INTERVAL_MS 5000
+
+struct log_ratelimit {
+	uint64_t start;
+	unsigned int count;
+	unsigned int suppressed;
+};
+
+#define log_error_ratelimit(format, ...)				\
+	do {								\
+		static struct log_ratelimit log_ratelimit_site;		\
+		if (log_ratelimit_check(&log_ratelimit_site))			\
+			l_error(format, ##__VA_ARGS__);			\
+	} while (0)
+
+bool log_ratelimit_check(struct log_ratelimit *ratelimit);
+void log_discard(const char *format, ...)
+				__attribute__((format(printf, 1, 2)));
@@ -28,20 +28,69 @@
 
 #include <stdio.h>
 #include <stdbool.h>
+#include <string.h>
 #include <sys/time.h>
+#include <time.h>
 #include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <poll.h>
+#include <netdb.h>
+#include <sys/socket.h>
 #include <ell/ell.h>
 #include <amqp.h>
 #include <amqp_framing.h>
 #include <amqp_tcp_socket.h>
 
+#include "alloc.h"
+#include "arena.h"
+#include "capture.h"
+#include "log.h"
+#include "stats.h"
+#include "tls.h"
 #include "mq.h"
 
 #define AMQP_EXCHANGE_TYPE_DIRECT "direct"
 #define AMQP_EXCHANGE_TYPE_FANOUT "fanout"
 
 #define MQ_CONNECTION_TIMEOUT_US 10000
-#define MQ_CONNECTION_RETRY_TIMEOUT_MS 1000
+/* Bounds the socket open, done off the main loop */
+#define MQ_SOCKET_OPEN_TIMEOUT_S 10
+/* Bounds the connect latency probe of broker lists */
+#define MQ_PROBE_TIMEOUT_MS 1000
+/* Connect latencies older than this are probed again */
+#define MQ_PROBE_MAX_AGE_S 300
+
+/* Reconnection backoff, see mq_next_backoff() */
+#define MQ_BACKOFF_FIRST_MS 250
+#define MQ_BACKOFF_BASE_MS 1000
+#define MQ_BACKOFF_CAP_MS 60000
+#define MQ_ARENA_POOL_MAX 16
+
+/* Sender clock in microseconds and trace id, set when tracing */
+#define MQ_HEADER_TIMESTAMP "x-timestamp-us"
+#define MQ_HEADER_TRACE_ID "x-trace-id"
+#define MQ_HEADERS_MAX 8
+#define MQ_TRACE_ID_LEN 32
+/* Queue names are AMQP short strings */
+#define MQ_SHORTSTR_MAX 255
+
+/* Broker endpoint, its url is parsed once on start */
+struct mq_endpoint {
+	char *url; // Parsed in place, referenced by info
+	struct amqp_connection_info info;
+	/* Last connect latency measured, 0 if unknown or failed */
+	uint64_t latency_us;
+	uint64_t probed_at;
+};
+
+/* Shared with the connection thread, which only reads the parsed urls */
+struct mq_endpoints {
+	int ref_count;
+	unsigned int count;
+	struct mq_endpoint *entries;
+};
 
 struct mq_context {
 	amqp_connection_state_t conn;
@@ -49,16 +98,136 @@ struct mq_context {
 	struct l_timeout *conn_retry_timeout;
 	mq_connected_cb_t connected_cb;
 	mq_disconnected_cb_t disconnected_cb;
+	mq_state_cb_t state_cb;
+	void *state_data;
+	enum mq_state state;
+	/* Last reconnection delay, 0 if the next retry is the first one */
+	uint64_t backoff_ms;
 	void *connection_data;
 	mq_read_cb_t read_cb;
+	void *read_data;
+	struct l_queue *arena_pool;
+	bool arena_retain;
+	unsigned int generation;
+	struct mq_endpoints *endpoints;
+	/* Endpoint of the current connection */
+	unsigned int endpoint;
+	/* Exchanges already declared on the current connection */
+	struct l_hashmap *exchanges;
+	/* Queues declared, restored after a reconnection */
+	struct l_queue *queues;
+	/* Consuming from the direct reply-to pseudo queue */
+	bool direct_reply;
+	struct mq_connect *connect_job;
+	/* Settings and resumable session of amqps connections */
+	struct tls *tls;
+	struct mq_stats stats;
+	/* Outgoing messages carry a trace id, see mq_set_trace() */
+	bool trace;
+	uint32_t trace_prefix;
+	uint64_t trace_seq;
+	/* Start of the current disconnection, 0 while connected */
+	uint64_t disconnected_since;
+	bool connected_once;
+	/* Traffic recorded, see mq_set_capture() */
+	struct capture *capture;
+};
+
+struct mq_binding {
+	char *exchange;
+	char *exchange_type;
+	char *routing_key;
+};
+
+struct mq_queue {
+	struct mq_context *ctx;
+	amqp_bytes_t name;
+	struct l_queue *bindings;
+	bool consuming;
+	bool lost;
 };
 
-static struct mq_context mq_ctx;
+static struct mq_endpoints *mq_endpoints_ref(struct mq_endpoints *endpoints)
+{
+	__sync_fetch_and_add(&endpoints->ref_count, 1);
+
+	return endpoints;
+}
+
+static void mq_endpoints_unref(struct mq_endpoints *endpoints)
+{
+	unsigned int i;
+
+	if (!endpoints)
+		return;
+
+	if (__sync_sub_and_fetch(&endpoints->ref_count, 1))
+		return;
+
+	for (i = 0; i < endpoints->count; i++)
+		l_free(endpoints->entries[i].url);
+
+	l_free(endpoints->entries);
+	l_free(endpoints);
+}
+
+/* Parses a comma separated list of broker urls */
+static struct mq_endpoints *mq_endpoints_new(const char *urls)
+{
+	struct mq_endpoints *endpoints;
+	char **list;
+	unsigned int i;
+	int status;
+
+	list = l_strsplit(urls, ',');
+	if (!list)
+		return NULL;
+
+	endpoints = l_new(struct mq_endpoints, 1);
+	endpoints->ref_count = 1;
+	endpoints->entries = l_new(struct mq_endpoint, l_strv_length(list));
+
+	for (i = 0; list[i]; i++) {
+		struct mq_endpoint *endpoint;
+		char *url = list[i] + strspn(list[i], " \t");
+		size_t len = strcspn(url, " \t");
+
+		if (!len)
+			continue;
+
+		endpoint = &endpoints->entries[endpoints->count++];
+		endpoint->url = l_strndup(url, len);
+
+		// This function will change the url after processed
+		status = amqp_parse_url(endpoint->url, &endpoint->info);
+		if (status) {
+			l_error("amqp_parse_url: broker %u: %s",
+				endpoints->count, amqp_error_string2(status));
+			goto fail;
+		}
+	}
+
+	l_strfreev(list);
+
+	if (!endpoints->count) {
+		l_error("No broker url provided");
+		mq_endpoints_unref(endpoints);
+		return NULL;
+	}
+
+	return endpoints;
+
+fail:
+	l_strfreev(list);
+	mq_endpoints_unref(endpoints);
+	return NULL;
+}
 
 static const char *mq_server_exception_string(amqp_rpc_reply_t reply)
 {
 	amqp_connection_close_t *m = reply.reply.decoded;
-	static char r[512];
+	/* Also used by the connection thread */
+	static __thread char r[512];
 
 	switch (reply.reply.id) {
 	case AMQP_CONNECTION_CLOSE_METHOD:
@@ -80,7 +249,7 @@ static const char *mq_server_exception_string(amqp_rpc_reply_t reply)
 		break;
 	}
 
-	return l_strdup(r);
+	return r;
 }
 
 static const char *mq_rpc_reply_string(amqp_rpc_reply_t reply)
@@ -98,13 +267,170 @@ static const char *mq_rpc_reply_string(amqp_rpc_reply_t reply)
 	}
 }
 
-static char *mq_bytes_to_new_string(amqp_bytes_t data)
+static char *mq_bytes_to_new_string(struct arena *arena, amqp_bytes_t data)
+{
+	return arena_strndup(arena, data.bytes, data.len);
+}
+
+static struct arena *mq_arena_acquire(struct mq_context *ctx)
+{
+	struct arena *arena = l_queue_pop_head(ctx->arena_pool);
+
+	if (!arena)
+		return arena_new(0);
+
+	return arena;
+}
+
+/**
+ * mq_arena_release:
+ * @ctx: message queue context
+ * @arena: arena passed to the read callback
+ *
+ * Drops a reference to a delivery arena. Everything allocated for the
+ * delivery is released at once with the last reference. When retaining, the
+ * blocks stay around to serve the next delivery without calling malloc.
+ * Must be called from the main loop.
+ */
+void mq_arena_release(struct mq_context *ctx, struct arena *arena)
+{
+	if (!arena_unref(arena))
+		return;
+
+	if (!ctx->arena_retain ||
+			l_queue_length(ctx->arena_pool) >= MQ_ARENA_POOL_MAX) {
+		arena_free(arena);
+		return;
+	}
+
+	arena_reset(arena);
+	l_queue_push_head(ctx->arena_pool, arena);
+}
+
+/**
+ * mq_settle:
+ * @ctx: message queue context
+ * @delivery: delivery received on the read callback
+ * @result: how the delivery was handled
+ *
+ * Acknowledges a delivery to the broker. Not consumed deliveries are queued
+ * again unless they were already redelivered, in order to not loop forever
+ * on a message that can't be handled. Deliveries from a previous connection
+ * are ignored, the broker has already queued them again.
+ *
+ * Returns: 0 if successful and negative integer otherwise.
+ */
+int mq_settle(struct mq_context *ctx, const struct mq_delivery *delivery,
+	      enum mq_read_result result)
+{
+	int err;
+
+	/* Consumed without acknowledgement */
+	if (delivery->no_ack)
+		return 0;
+
+	if (!ctx->conn || delivery->generation != ctx->generation) {
+		log_trace("Delivery %"PRIu64" from a closed connection",
+			  delivery->tag);
+		return 0;
+	}
+
+	switch (result) {
+	case MQ_READ_ACK:
+		err = amqp_basic_ack(ctx->conn, 1, delivery->tag, 0);
+		break;
+	case MQ_READ_REQUEUE:
+		err = amqp_basic_nack(ctx->conn, 1, delivery->tag, 0,
+				      !delivery->redelivered);
+		break;
+	case MQ_READ_REJECT:
+		err = amqp_basic_reject(ctx->conn, 1, delivery->tag, 0);
+		break;
+	case MQ_READ_PENDING:
+	default:
+		return 0;
+	}
+
+	if (err < 0)
+		log_error_ratelimit("Error on settle delivery %"PRIu64": %s",
+				    delivery->tag, amqp_error_string2(err));
+
+	return err;
+}
+
+/* Wall clock, comparable to the clock of other hosts */
+static uint64_t mq_wallclock_us(void)
 {
-	char *str = l_new(char, data.len + 1);
+	struct timespec ts;
 
-	memcpy(str, data.bytes, data.len);
-	str[data.len] = '\0';
-	return str;
+	clock_gettime(CLOCK_REALTIME, &ts);
+
+	return (uint64_t) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+/*
+ * Time the message was sent, in microseconds since the epoch, or 0 if the
+ * sender didn't stamp it. The timestamp property has a resolution of a
+ * second, the timestamp header is preferred when present.
+ */
+static uint64_t mq_sent_time_us(const amqp_basic_properties_t *props)
+{
+	const amqp_table_entry_t *entry;
+	int i;
+
+	if (props->_flags & AMQP_BASIC_HEADERS_FLAG) {
+		for (i = 0; i < props->headers.num_entries; i++) {
+			entry = &props->headers.entries[i];
+
+			if (entry->key.len != strlen(MQ_HEADER_TIMESTAMP) ||
+					memcmp(entry->key.bytes,
+					       MQ_HEADER_TIMESTAMP,
+					       entry->key.len))
+				continue;
+
+			if (entry->value.kind == AMQP_FIELD_KIND_I64 &&
+					entry->value.value.i64 > 0)
+				return entry->value.value.i64;
+
+			if (entry->value.kind == AMQP_FIELD_KIND_U64)
+				return entry->value.value.u64;
+		}
+	}
+
+	if (props->_flags & AMQP_BASIC_TIMESTAMP_FLAG)
+		return props->timestamp * 1000000;
+
+	return 0;
+}
+
+/* Hands a delivery to the read callback and releases it once settled */
+static void mq_deliver(struct mq_context *ctx, struct mq_delivery *delivery)
+{
+	enum mq_read_result result;
+
+	result = ctx->read_cb(delivery, ctx->read_data);
+	if (result == MQ_READ_REQUEUE || result == MQ_READ_REJECT)
+		log_trace("Message envelope not consumed");
+
+	mq_settle(ctx, delivery, result);
+	mq_arena_release(ctx, delivery->arena);
+}
+
+static void mq_capture_delivery(struct mq_context *ctx,
+				const struct mq_delivery *delivery,
+				size_t body_len)
+{
+	struct capture_record record = {
+		.direction = CAPTURE_IN,
+		.flags = delivery->redelivered ? CAPTURE_REDELIVERED : 0,
+		.exchange = delivery->exchange,
+		.routing_key = delivery->routing_key,
+		.correlation_id = delivery->correlation_id,
+		.body = delivery->body,
+		.body_len = body_len,
+	};
+
+	capture_write(ctx->capture, &record);
 }
 
 /**
@@ -114,125 +440,654 @@ static char *mq_bytes_to_new_string(amqp_bytes_t data)
  */
 static bool on_receive(struct l_io *io, void *user_data)
 {
+	struct mq_context *ctx = user_data;
 	amqp_rpc_reply_t res;
 	amqp_envelope_t envelope;
-	char *exchange, *routing_key, *body;
+	struct mq_delivery delivery;
 	struct timeval time_out = { .tv_usec = MQ_CONNECTION_TIMEOUT_US };
-	bool success;
+	uint64_t sent_us, now_us;
 
-	if (amqp_release_buffers_ok(mq_ctx.conn))
-		amqp_release_buffers(mq_ctx.conn);
+	alloc_site_enter(ALLOC_SITE_RECEIVE);
 
-	res = amqp_consume_message(mq_ctx.conn, &envelope, &time_out, 0);
+	if (amqp_release_buffers_ok(ctx->conn))
+		amqp_release_buffers(ctx->conn);
 
-	if (res.reply_type != AMQP_RESPONSE_NORMAL)
-		return true;
+	res = amqp_consume_message(ctx->conn, &envelope, &time_out, 0);
 
-	l_debug("Receive %u -> exchange: %.*s, routingkey: %.*s\nBody: %.*s\n",
-		(unsigned int)envelope.delivery_tag,
-		(int)envelope.exchange.len,
-		(char *)envelope.exchange.bytes,
-		(int)envelope.routing_key.len,
-		(char *)envelope.routing_key.bytes,
-		(int)envelope.message.body.len,
-		(char *)envelope.message.body.bytes);
+	if (res.reply_type != AMQP_RESPONSE_NORMAL) {
+		alloc_site_set(ALLOC_SITE_OTHER);
+		alloc_site_leave();
+		return true;
+	}
 
-	if (!mq_ctx.read_cb) {
+	ctx->stats.messages_in++;
+	ctx->stats.bytes_in += envelope.message.body.len;
+
+	log_trace("Receive %u -> exchange: %.*s, routingkey: %.*s\n"
+		  "Body (%zu bytes): %.*s\n",
+		  (unsigned int)envelope.delivery_tag,
+		  (int)envelope.exchange.len,
+		  (char *)envelope.exchange.bytes,
+		  (int)envelope.routing_key.len,
+		  (char *)envelope.routing_key.bytes,
+		  envelope.message.body.len,
+		  LOG_PAYLOAD_LEN(envelope.message.body.len),
+		  (char *)envelope.message.body.bytes);
+
+	if (!ctx->read_cb) {
 		l_debug("AMQP read callback is not set");
 		amqp_destroy_envelope(&envelope);
+		alloc_site_leave();
 		return false;
 	}
 
-	exchange = mq_bytes_to_new_string(envelope.exchange);
-	routing_key = mq_bytes_to_new_string(envelope.routing_key);
-	body = mq_bytes_to_new_string(envelope.message.body);
-
-	success = mq_ctx.read_cb(exchange, routing_key, body, user_data);
-	if (!success)
-		/* TODO: Add the msg on the queue again */
-		l_debug("Message envelope not consumed");
-
-	l_debug("Destroy received envelope");
+	delivery.arena = mq_arena_acquire(ctx);
+	delivery.exchange = mq_bytes_to_new_string(delivery.arena,
+						   envelope.exchange);
+	delivery.routing_key = mq_bytes_to_new_string(delivery.arena,
+						      envelope.routing_key);
+	delivery.body = mq_bytes_to_new_string(delivery.arena,
+					       envelope.message.body);
+	delivery.correlation_id = NULL;
+	if (envelope.message.properties._flags &
+					AMQP_BASIC_CORRELATION_ID_FLAG)
+		delivery.correlation_id = mq_bytes_to_new_string(
+				delivery.arena,
+				envelope.message.properties.correlation_id);
+	delivery.tag = envelope.delivery_tag;
+	delivery.generation = ctx->generation;
+	delivery.redelivered = envelope.redelivered;
+
+	/* Clocks out of sync make the lag unknown rather than negative */
+	sent_us = mq_sent_time_us(&envelope.message.properties);
+	now_us = mq_wallclock_us();
+	delivery.lag_us = sent_us && now_us > sent_us ? now_us - sent_us : 0;
+	if (delivery.lag_us)
+		stats_histogram_add(&ctx->stats.delivery_lag,
+				    delivery.lag_us);
+
+	delivery.no_ack = envelope.consumer_tag.len ==
+					strlen(MQ_DIRECT_REPLY_TO) &&
+			!memcmp(envelope.consumer_tag.bytes,
+				MQ_DIRECT_REPLY_TO,
+				envelope.consumer_tag.len);
+
+	if (ctx->capture)
+		mq_capture_delivery(ctx, &delivery, envelope.message.body.len);
+
+	mq_deliver(ctx, &delivery);
+
+	log_trace("Destroy received envelope");
 	amqp_destroy_envelope(&envelope);
-	l_free(exchange);
-	l_free(routing_key);
-	l_free(body);
+	alloc_site_leave();
 
 	return true;
 }
 
-static void close_connection(void)
+/*
+ * Connection being opened by a helper thread. Events are written to a pipe
+ * read by the main loop. If the context stops meanwhile, the job is
+ * abandoned and the thread releases it, along with the connection.
+ */
+enum mq_connect_event {
+	MQ_CONNECT_AUTHENTICATING,
+	MQ_CONNECT_DONE
+};
+
+struct mq_connect {
+	pthread_t thread;
+	pthread_mutex_t lock;
+	struct mq_endpoints *endpoints;
+	/* Connect latency per endpoint, cached or probed, 0 if unreachable */
+	uint64_t *probe_us;
+	/* Endpoints probed by this attempt, the others were cached */
+	bool *probed;
+	/* Endpoints failing to connect, probed again on the next attempt */
+	bool *failed;
+	/* Endpoint connected, valid if conn is set */
+	unsigned int connected;
+	struct tls *tls;
+	struct l_io *io;
+	int notify_fd;
+	bool abandoned;
+	amqp_connection_state_t conn;
+};
+
+static void mq_connect_free(struct mq_connect *job)
+{
+	l_io_destroy(job->io);
+	close(job->notify_fd);
+	pthread_mutex_destroy(&job->lock);
+	tls_unref(job->tls);
+	mq_endpoints_unref(job->endpoints);
+	l_free(job->probe_us);
+	l_free(job->probed);
+	l_free(job->failed);
+	l_free(job);
+}
+
+/* Called on the connection thread */
+static void mq_connect_notify(struct mq_connect *job,
+			      enum mq_connect_event event)
+{
+	uint8_t byte = event;
+	bool abandoned;
+
+	pthread_mutex_lock(&job->lock);
+
+	abandoned = job->abandoned;
+	if (!abandoned && write(job->notify_fd, &byte, sizeof(byte)) < 0)
+		l_error("Error on notify connection: %s", strerror(errno));
+
+	pthread_mutex_unlock(&job->lock);
+
+	if (!abandoned || event != MQ_CONNECT_DONE)
+		return;
+
+	if (job->conn) {
+		amqp_connection_close(job->conn, AMQP_REPLY_SUCCESS);
+		amqp_destroy_connection(job->conn);
+	}
+
+	mq_connect_free(job);
+}
+
+/*
+ * The thread can't be interrupted, it is left to finish on its own. It must
+ * see the job abandoned before the read end of the pipe is closed, or its
+ * next notification raises SIGPIPE.
+ */
+static void mq_connect_abandon(struct mq_connect *job)
+{
+	pthread_mutex_lock(&job->lock);
+	job->abandoned = true;
+	pthread_mutex_unlock(&job->lock);
+
+	l_io_destroy(job->io);
+	job->io = NULL;
+
+	pthread_detach(job->thread);
+}
+
+static void close_connection(struct mq_context *ctx)
 {
 	amqp_rpc_reply_t r;
 	int err;
 
-	if (!mq_ctx.conn)
+	if (!ctx->conn)
 		return;
 
-	r = amqp_channel_close(mq_ctx.conn, 1, AMQP_REPLY_SUCCESS);
+	r = amqp_channel_close(ctx->conn, 1, AMQP_REPLY_SUCCESS);
 	if (r.reply_type != AMQP_RESPONSE_NORMAL)
 		l_error("amqp_channel_close: %s",
 				mq_rpc_reply_string(r));
 
-	r = amqp_connection_close(mq_ctx.conn, AMQP_REPLY_SUCCESS);
+	r = amqp_connection_close(ctx->conn, AMQP_REPLY_SUCCESS);
 	if (r.reply_type != AMQP_RESPONSE_NORMAL)
 		l_error("amqp_connection_close: %s",
 				mq_rpc_reply_string(r));
 
-	err = amqp_destroy_connection(mq_ctx.conn);
+	err = amqp_destroy_connection(ctx->conn);
 	if (err < 0)
 		l_error("amqp_destroy_connection: %s",
 				amqp_error_string2(err));
 
-	mq_ctx.conn = NULL;
+	ctx->conn = NULL;
+}
+
+static void mq_set_state(struct mq_context *ctx, enum mq_state state,
+			 uint64_t delay_ms)
+{
+	ctx->state = state;
+
+	if (state == MQ_STATE_READY && ctx->disconnected_since) {
+		ctx->stats.disconnected_us += l_time_now() -
+						ctx->disconnected_since;
+		ctx->disconnected_since = 0;
+	} else if (state != MQ_STATE_READY && !ctx->disconnected_since) {
+		ctx->disconnected_since = l_time_now();
+	}
+
+	if (ctx->state_cb)
+		ctx->state_cb(state, delay_ms, ctx->state_data);
+}
+
+/*
+ * Decorrelated jitter: each delay is random between the base and three
+ * times the previous one, up to a cap. Gateways losing the broker at the
+ * same time spread their attempts instead of retrying in lockstep. The
+ * first retry is quick, most disconnections are short.
+ */
+static uint64_t mq_next_backoff(struct mq_context *ctx)
+{
+	uint64_t high;
+
+	if (!ctx->backoff_ms) {
+		ctx->backoff_ms = MQ_BACKOFF_BASE_MS;
+		return l_getrandom_uint32() % (MQ_BACKOFF_FIRST_MS + 1);
+	}
+
+	high = ctx->backoff_ms * 3;
+	if (high > MQ_BACKOFF_CAP_MS)
+		high = MQ_BACKOFF_CAP_MS;
+
+	ctx->backoff_ms = MQ_BACKOFF_BASE_MS +
+		l_getrandom_uint32() % (high - MQ_BACKOFF_BASE_MS + 1);
+
+	return ctx->backoff_ms;
+}
+
+static void mq_schedule_retry(struct mq_context *ctx)
+{
+	uint64_t delay_ms = mq_next_backoff(ctx);
+
+	if (!ctx->conn_retry_timeout)
+		return;
+
+	l_debug("Retrying connection in %"PRIu64" ms", delay_ms);
+
+	mq_set_state(ctx, MQ_STATE_BACKING_OFF, delay_ms);
+	/* Zero disables an ell timeout */
+	l_timeout_modify_ms(ctx->conn_retry_timeout, delay_ms ? : 1);
 }
 
 static void on_disconnect(struct l_io *io, void *user_data)
 {
+	struct mq_context *ctx = user_data;
+
 	l_debug("AMQP broker disconnected");
 
-	mq_ctx.disconnected_cb(mq_ctx.connection_data);
+	mq_set_state(ctx, MQ_STATE_DISCONNECTED, 0);
+	ctx->disconnected_cb(ctx->connection_data);
 
-	if (mq_ctx.conn_retry_timeout)
-		l_timeout_modify_ms(mq_ctx.conn_retry_timeout,
-				    MQ_CONNECTION_RETRY_TIMEOUT_MS);
+	mq_schedule_retry(ctx);
 }
 
-static void attempt_connection(struct l_timeout *ltimeout, void *user_data)
+/* Acknowledges a channel closed by the broker and opens it again */
+static int mq_channel_reopen(struct mq_context *ctx)
 {
-	const char *url = user_data;
-	amqp_socket_t *socket;
-	struct amqp_connection_info cinfo;
-	char *tmp_url = l_strdup(url);
-	amqp_rpc_reply_t r;
-	struct timeval timeout = { .tv_usec = MQ_CONNECTION_TIMEOUT_US };
-	int status;
-
-	l_debug("Trying to connect to rabbitmq");
+	amqp_channel_close_ok_t close_ok;
+	amqp_rpc_reply_t resp;
 
-	/* Check and close if a connection is already up */
-	close_connection();
+	amqp_send_method(ctx->conn, 1, AMQP_CHANNEL_CLOSE_OK_METHOD, &close_ok);
 
-	/* Check and destroy if an IO is already allocated */
-	if (mq_ctx.amqp_io) {
-		l_io_destroy(mq_ctx.amqp_io);
-		mq_ctx.amqp_io = NULL;
+	amqp_channel_open(ctx->conn, 1);
+	resp = amqp_get_rpc_reply(ctx->conn);
+	if (resp.reply_type != AMQP_RESPONSE_NORMAL) {
+		l_error("amqp_channel_open(): %s", mq_rpc_reply_string(resp));
+		return -1;
 	}
 
-	// This function will change the url after processed
-	status = amqp_parse_url(tmp_url, &cinfo);
-	if (status) {
-		l_error("amqp_parse_url: %s", amqp_error_string2(status));
+	return 0;
+}
+
+/*
+ * Exchanges are declared once per connection, so publishing doesn't wait for
+ * a declare round trip and many messages can be pipelined on the wire.
+ * With @wait false the declare doesn't wait for the broker either: it is
+ * part of a topology confirmed by mq_sync(), which forgets the exchanges
+ * declared if it fails. Otherwise the exchange is only cached once the
+ * broker confirmed it.
+ */
+static int mq_declare_exchange(struct mq_context *ctx, const char *exchange,
+			       const char *type, bool wait)
+{
+	amqp_exchange_declare_t req = {
+		.exchange = amqp_cstring_bytes(exchange),
+		.type = amqp_cstring_bytes(type),
+		.passive = 0,
+		.durable = 1,
+		.auto_delete = 0,
+		.internal = 0,
+		.nowait = 1,
+		.arguments = amqp_empty_table,
+	};
+	amqp_rpc_reply_t resp;
+	int err;
+
+	if (!ctx->conn)
+		return -1;
+
+	if (l_hashmap_lookup(ctx->exchanges, exchange))
+		return 0;
+
+	if (!wait) {
+		/* Declare the exchange as durable */
+		err = amqp_send_method(ctx->conn, 1,
+				       AMQP_EXCHANGE_DECLARE_METHOD, &req);
+		if (err != AMQP_STATUS_OK) {
+			l_error("amqp_exchange_declare(): %s",
+				amqp_error_string2(err));
+			return -1;
+		}
+
 		goto done;
 	}
 
-	mq_ctx.conn = amqp_new_connection();
-	if (!mq_ctx.conn) {
+	amqp_exchange_declare(ctx->conn, 1, req.exchange, req.type,
+			      0 /* passive */,
+			      1 /* durable */,
+			      0 /* auto_delete */,
+			      0 /* internal */,
+			      amqp_empty_table);
+	resp = amqp_get_rpc_reply(ctx->conn);
+	if (resp.reply_type != AMQP_RESPONSE_NORMAL) {
+		l_error("amqp_exchange_declare(): %s",
+			mq_rpc_reply_string(resp));
+
+		/* Later messages can still be published on the channel */
+		if (resp.reply_type == AMQP_RESPONSE_SERVER_EXCEPTION &&
+				resp.reply.id == AMQP_CHANNEL_CLOSE_METHOD)
+			mq_channel_reopen(ctx);
+
+		return -1;
+	}
+
+done:
+	l_hashmap_insert(ctx->exchanges, exchange, L_UINT_TO_PTR(1));
+
+	return 0;
+}
+
+static int mq_send_bind(struct mq_context *ctx, amqp_bytes_t queue,
+			const char *exchange, const char *exchange_type,
+			const char *routing_key)
+{
+	amqp_queue_bind_t req = { 0 };
+
+	if (!ctx->conn)
+		return -1;
+
+	if (mq_declare_exchange(ctx, exchange, exchange_type, false))
+		return -1;
+
+	/* Set up to bind a queue to an exchange */
+	req.queue = queue;
+	req.exchange = amqp_cstring_bytes(exchange);
+	req.routing_key = amqp_cstring_bytes(routing_key);
+	req.nowait = 1;
+	req.arguments = amqp_empty_table;
+
+	if (amqp_send_method(ctx->conn, 1, AMQP_QUEUE_BIND_METHOD, &req) !=
+							AMQP_STATUS_OK) {
+		l_error("Error while binding queue");
+		return -1;
+	}
+
+	return 0;
+}
+
+static int mq_send_queue_declare(struct mq_context *ctx, amqp_bytes_t queue)
+{
+	amqp_queue_declare_t req = {
+		.queue = queue,
+		.passive = 0,
+		.durable = 1,
+		.exclusive = 0,
+		.auto_delete = 0,
+		.nowait = 1,
+		.arguments = amqp_empty_table,
+	};
+
+	if (amqp_send_method(ctx->conn, 1, AMQP_QUEUE_DECLARE_METHOD, &req) !=
+							AMQP_STATUS_OK) {
+		l_error("Error declaring queue name");
+		return -1;
+	}
+
+	return 0;
+}
+
+static int mq_send_consume(struct mq_context *ctx, amqp_bytes_t queue,
+			   bool no_ack)
+{
+	amqp_basic_consume_t req = {
+		.queue = queue,
+		.consumer_tag = queue,
+		.no_local = 0,
+		.no_ack = no_ack,
+		.exclusive = 0,
+		.nowait = 1,
+		.arguments = amqp_empty_table,
+	};
+
+	/* Start a queue consumer */
+	if (amqp_send_method(ctx->conn, 1, AMQP_BASIC_CONSUME_METHOD, &req) !=
+							AMQP_STATUS_OK) {
+		l_error("Error while starting consumer");
+		return -1;
+	}
+
+	return 0;
+}
+
+static bool mq_queue_match(const void *data, const void *user_data)
+{
+	const struct mq_queue *queue = data;
+	const amqp_bytes_t *name = user_data;
+
+	return queue->name.len == name->len &&
+		!memcmp(queue->name.bytes, name->bytes, name->len);
+}
+
+static struct mq_queue *mq_queue_find(struct mq_context *ctx,
+				      amqp_bytes_t name)
+{
+	return l_queue_find(ctx->queues, mq_queue_match, &name);
+}
+
+static bool mq_binding_match(const void *data, const void *user_data)
+{
+	const struct mq_binding *binding = data;
+	const struct mq_binding *key = user_data;
+
+	return !strcmp(binding->exchange, key->exchange) &&
+		!strcmp(binding->routing_key, key->routing_key);
+}
+
+static void mq_binding_free(void *data)
+{
+	struct mq_binding *binding = data;
+
+	l_free(binding->exchange);
+	l_free(binding->exchange_type);
+	l_free(binding->routing_key);
+	l_free(binding);
+}
+
+static void mq_queue_free(void *data)
+{
+	struct mq_queue *queue = data;
+
+	l_queue_destroy(queue->bindings, mq_binding_free);
+	amqp_bytes_free(queue->name);
+	l_free(queue);
+}
+
+static int mq_prepare_queue(struct mq_context *ctx, amqp_bytes_t queue,
+			    const char *exchange, const char *exchange_type,
+			    const char *routing_key)
+{
+	struct mq_binding key = {
+		.exchange = (char *) exchange,
+		.routing_key = (char *) routing_key,
+	};
+	struct mq_binding *binding;
+	struct mq_queue *record;
+
+	if (exchange == NULL || exchange_type == NULL || routing_key == NULL)
+		return -1;
+
+	record = mq_queue_find(ctx, queue);
+
+	/*
+	 * While reconnecting the binding is only recorded: the topology
+	 * restore sends it once the connection is back.
+	 */
+	if (!ctx->conn) {
+		if (!record)
+			return -1;
+	} else if (mq_send_bind(ctx, queue, exchange, exchange_type,
+				routing_key)) {
+		return -1;
+	}
+
+	if (!record || l_queue_find(record->bindings, mq_binding_match, &key))
+		return 0;
+
+	binding = l_new(struct mq_binding, 1);
+	binding->exchange = l_strdup(exchange);
+	binding->exchange_type = l_strdup(exchange_type);
+	binding->routing_key = l_strdup(routing_key);
+	l_queue_push_tail(record->bindings, binding);
+
+	return 0;
+}
+
+/*
+ * Checks with a passive declare if a durable queue survived the previous
+ * connection. The broker closes the channel when it doesn't, so it is
+ * opened again.
+ *
+ * Returns 1 if the queue exists, 0 if it was lost and -1 on error.
+ */
+static int mq_queue_exists(struct mq_context *ctx, amqp_bytes_t queue)
+{
+	amqp_channel_close_t *close;
+	amqp_queue_declare_ok_t *r;
+	amqp_rpc_reply_t resp;
+	uint16_t reply_code;
+
+	r = amqp_queue_declare(ctx->conn, 1, queue,
+			1, /* passive */
+			0, /* durable */
+			0, /* exclusive */
+			0, /* auto-delete */
+			amqp_empty_table);
+	resp = amqp_get_rpc_reply(ctx->conn);
+	if (resp.reply_type == AMQP_RESPONSE_NORMAL) {
+		l_debug("Queue %.*s kept %u messages", (int) queue.len,
+			(char *) queue.bytes, r->message_count);
+		return 1;
+	}
+
+	if (resp.reply_type != AMQP_RESPONSE_SERVER_EXCEPTION ||
+			resp.reply.id != AMQP_CHANNEL_CLOSE_METHOD) {
+		l_error("amqp_queue_declare(): %s", mq_rpc_reply_string(resp));
+		return -1;
+	}
+
+	/* Decoded in frame memory reused by the next RPC */
+	close = resp.reply.decoded;
+	reply_code = close->reply_code;
+	if (reply_code != AMQP_NOT_FOUND)
+		l_error("amqp_queue_declare(): %s", mq_rpc_reply_string(resp));
+
+	if (mq_channel_reopen(ctx))
+		return -1;
+
+	return reply_code == AMQP_NOT_FOUND ? 0 : -1;
+}
+
+static void mq_restore_bindings(void *data, void *user_data)
+{
+	struct mq_binding *binding = data;
+	struct mq_queue *queue = user_data;
+
+	mq_send_bind(queue->ctx, queue->name, binding->exchange,
+		     binding->exchange_type, binding->routing_key);
+}
+
+/*
+ * Replays on a new connection the topology set up on the previous one.
+ * Durable queues and their bindings usually survive in the broker, only the
+ * ones lost are declared and bound again, keeping the commands not
+ * delivered yet. Consumers always belong to the connection.
+ */
+static int mq_restore_topology(struct mq_context *ctx)
+{
+	const struct l_queue_entry *entry;
+	struct mq_queue *queue;
+	int exists;
+
+	if (l_queue_isempty(ctx->queues) && !ctx->direct_reply)
+		return 0;
+
+	/* Checked first, a missing queue closes the channel */
+	for (entry = l_queue_get_entries(ctx->queues); entry;
+						entry = entry->next) {
+		queue = entry->data;
+
+		exists = mq_queue_exists(ctx, queue->name);
+		if (exists < 0)
+			return -1;
+
+		queue->lost = !exists;
+	}
+
+	for (entry = l_queue_get_entries(ctx->queues); entry;
+						entry = entry->next) {
+		queue = entry->data;
+
+		if (queue->lost) {
+			l_info("Restoring queue %.*s", (int) queue->name.len,
+			       (char *) queue->name.bytes);
+
+			if (mq_send_queue_declare(ctx, queue->name))
+				return -1;
+
+			l_queue_foreach(queue->bindings, mq_restore_bindings,
+					queue);
+		}
+
+		if (queue->consuming &&
+				mq_send_consume(ctx, queue->name, false))
+			return -1;
+	}
+
+	if (ctx->direct_reply &&
+			mq_send_consume(ctx,
+					amqp_cstring_bytes(MQ_DIRECT_REPLY_TO),
+					true))
+		return -1;
+
+	if (mq_sync(ctx))
+		return -1;
+
+	if (ctx->read_cb && !l_io_set_read_handler(ctx->amqp_io, on_receive,
+						   ctx, NULL)) {
+		l_error("Error on set up read handler on AMQP io");
+		return -1;
+	}
+
+	return 0;
+}
+
+/*
+ * Opens the connection up to the channel. Runs on the connection thread,
+ * blocking on the broker doesn't hold the main loop.
+ */
+static amqp_connection_state_t mq_connect_endpoint(struct mq_connect *job,
+				const struct amqp_connection_info *info)
+{
+	amqp_connection_state_t conn;
+	amqp_socket_t *socket;
+	struct amqp_connection_info cinfo = *info;
+	amqp_rpc_reply_t r;
+	struct timeval timeout = { .tv_sec = MQ_SOCKET_OPEN_TIMEOUT_S };
+	int status;
+
+	conn = amqp_new_connection();
+	if (!conn) {
 		l_error("amqp_new_connection: Error on creation");
-		goto done;
+		return NULL;
 	}
 
-	socket = amqp_tcp_socket_new(mq_ctx.conn);
+	if (cinfo.ssl)
+		socket = tls_socket_new(job->tls, conn);
+	else
+		socket = amqp_tcp_socket_new(conn);
+
 	if (!socket) {
 		l_error("error creating tcp socket");
 		goto destroy_conn;
@@ -246,93 +1101,404 @@ static void attempt_connection(struct l_timeout *ltimeout, void *user_data)
 		goto close_conn;
 	}
 
-	r = amqp_login(mq_ctx.conn, cinfo.vhost,
-		       AMQP_DEFAULT_MAX_CHANNELS, AMQP_DEFAULT_FRAME_SIZE,
-		       AMQP_DEFAULT_HEARTBEAT, AMQP_SASL_METHOD_PLAIN,
-		       cinfo.user, cinfo.password);
-	if (r.reply_type != AMQP_RESPONSE_NORMAL) {
-		l_error("amqp_login(): %s", mq_rpc_reply_string(r));
-		goto close_conn;
+	mq_connect_notify(job, MQ_CONNECT_AUTHENTICATING);
+
+	r = amqp_login(conn, cinfo.vhost,
+		       AMQP_DEFAULT_MAX_CHANNELS, AMQP_DEFAULT_FRAME_SIZE,
+		       AMQP_DEFAULT_HEARTBEAT, AMQP_SASL_METHOD_PLAIN,
+		       cinfo.user, cinfo.password);
+	if (r.reply_type != AMQP_RESPONSE_NORMAL) {
+		l_error("amqp_login(): %s", mq_rpc_reply_string(r));
+		goto close_conn;
+	}
+
+	amqp_channel_open(conn, 1);
+	r = amqp_get_rpc_reply(conn);
+	if (r.reply_type != AMQP_RESPONSE_NORMAL) {
+		l_error("amqp_channel_open(): %s",
+			mq_rpc_reply_string(r));
+		goto close_conn;
+	}
+
+	return conn;
+
+close_conn:
+	r = amqp_connection_close(conn, AMQP_REPLY_SUCCESS);
+	if (r.reply_type != AMQP_RESPONSE_NORMAL)
+		l_error("amqp_connection_close: %s",
+			mq_rpc_reply_string(r));
+destroy_conn:
+	status = amqp_destroy_connection(conn);
+	if (status < 0)
+		l_error("status destroy: %s", amqp_error_string2(status));
+
+	return NULL;
+}
+
+/* Starts a non-blocking TCP connect, returns the socket or -1 */
+static int mq_probe_start(const struct amqp_connection_info *info)
+{
+	struct addrinfo hints = {
+		.ai_family = AF_UNSPEC,
+		.ai_socktype = SOCK_STREAM,
+	};
+	struct addrinfo *res;
+	char port[8];
+	int fd;
+
+	snprintf(port, sizeof(port), "%d", info->port);
+	if (getaddrinfo(info->host, port, &hints, &res))
+		return -1;
+
+	fd = socket(res->ai_family,
+		    res->ai_socktype | SOCK_NONBLOCK | SOCK_CLOEXEC,
+		    res->ai_protocol);
+	if (fd >= 0 && connect(fd, res->ai_addr, res->ai_addrlen) < 0 &&
+			errno != EINPROGRESS) {
+		close(fd);
+		fd = -1;
+	}
+
+	freeaddrinfo(res);
+
+	return fd;
+}
+
+/*
+ * Measures the TCP connect latency of the endpoints without a cached one, all
+ * at once. Endpoints not answering within MQ_PROBE_TIMEOUT_MS are left as
+ * unreachable.
+ */
+static void mq_connect_probe(struct mq_connect *job)
+{
+	unsigned int count = job->endpoints->count;
+	struct pollfd *pfds = l_new(struct pollfd, count);
+	uint64_t *start = l_new(uint64_t, count);
+	uint64_t now, deadline;
+	unsigned int pending = 0;
+	unsigned int i;
+	int n;
+
+	for (i = 0; i < count; i++) {
+		pfds[i].fd = -1;
+
+		if (job->probe_us[i])
+			continue;
+
+		job->probed[i] = true;
+		pfds[i].fd = mq_probe_start(&job->endpoints->entries[i].info);
+		pfds[i].events = POLLOUT;
+		start[i] = l_time_now();
+
+		if (pfds[i].fd >= 0)
+			pending++;
+	}
+
+	deadline = l_time_now() + MQ_PROBE_TIMEOUT_MS * 1000;
+
+	while (pending) {
+		now = l_time_now();
+		if (now >= deadline)
+			break;
+
+		n = poll(pfds, count, (deadline - now + 999) / 1000);
+		if (n < 0 && errno == EINTR)
+			continue;
+
+		if (n <= 0)
+			break;
+
+		now = l_time_now();
+
+		for (i = 0; i < count; i++) {
+			socklen_t len = sizeof(n);
+
+			if (pfds[i].fd < 0 || !pfds[i].revents)
+				continue;
+
+			if (!getsockopt(pfds[i].fd, SOL_SOCKET, SO_ERROR,
+					&n, &len) && !n)
+				job->probe_us[i] = now - start[i] ? : 1;
+
+			close(pfds[i].fd);
+			pfds[i].fd = -1; // Ignored by poll()
+			pending--;
+		}
+	}
+
+	for (i = 0; i < count; i++) {
+		if (pfds[i].fd >= 0)
+			close(pfds[i].fd);
+	}
+
+	l_free(start);
+	l_free(pfds);
+}
+
+/*
+ * Tries the endpoints from the fastest to the slowest one, failing over to
+ * the next one right away. Unreachable endpoints are skipped, unless no
+ * endpoint answered the probe.
+ */
+static amqp_connection_state_t mq_connect_open(struct mq_connect *job)
+{
+	struct mq_endpoints *endpoints = job->endpoints;
+	amqp_connection_state_t conn;
+	unsigned int *order;
+	unsigned int count = 0;
+	unsigned int i, j;
+
+	/* Nothing to choose from */
+	if (endpoints->count == 1) {
+		job->connected = 0;
+		return mq_connect_endpoint(job, &endpoints->entries[0].info);
+	}
+
+	mq_connect_probe(job);
+
+	order = l_new(unsigned int, endpoints->count);
+
+	for (i = 0; i < endpoints->count; i++) {
+		if (!job->probe_us[i])
+			continue;
+
+		for (j = count; j > 0 &&
+				job->probe_us[order[j - 1]] > job->probe_us[i];
+				j--)
+			order[j] = order[j - 1];
+
+		order[j] = i;
+		count++;
+	}
+
+	if (!count) {
+		l_warn("No broker answered, trying them in order");
+		for (i = 0; i < endpoints->count; i++)
+			order[count++] = i;
+	}
+
+	conn = NULL;
+	for (i = 0; i < count && !conn; i++) {
+		job->connected = order[i];
+		conn = mq_connect_endpoint(job,
+					&endpoints->entries[order[i]].info);
+		if (!conn)
+			job->failed[order[i]] = true;
+	}
+
+	l_free(order);
+
+	return conn;
+}
+
+static void *mq_connect_thread(void *data)
+{
+	struct mq_connect *job = data;
+
+	job->conn = mq_connect_open(job);
+	mq_connect_notify(job, MQ_CONNECT_DONE);
+
+	return NULL;
+}
+
+/* Takes over the connection opened by the connection thread */
+static void mq_connect_finish(struct mq_context *ctx,
+			      amqp_connection_state_t conn)
+{
+	ctx->conn = conn;
+	if (!ctx->conn)
+		goto retry;
+
+	ctx->amqp_io = l_io_new(amqp_get_sockfd(ctx->conn));
+	if (!ctx->amqp_io)
+		goto close_conn;
+
+	if (!l_io_set_disconnect_handler(ctx->amqp_io, on_disconnect,
+					 ctx, NULL)) {
+		l_error("Error on set up disconnect handler");
+		goto close_conn;
+	}
+
+	ctx->generation++;
+	l_hashmap_destroy(ctx->exchanges, NULL);
+	ctx->exchanges = l_hashmap_string_new();
+
+	if (mq_restore_topology(ctx)) {
+		l_error("Error on restore the topology");
+		goto close_conn;
+	}
+
+	if (ctx->connected_once)
+		ctx->stats.reconnects++;
+
+	ctx->connected_once = true;
+	ctx->backoff_ms = 0;
+	mq_set_state(ctx, MQ_STATE_READY, 0);
+
+	ctx->connected_cb(ctx->connection_data);
+	return;
+
+close_conn:
+	l_io_destroy(ctx->amqp_io);
+	ctx->amqp_io = NULL;
+	close_connection(ctx);
+retry:
+	mq_schedule_retry(ctx);
+}
+
+static bool on_connect_event(struct l_io *io, void *user_data)
+{
+	struct mq_context *ctx = user_data;
+	struct mq_connect *job = ctx->connect_job;
+	struct amqp_connection_info *info;
+	struct mq_endpoint *endpoint;
+	amqp_connection_state_t conn;
+	unsigned int i;
+	uint64_t now;
+	uint8_t event;
+
+	if (read(l_io_get_fd(io), &event, sizeof(event)) != sizeof(event))
+		return true;
+
+	if (event == MQ_CONNECT_AUTHENTICATING) {
+		mq_set_state(ctx, MQ_STATE_AUTHENTICATING, 0);
+		return true;
+	}
+
+	pthread_join(job->thread, NULL);
+	conn = job->conn;
+
+	now = l_time_now();
+
+	for (i = 0; i < job->endpoints->count; i++) {
+		endpoint = &job->endpoints->entries[i];
+
+		if (job->failed[i]) {
+			endpoint->latency_us = 0;
+		} else if (job->probed[i]) {
+			endpoint->latency_us = job->probe_us[i];
+			endpoint->probed_at = now;
+		}
+	}
+
+	if (conn) {
+		info = &ctx->endpoints->entries[job->connected].info;
+		l_info("Connected to broker %s:%d", info->host, info->port);
+		ctx->endpoint = job->connected;
+	}
+
+	ctx->connect_job = NULL;
+	mq_connect_free(job);
+
+	mq_connect_finish(ctx, conn);
+
+	/* The io was destroyed along with the job */
+	return true;
+}
+
+static void attempt_connection(struct l_timeout *ltimeout, void *user_data)
+{
+	struct mq_context *ctx = user_data;
+	struct mq_endpoint *endpoint;
+	struct mq_connect *job;
+	unsigned int i;
+	uint64_t now;
+	int fds[2];
+
+	/* Still trying */
+	if (ctx->connect_job)
+		return;
+
+	l_debug("Trying to connect to rabbitmq");
+
+	/* Check and close if a connection is already up */
+	close_connection(ctx);
+
+	/* Check and destroy if an IO is already allocated */
+	if (ctx->amqp_io) {
+		l_io_destroy(ctx->amqp_io);
+		ctx->amqp_io = NULL;
 	}
 
-	amqp_channel_open(mq_ctx.conn, 1);
-	r = amqp_get_rpc_reply(mq_ctx.conn);
-	if (r.reply_type != AMQP_RESPONSE_NORMAL) {
-		l_error("amqp_channel_open(): %s",
-			mq_rpc_reply_string(r));
-		goto close_conn;
+	if (pipe2(fds, O_CLOEXEC) < 0) {
+		l_error("Error on create connection pipe: %s",
+			strerror(errno));
+		mq_schedule_retry(ctx);
+		return;
 	}
 
-	mq_ctx.amqp_io = l_io_new(amqp_get_sockfd(mq_ctx.conn));
-	if (!mq_ctx.amqp_io)
-		goto close_channel;
+	/* Default settings for amqps urls */
+	if (!ctx->tls) {
+		struct tls_config config = { .verify_peer = true };
 
-	status = l_io_set_disconnect_handler(mq_ctx.amqp_io, on_disconnect,
-					     NULL, NULL);
-	if (!status) {
-		l_error("Error on set up disconnect handler");
-		goto io_destroy;
+		ctx->tls = tls_new(&config);
 	}
 
-	mq_ctx.connected_cb(mq_ctx.connection_data);
-	goto done;
+	job = l_new(struct mq_connect, 1);
+	job->endpoints = mq_endpoints_ref(ctx->endpoints);
+	job->probe_us = l_new(uint64_t, ctx->endpoints->count);
+	job->probed = l_new(bool, ctx->endpoints->count);
+	job->failed = l_new(bool, ctx->endpoints->count);
+	job->tls = tls_ref(ctx->tls);
+	job->notify_fd = fds[1];
+	pthread_mutex_init(&job->lock, NULL);
+
+	/* Only stale and failed endpoints are probed by the attempt */
+	now = l_time_now();
+	for (i = 0; i < ctx->endpoints->count; i++) {
+		endpoint = &ctx->endpoints->entries[i];
+
+		if (endpoint->latency_us && now - endpoint->probed_at <
+				(uint64_t) MQ_PROBE_MAX_AGE_S * 1000000)
+			job->probe_us[i] = endpoint->latency_us;
+	}
 
-io_destroy:
-	l_io_destroy(mq_ctx.amqp_io);
-	mq_ctx.amqp_io = NULL;
-close_channel:
-	r = amqp_channel_close(mq_ctx.conn, 1, AMQP_REPLY_SUCCESS);
-	if (r.reply_type != AMQP_RESPONSE_NORMAL)
-		l_error("amqp_channel_close: %s",
-				mq_rpc_reply_string(r));
-close_conn:
-	r = amqp_connection_close(mq_ctx.conn, AMQP_REPLY_SUCCESS);
-	if (r.reply_type != AMQP_RESPONSE_NORMAL)
-		l_error("amqp_connection_close: %s",
-			mq_rpc_reply_string(r));
-destroy_conn:
-	status = amqp_destroy_connection(mq_ctx.conn);
-	if (status < 0)
-		l_error("status destroy: %s", amqp_error_string2(status));
+	job->io = l_io_new(fds[0]);
+	l_io_set_close_on_destroy(job->io, true);
+	l_io_set_read_handler(job->io, on_connect_event, ctx, NULL);
 
-	mq_ctx.conn = NULL;
-	l_timeout_modify_ms(ltimeout, MQ_CONNECTION_RETRY_TIMEOUT_MS);
-done:
-	l_free(tmp_url);
-}
+	mq_set_state(ctx, MQ_STATE_CONNECTING, 0);
 
-static int mq_prepare_queue(amqp_bytes_t queue, const char *exchange,
-			    const char *exchange_type, const char *routing_key)
-{
-	if (exchange == NULL || exchange_type == NULL || routing_key == NULL)
-		return -1;
+	if (pthread_create(&job->thread, NULL, mq_connect_thread, job)) {
+		l_error("Error on create connection thread");
+		mq_connect_free(job);
+		mq_schedule_retry(ctx);
+		return;
+	}
 
-	/* Declare the exchange as durable */
-	amqp_exchange_declare(mq_ctx.conn, 1,
-			amqp_cstring_bytes(exchange),
-			amqp_cstring_bytes(exchange_type),
-			0 /* passive*/,
-			1 /* durable */,
-			0 /* auto_delete*/,
-			0 /* internal */,
-			amqp_empty_table);
+	ctx->connect_job = job;
+}
 
-	/* Set up to bind a queue to an exchange */
-	amqp_queue_bind(mq_ctx.conn, 1, queue,
-			amqp_cstring_bytes(exchange),
-			amqp_cstring_bytes(routing_key),
-			amqp_empty_table);
+static void mq_capture_publish(struct mq_context *ctx, const char *exchange,
+			       const char *type, const char *routing_key,
+			       uint64_t expiration_ms, amqp_bytes_t reply_to,
+			       const char *correlation_id, amqp_bytes_t body)
+{
+	struct capture_record record = {
+		.direction = CAPTURE_OUT,
+		.exchange = exchange,
+		.routing_key = routing_key ? : "",
+		.expiration_ms = expiration_ms,
+		.body = body.bytes,
+		.body_len = body.len,
+	};
+	char reply_to_str[MQ_SHORTSTR_MAX + 1];
+
+	if (!strcmp(type, AMQP_EXCHANGE_TYPE_FANOUT))
+		record.flags |= CAPTURE_FANOUT;
 
-	if (amqp_get_rpc_reply(mq_ctx.conn).reply_type !=
-			       AMQP_RESPONSE_NORMAL) {
-		l_error("Error while binding queue");
-		return -1;
+	if (reply_to.bytes) {
+		snprintf(reply_to_str, sizeof(reply_to_str), "%.*s",
+			 (int) reply_to.len, (char *) reply_to.bytes);
+		record.reply_to = reply_to_str;
+		record.correlation_id = correlation_id;
 	}
 
-	return 0;
+	capture_write(ctx->capture, &record);
 }
 
-static int mq_publish_message(const char *exchange,
+static int mq_publish_message(struct mq_context *ctx,
+			      const char *exchange,
 			      const char *type,
 			      const char *routing_key,
 			      amqp_table_entry_t *headers,
@@ -343,26 +1509,21 @@ static int mq_publish_message(const char *exchange,
 			      const char *body)
 {
 	amqp_basic_properties_t props;
-	amqp_rpc_reply_t resp;
 	amqp_bytes_t routing_key_bytes;
+	amqp_bytes_t body_bytes;
+	amqp_table_entry_t entries[MQ_HEADERS_MAX];
+	char trace_id[MQ_TRACE_ID_LEN];
+	uint64_t start, now_us;
 	char *expiration_str;
 	int8_t rc; // Return Code
 
-	/* Declare the exchange as durable */
-	amqp_exchange_declare(mq_ctx.conn, 1,
-			amqp_cstring_bytes(exchange),
-			amqp_cstring_bytes(type),
-			0 /* passive*/,
-			1 /* durable */,
-			0 /* auto_delete*/,
-			0 /* internal */,
-			amqp_empty_table);
-	resp = amqp_get_rpc_reply(mq_ctx.conn);
-	if (resp.reply_type != AMQP_RESPONSE_NORMAL) {
-		l_error("amqp_exchange_declare(): %s",
-			mq_rpc_reply_string(resp));
-		return -1;
-	}
+	ctx->stats.publish_calls++;
+
+	if (!ctx->conn)
+		goto fail;
+
+	if (mq_declare_exchange(ctx, exchange, type, true))
+		goto fail;
 
 	props._flags =	AMQP_BASIC_CONTENT_TYPE_FLAG	|
 			AMQP_BASIC_DELIVERY_MODE_FLAG;
@@ -372,7 +1533,7 @@ static int mq_publish_message(const char *exchange,
 			props.correlation_id =
 					amqp_cstring_bytes(correlation_id);
 		else
-			return -1;
+			goto fail;
 
 		props._flags |= AMQP_BASIC_REPLY_TO_FLAG |
 				AMQP_BASIC_CORRELATION_ID_FLAG;
@@ -380,7 +1541,7 @@ static int mq_publish_message(const char *exchange,
 		props.reply_to = amqp_bytes_malloc_dup(reply_to);
 		if (!props.reply_to.bytes) {
 			l_error("Out of memory while copying queue name");
-			return -1;
+			goto fail;
 		}
 	} else {
 		props.reply_to = amqp_empty_bytes;
@@ -392,6 +1553,30 @@ static int mq_publish_message(const char *exchange,
 		props.expiration = amqp_cstring_bytes(expiration_str);
 	}
 
+	now_us = mq_wallclock_us();
+	props._flags |= AMQP_BASIC_TIMESTAMP_FLAG;
+	props.timestamp = now_us / 1000000;
+
+	if (ctx->trace && num_headers + 2 <= MQ_HEADERS_MAX) {
+		memcpy(entries, headers, num_headers * sizeof(*headers));
+
+		entries[num_headers].key =
+				amqp_cstring_bytes(MQ_HEADER_TIMESTAMP);
+		entries[num_headers].value.kind = AMQP_FIELD_KIND_I64;
+		entries[num_headers].value.value.i64 = now_us;
+
+		snprintf(trace_id, sizeof(trace_id), "%08x.%"PRIu64,
+			 ctx->trace_prefix, ++ctx->trace_seq);
+		entries[num_headers + 1].key =
+				amqp_cstring_bytes(MQ_HEADER_TRACE_ID);
+		entries[num_headers + 1].value.kind = AMQP_FIELD_KIND_UTF8;
+		entries[num_headers + 1].value.value.bytes =
+						amqp_cstring_bytes(trace_id);
+
+		headers = entries;
+		num_headers += 2;
+	}
+
 	if (num_headers > 0) {
 		props._flags |= AMQP_BASIC_HEADERS_FLAG;
 		props.headers.num_entries = num_headers;
@@ -406,20 +1591,37 @@ static int mq_publish_message(const char *exchange,
 	else
 		routing_key_bytes = amqp_empty_bytes;
 
-	l_debug("Publish -> exchange: %s, routingkey: %s\nBody: %s\n",
-		exchange,
-		routing_key,
-		body);
+	body_bytes = amqp_cstring_bytes(body);
+
+	log_trace("Publish -> exchange: %s, routingkey: %s\n"
+		  "Body (%zu bytes): %.*s\n",
+		  exchange,
+		  routing_key ? : "",
+		  body_bytes.len,
+		  LOG_PAYLOAD_LEN(body_bytes.len),
+		  body);
 
-	rc = amqp_basic_publish(mq_ctx.conn, 1,
+	start = l_time_now();
+	rc = amqp_basic_publish(ctx->conn, 1,
 			amqp_cstring_bytes(exchange),
 			routing_key_bytes,
 			0 /* mandatory */,
 			0 /* immediate */,
-			&props, amqp_cstring_bytes(body));
-	if (rc < 0)
-		l_error("amqp_basic_publish(): %s",
-			amqp_error_string2(rc));
+			&props, body_bytes);
+	stats_histogram_add(&ctx->stats.publish, l_time_now() - start);
+
+	if (rc < 0) {
+		log_error_ratelimit("amqp_basic_publish(): %s",
+				    amqp_error_string2(rc));
+		ctx->stats.publish_errors++;
+	} else {
+		ctx->stats.bytes_out += body_bytes.len;
+
+		if (ctx->capture)
+			mq_capture_publish(ctx, exchange, type, routing_key,
+					   expiration_ms, reply_to,
+					   correlation_id, body_bytes);
+	}
 
 	if (expiration_ms)
 		l_free(expiration_str);
@@ -428,10 +1630,15 @@ static int mq_publish_message(const char *exchange,
 		amqp_bytes_free(props.reply_to);
 
 	return rc;
+
+fail:
+	ctx->stats.publish_errors++;
+	return -1;
 }
 
 /**
  * mq_publish_direct_message_rpc:
+ * @ctx: message queue context
  * @exchange: exchange name
  * @routing_key: routing key name
  * @headers: array of table entry with headers
@@ -447,7 +1654,8 @@ static int mq_publish_message(const char *exchange,
  *
  * Returns: 0 if successful and negative integer otherwise.
  */
-int8_t mq_publish_direct_message_rpc(const char *exchange,
+int8_t mq_publish_direct_message_rpc(struct mq_context *ctx,
+				     const char *exchange,
 				     const char *routing_key,
 				     amqp_table_entry_t *headers,
 				     size_t num_headers,
@@ -456,7 +1664,7 @@ int8_t mq_publish_direct_message_rpc(const char *exchange,
 				     const char *correlation_id,
 				     const char *body)
 {
-	return mq_publish_message(exchange, AMQP_EXCHANGE_TYPE_DIRECT,
+	return mq_publish_message(ctx, exchange, AMQP_EXCHANGE_TYPE_DIRECT,
 				  routing_key, headers,
 				  num_headers, expiration_ms,
 				  reply_to, correlation_id, body);
@@ -464,6 +1672,7 @@ int8_t mq_publish_direct_message_rpc(const char *exchange,
 
 /**
  * mq_publish_direct_message:
+ * @ctx: message queue context
  * @exchange: exchange name
  * @routing_key: routing key name
  * @headers: array of table entry with headers
@@ -475,14 +1684,15 @@ int8_t mq_publish_direct_message_rpc(const char *exchange,
  *
  * Returns: 0 if successful and negative integer otherwise.
  */
-int8_t mq_publish_direct_message(const char *exchange,
+int8_t mq_publish_direct_message(struct mq_context *ctx,
+				 const char *exchange,
 				 const char *routing_key,
 				 amqp_table_entry_t *headers,
 				 size_t num_headers,
 				 uint64_t expiration_ms,
 				 const char *body)
 {
-	return mq_publish_message(exchange, AMQP_EXCHANGE_TYPE_DIRECT,
+	return mq_publish_message(ctx, exchange, AMQP_EXCHANGE_TYPE_DIRECT,
 				  routing_key, headers,
 				  num_headers, expiration_ms,
 				  amqp_empty_bytes, NULL, body);
@@ -490,6 +1700,7 @@ int8_t mq_publish_direct_message(const char *exchange,
 
 /**
  * mq_publish_fanout_message:
+ * @ctx: message queue context
  * @exchange: exchange name
  * @headers: array of table entry with headers
  * @num_headers: headers length
@@ -500,13 +1711,14 @@ int8_t mq_publish_direct_message(const char *exchange,
  *
  * Returns: 0 if successful and negative integer otherwise.
  */
-int8_t mq_publish_fanout_message(const char *exchange,
+int8_t mq_publish_fanout_message(struct mq_context *ctx,
+				 const char *exchange,
 				 amqp_table_entry_t *headers,
 				 size_t num_headers,
 				 uint64_t expiration_ms,
 				 const char *body)
 {
-	return mq_publish_message(exchange, AMQP_EXCHANGE_TYPE_FANOUT,
+	return mq_publish_message(ctx, exchange, AMQP_EXCHANGE_TYPE_FANOUT,
 				  NULL, headers,
 				  num_headers, expiration_ms,
 				  amqp_empty_bytes, NULL, body);
@@ -514,60 +1726,80 @@ int8_t mq_publish_fanout_message(const char *exchange,
 
 /**
  * mq_declare_new_queue:
+ * @ctx: message queue context
  * @name: queue name
  *
- * Declares a durable queue in amqp connection.
+ * Declares a durable queue in amqp connection. The declare is pipelined, it
+ * is confirmed by the next mq_sync(). The queue, its bindings and consumer
+ * are restored on reconnection, as long as it is not deleted.
  *
  * Returns: the queue declared or NULL otherwise.
  */
-amqp_bytes_t mq_declare_new_queue(const char *name)
+amqp_bytes_t mq_declare_new_queue(struct mq_context *ctx,
+				  const char *name)
 {
 	amqp_bytes_t queue;
-	amqp_queue_declare_ok_t *r;
+	struct mq_queue *record;
 
-	if (!mq_ctx.conn) {
-		queue.bytes = NULL;
+	queue.bytes = NULL;
+
+	if (!ctx->conn)
 		return queue;
-	}
 
-	r = amqp_queue_declare(mq_ctx.conn, 1,
-			amqp_cstring_bytes(name),
-			0, /* passive */
-			1, /* durable */
-			0, /* exclusive */
-			0, /* auto-delete */
-			amqp_empty_table);
+	if (mq_send_queue_declare(ctx, amqp_cstring_bytes(name)))
+		return queue;
 
-	if (amqp_get_rpc_reply(mq_ctx.conn).reply_type !=
-			       AMQP_RESPONSE_NORMAL) {
-		l_error("Error declaring queue name");
-		queue.bytes = NULL;
+	queue = amqp_bytes_malloc_dup(amqp_cstring_bytes(name));
+	if (queue.bytes == NULL) {
+		l_error("Out of memory while copying queue buffer");
 		return queue;
 	}
 
-	queue = amqp_bytes_malloc_dup(r->queue);
-	if (queue.bytes == NULL)
-		l_error("Out of memory while copying queue buffer");
+	if (mq_queue_find(ctx, queue))
+		return queue;
+
+	record = l_new(struct mq_queue, 1);
+	record->ctx = ctx;
+	record->name = amqp_bytes_malloc_dup(queue);
+	record->bindings = l_queue_new();
+
+	if (!ctx->queues)
+		ctx->queues = l_queue_new();
+
+	l_queue_push_tail(ctx->queues, record);
 
 	return queue;
 }
 
 /**
  * mq_delete_queue:
+ * @ctx: message queue context
  * @name: queue name
  *
- * Delete a queue in amqp connection.
+ * Delete a queue in amqp connection. The delete is pipelined, it is
+ * confirmed by the next mq_sync().
  *
  * Returns: 0 if successful and -1 otherwise.
  */
-int mq_delete_queue(amqp_bytes_t queue)
+int mq_delete_queue(struct mq_context *ctx, amqp_bytes_t queue)
 {
-	if (!mq_ctx.conn)
+	amqp_queue_delete_t req = {
+		.queue = queue,
+		.if_unused = 0,
+		.if_empty = 0,
+		.nowait = 1,
+	};
+	struct mq_queue *record;
+
+	record = l_queue_remove_if(ctx->queues, mq_queue_match, &queue);
+	if (record)
+		mq_queue_free(record);
+
+	if (!ctx->conn)
 		return -1;
 
-	amqp_queue_delete(mq_ctx.conn, 1, queue, 0, 0);
-	if (amqp_get_rpc_reply(mq_ctx.conn).reply_type !=
-			       AMQP_RESPONSE_NORMAL) {
+	if (amqp_send_method(ctx->conn, 1, AMQP_QUEUE_DELETE_METHOD, &req) !=
+							AMQP_STATUS_OK) {
 		l_error("Error deleting queue name");
 		return -1;
 	}
@@ -575,53 +1807,170 @@ int mq_delete_queue(amqp_bytes_t queue)
 	return 0;
 }
 
+/**
+ * mq_sync:
+ * @ctx: message queue context
+ *
+ * Waits for the broker to process every method sent before. Declares, binds
+ * and consumers are pipelined without waiting for a reply, so a whole
+ * topology is set up in a single round trip ending here. The broker closes
+ * the channel if any of them failed, which is reported by this call.
+ *
+ * Returns: 0 if successful and -1 otherwise.
+ */
+int mq_sync(struct mq_context *ctx)
+{
+	amqp_rpc_reply_t resp;
+
+	if (!ctx->conn)
+		return -1;
+
+	/* Any synchronous method works, amq.direct always exists */
+	amqp_exchange_declare(ctx->conn, 1,
+			amqp_cstring_bytes("amq.direct"),
+			amqp_cstring_bytes(AMQP_EXCHANGE_TYPE_DIRECT),
+			1 /* passive*/,
+			0 /* durable */,
+			0 /* auto_delete*/,
+			0 /* internal */,
+			amqp_empty_table);
+	resp = amqp_get_rpc_reply(ctx->conn);
+	if (resp.reply_type != AMQP_RESPONSE_NORMAL) {
+		l_error("Error setting up topology: %s",
+			mq_rpc_reply_string(resp));
+
+		/* Pipelined exchange declares may have failed */
+		l_hashmap_destroy(ctx->exchanges, NULL);
+		ctx->exchanges = l_hashmap_string_new();
+		return -1;
+	}
+
+	return 0;
+}
+
 /**
  * mq_prepare_queue:
+ * @ctx: message queue context
  * @queue: queue declared
  * @exchange: exchange to be declared
  * @routing_key: routing key to bind
  *
  * Declares a exchange and bind a routing key to a queue to be a consumer.
+ * While the connection is down the binding is only recorded, to be sent when
+ * the topology of @queue is restored.
  *
  * Returns: 0 if successful and -1 otherwise.
  */
-int mq_prepare_direct_queue(amqp_bytes_t queue, const char *exchange,
-			    const char *routing_key)
+int mq_prepare_direct_queue(struct mq_context *ctx, amqp_bytes_t queue,
+			    const char *exchange, const char *routing_key)
 {
-	return mq_prepare_queue(queue, exchange, AMQP_EXCHANGE_TYPE_DIRECT,
-				routing_key);
+	return mq_prepare_queue(ctx, queue, exchange,
+				AMQP_EXCHANGE_TYPE_DIRECT, routing_key);
+}
+
+/**
+ * mq_unbind_queue:
+ * @ctx: message queue context
+ * @queue: queue declared
+ * @exchange: exchange the queue is bound to
+ * @routing_key: routing key to unbind
+ *
+ * Removes a binding created by mq_prepare_direct_queue().
+ *
+ * Returns: 0 if successful and -1 otherwise.
+ */
+int mq_unbind_queue(struct mq_context *ctx, amqp_bytes_t queue,
+		    const char *exchange, const char *routing_key)
+{
+	struct mq_binding key = {
+		.exchange = (char *) exchange,
+		.routing_key = (char *) routing_key,
+	};
+	struct mq_binding *binding;
+	struct mq_queue *record;
+
+	if (!ctx->conn || !queue.bytes)
+		return -1;
+
+	amqp_queue_unbind(ctx->conn, 1, queue,
+			  amqp_cstring_bytes(exchange),
+			  amqp_cstring_bytes(routing_key),
+			  amqp_empty_table);
+
+	if (amqp_get_rpc_reply(ctx->conn).reply_type !=
+			       AMQP_RESPONSE_NORMAL) {
+		l_error("Error while unbinding queue");
+		return -1;
+	}
+
+	record = mq_queue_find(ctx, queue);
+	binding = record ? l_queue_remove_if(record->bindings,
+					     mq_binding_match, &key) : NULL;
+	if (binding)
+		mq_binding_free(binding);
+
+	return 0;
 }
 
 /**
  * mq_consumer_queue:
+ * @ctx: message queue context
  * @queue: queue that is going to be consume
  *
- * Start a queue consumer.
+ * Start a queue consumer, tagged with the queue name. Deliveries must be
+ * acknowledged, which is done by mq_settle() according to the read callback
+ * result. The consumer is pipelined, it is confirmed by the next mq_sync().
  *
  * Returns: 0 if successful and -1 otherwise.
  */
-int mq_consumer_queue(amqp_bytes_t queue)
+int mq_consumer_queue(struct mq_context *ctx, amqp_bytes_t queue)
 {
-	/* Start a queue consumer */
-	amqp_basic_consume(mq_ctx.conn, 1,
-			queue,
-			amqp_empty_bytes,
-			0, /* no_local */
-			1, /* no_ack */
-			0, /* exclusive */
-			amqp_empty_table);
+	struct mq_queue *record;
 
-	if (amqp_get_rpc_reply(mq_ctx.conn).reply_type !=
-							AMQP_RESPONSE_NORMAL) {
-		l_error("Error while starting consumer");
+	if (!ctx->conn)
+		return -1;
+
+	if (mq_send_consume(ctx, queue, false))
+		return -1;
+
+	record = mq_queue_find(ctx, queue);
+	if (record)
+		record->consuming = true;
+
+	return 0;
+}
+
+/**
+ * mq_consume_direct_reply:
+ * @ctx: message queue context
+ *
+ * Starts consuming from the RabbitMQ direct reply-to pseudo queue, so
+ * messages published with MQ_DIRECT_REPLY_TO as reply-to get their replies
+ * on this connection without a reply queue. Replies are not acknowledged,
+ * mq_settle() ignores them. Must be called before publishing such messages.
+ *
+ * Returns: 0 if successful and -1 otherwise.
+ */
+int mq_consume_direct_reply(struct mq_context *ctx)
+{
+	if (!ctx->conn)
+		return -1;
+
+	if (ctx->direct_reply)
+		return 0;
+
+	if (mq_send_consume(ctx, amqp_cstring_bytes(MQ_DIRECT_REPLY_TO),
+			    true))
 		return -1;
-	}
+
+	ctx->direct_reply = true;
 
 	return 0;
 }
 
 /**
  * mq_set_read_cb:
+ * @ctx: message queue context
  * @read_cb: callback to be called when receive some amqp message
  * @user_data: user data provided to callback
  *
@@ -629,21 +1978,23 @@ int mq_consumer_queue(amqp_bytes_t queue)
  *
  * Returns: 0 if successful and -1 otherwise.
  */
-int mq_set_read_cb(mq_read_cb_t read_cb, void *user_data)
+int mq_set_read_cb(struct mq_context *ctx, mq_read_cb_t read_cb,
+		   void *user_data)
 {
 	int err;
 
-	mq_ctx.read_cb = read_cb;
+	ctx->read_cb = read_cb;
+	ctx->read_data = user_data;
 
-	if (!mq_ctx.amqp_io) {
+	if (!ctx->amqp_io) {
 		l_error("Error amqp service not started");
 		return -1;
 	}
 
-	err = l_io_set_read_handler(mq_ctx.amqp_io, on_receive,
-				    user_data, NULL);
+	err = l_io_set_read_handler(ctx->amqp_io, on_receive,
+				    ctx, NULL);
 	if (!err) {
-		l_io_destroy(mq_ctx.amqp_io);
+		l_io_destroy(ctx->amqp_io);
 		l_error("Error on set up read handler on AMQP io");
 		return -1;
 	}
@@ -651,27 +2002,288 @@ int mq_set_read_cb(mq_read_cb_t read_cb, void *user_data)
 	return 0;
 }
 
-int mq_start(char *url, mq_connected_cb_t connected_cb,
+/**
+ * mq_inject:
+ * @ctx: message queue context
+ * @exchange: exchange the message was published to
+ * @routing_key: routing key of the message
+ * @correlation_id: correlation id or NULL if not set
+ * @body: the message received
+ *
+ * Hands a message to the read callback as if it was consumed from a queue,
+ * e.g. to replay a capture. The broker isn't involved: the delivery isn't
+ * acknowledged and it isn't captured again.
+ *
+ * Returns: 0 if successful and -1 if the read callback is not set.
+ */
+int mq_inject(struct mq_context *ctx, const char *exchange,
+	      const char *routing_key, const char *correlation_id,
+	      const char *body)
+{
+	struct mq_delivery delivery = {
+		.generation = ctx->generation,
+		.no_ack = true,
+	};
+	size_t body_len = strlen(body);
+
+	if (!ctx->read_cb)
+		return -1;
+
+	alloc_site_enter(ALLOC_SITE_RECEIVE);
+
+	delivery.arena = mq_arena_acquire(ctx);
+	delivery.exchange = arena_strndup(delivery.arena, exchange,
+					  strlen(exchange));
+	delivery.routing_key = arena_strndup(delivery.arena, routing_key,
+					     strlen(routing_key));
+	delivery.body = arena_strndup(delivery.arena, body, body_len);
+	if (correlation_id)
+		delivery.correlation_id = arena_strndup(delivery.arena,
+							correlation_id,
+							strlen(correlation_id));
+
+	ctx->stats.messages_in++;
+	ctx->stats.bytes_in += body_len;
+
+	mq_deliver(ctx, &delivery);
+	alloc_site_leave();
+
+	return 0;
+}
+
+/**
+ * mq_set_capture:
+ * @ctx: message queue context
+ * @path: capture file, NULL to stop capturing
+ *
+ * Records the messages consumed and published from now on, along with
+ * their timing, to be replayed later. A previous capture is completed.
+ *
+ * Returns: 0 if successful and -1 otherwise.
+ */
+int mq_set_capture(struct mq_context *ctx, const char *path)
+{
+	capture_free(ctx->capture);
+	ctx->capture = NULL;
+
+	if (!path)
+		return 0;
+
+	ctx->capture = capture_new(path);
+
+	return ctx->capture ? 0 : -1;
+}
+
+/**
+ * mq_set_arena_retain:
+ * @ctx: message queue context
+ * @retain: true to keep the receive arena memory between deliveries
+ *
+ * By default the memory used to process a delivery is given back to the
+ * system as soon as the read callback returns. When retaining, it is reset
+ * and reused by the next delivery instead.
+ */
+void mq_set_arena_retain(struct mq_context *ctx, bool retain)
+{
+	ctx->arena_retain = retain;
+
+	if (retain && !ctx->arena_pool)
+		ctx->arena_pool = l_queue_new();
+
+	if (!retain) {
+		l_queue_destroy(ctx->arena_pool,
+				(l_queue_destroy_func_t) arena_free);
+		ctx->arena_pool = NULL;
+	}
+}
+
+/**
+ * mq_new:
+ *
+ * Creates a message queue context. Each context owns its own connection,
+ * so many of them can be used independently in the same process.
+ *
+ * Returns: the context created.
+ */
+struct mq_context *mq_new(void)
+{
+	return l_new(struct mq_context, 1);
+}
+
+/**
+ * mq_free:
+ * @ctx: context created by mq_new()
+ *
+ * Stops the context connection and releases it.
+ */
+void mq_free(struct mq_context *ctx)
+{
+	if (!ctx)
+		return;
+
+	mq_stop(ctx);
+	l_queue_destroy(ctx->arena_pool, (l_queue_destroy_func_t) arena_free);
+	l_hashmap_destroy(ctx->exchanges, NULL);
+	tls_unref(ctx->tls);
+	capture_free(ctx->capture);
+	l_free(ctx);
+}
+
+/**
+ * mq_set_tls:
+ * @ctx: message queue context
+ * @config: TLS settings used by amqps urls
+ *
+ * Replaces the TLS settings. The session resumed on reconnection is kept by
+ * these settings, so it is dropped.
+ */
+void mq_set_tls(struct mq_context *ctx, const struct tls_config *config)
+{
+	tls_unref(ctx->tls);
+	ctx->tls = tls_new(config);
+}
+
+/**
+ * mq_get_tls_stats:
+ * @ctx: message queue context
+ * @stats: filled with the TLS handshakes done so far
+ */
+void mq_get_tls_stats(struct mq_context *ctx, struct tls_stats *stats)
+{
+	if (!ctx->tls) {
+		memset(stats, 0, sizeof(*stats));
+		return;
+	}
+
+	tls_get_stats(ctx->tls, stats);
+}
+
+/**
+ * mq_set_trace:
+ * @ctx: message queue context
+ * @enable: true to add trace headers to outgoing messages
+ *
+ * Every message has the AMQP timestamp property, in seconds. Tracing adds
+ * the send time in microseconds and a trace id unique per message, made of
+ * a random prefix of @ctx and a sequence number.
+ */
+void mq_set_trace(struct mq_context *ctx, bool enable)
+{
+	ctx->trace = enable;
+
+	if (!ctx->trace_prefix)
+		ctx->trace_prefix = l_getrandom_uint32();
+}
+
+/**
+ * mq_get_stats:
+ * @ctx: message queue context
+ * @stats: filled with the counters of @ctx
+ *
+ * The disconnected time includes the current disconnection, if any.
+ */
+void mq_get_stats(struct mq_context *ctx, struct mq_stats *stats)
+{
+	*stats = ctx->stats;
+
+	if (ctx->disconnected_since)
+		stats->disconnected_us += l_time_now() -
+						ctx->disconnected_since;
+}
+
+/**
+ * mq_set_state_cb:
+ * @ctx: message queue context
+ * @state_cb: callback called on every connection state change
+ * @user_data: user data provided to @state_cb
+ *
+ * The callback gets the delay until the next attempt when the state is
+ * MQ_STATE_BACKING_OFF and 0 otherwise.
+ */
+void mq_set_state_cb(struct mq_context *ctx, mq_state_cb_t state_cb,
+		     void *user_data)
+{
+	ctx->state_cb = state_cb;
+	ctx->state_data = user_data;
+}
+
+/**
+ * mq_start:
+ * @ctx: message queue context
+ * @url: AMQP broker url, or a comma separated list of broker urls
+ * @connected_cb: callback called when the connection is up
+ * @disconnected_cb: callback called when the connection is lost
+ * @user_data: user data provided to callbacks
+ *
+ * Starts connecting to the broker, retrying until the connection is up.
+ * Retries are delayed by an exponential backoff with jitter.
+ *
+ * Each attempt on a broker list connects to the fastest broker, failing over
+ * to the next ones within the same attempt. Connect latencies are cached, a
+ * broker is only probed again once its latency is stale or it failed.
+ *
+ * Returns: 0 if successful and -1 otherwise.
+ */
+int mq_start(struct mq_context *ctx, const char *url,
+	     mq_connected_cb_t connected_cb,
 	     mq_disconnected_cb_t disconnected_cb, void *user_data)
 {
-	mq_ctx.connected_cb = connected_cb;
-	mq_ctx.disconnected_cb = disconnected_cb;
-	mq_ctx.connection_data = user_data;
+	struct mq_endpoints *endpoints;
+
+	endpoints = mq_endpoints_new(url);
+	if (!endpoints)
+		return -1;
+
+	ctx->connected_cb = connected_cb;
+	ctx->disconnected_cb = disconnected_cb;
+	ctx->connection_data = user_data;
 
-	mq_ctx.conn_retry_timeout = l_timeout_create_ms(1, // start in oneshot
-							attempt_connection,
-							url, NULL);
+	mq_endpoints_unref(ctx->endpoints);
+	ctx->endpoints = endpoints;
+	ctx->endpoint = 0;
+
+	ctx->conn_retry_timeout = l_timeout_create_ms(1, // start in oneshot
+						      attempt_connection,
+						      ctx, NULL);
 
 	return 0;
 }
 
-void mq_stop(void)
+void mq_stop(struct mq_context *ctx)
 {
-	l_timeout_remove(mq_ctx.conn_retry_timeout);
-	mq_ctx.conn_retry_timeout = NULL;
+	if (ctx->connect_job) {
+		mq_connect_abandon(ctx->connect_job);
+		ctx->connect_job = NULL;
+	}
+
+	if (ctx->state != MQ_STATE_DISCONNECTED)
+		mq_set_state(ctx, MQ_STATE_DISCONNECTED, 0);
+
+	/* Not counted as disconnected while stopped */
+	if (ctx->disconnected_since) {
+		ctx->stats.disconnected_us += l_time_now() -
+						ctx->disconnected_since;
+		ctx->disconnected_since = 0;
+	}
+
+	ctx->connected_once = false;
+	ctx->backoff_ms = 0;
+
+	l_timeout_remove(ctx->conn_retry_timeout);
+	ctx->conn_retry_timeout = NULL;
+
+	l_io_destroy(ctx->amqp_io);
+	ctx->amqp_io = NULL;
+
+	close_connection(ctx);
+
+	l_queue_clear(ctx->arena_pool, (l_queue_destroy_func_t) arena_free);
 
-	l_io_destroy(mq_ctx.amqp_io);
-	mq_ctx.amqp_io = NULL;
+	/* Nothing to restore on the next start */
+	l_queue_destroy(ctx->queues, mq_queue_free);
+	ctx->queues = NULL;
+	ctx->direct_reply = false;
 
-	close_connection();
+	mq_endpoints_unref(ctx->endpoints);
+	ctx->endpoints = NULL;
 }
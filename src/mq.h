@@ -18,12 +18,65 @@
  *  Message Queue header file
  */
 
-typedef bool (*mq_read_cb_t) (const char *exchange, const char *routing_key,
-			      const char *body, void *user_data);
+/* Pseudo queue for replies without declaring a reply queue */
+#define MQ_DIRECT_REPLY_TO "amq.rabbitmq.reply-to"
+
+/* Counters of the connection, kept across reconnections */
+struct mq_stats {
+	uint64_t publish_calls;
+	uint64_t publish_errors;
+	uint64_t bytes_out;
+	uint64_t messages_in;
+	uint64_t bytes_in;
+	uint64_t reconnects;
+	/* Time without a connection up while started */
+	uint64_t disconnected_us;
+	/* amqp_basic_publish() duration in microseconds */
+	struct stats_histogram publish;
+	/* Time from the sender to us, of the messages stamped */
+	struct stats_histogram delivery_lag;
+};
+
+enum mq_read_result {
+	MQ_READ_ACK,		/* Consumed */
+	MQ_READ_REQUEUE,	/* Not consumed, queued again once */
+	MQ_READ_REJECT,		/* Unusable, dropped */
+	MQ_READ_PENDING		/* Settled later through mq_settle() */
+};
+
+struct mq_delivery {
+	const char *exchange;
+	const char *routing_key;
+	const char *body;
+	const char *correlation_id;	/* NULL if not set */
+	struct arena *arena;
+	uint64_t tag;
+	unsigned int generation;
+	uint64_t lag_us;		/* 0 if unknown */
+	bool redelivered;
+	bool no_ack;
+};
+
+typedef enum mq_read_result (*mq_read_cb_t) (
+					const struct mq_delivery *delivery,
+					void *user_data);
+enum mq_state {
+	MQ_STATE_DISCONNECTED,
+	MQ_STATE_CONNECTING,
+	MQ_STATE_AUTHENTICATING,
+	MQ_STATE_READY,
+	MQ_STATE_BACKING_OFF
+};
+
+typedef void (*mq_state_cb_t) (enum mq_state state, uint64_t delay_ms,
+			       void *user_data);
 typedef void (*mq_connected_cb_t) (void *user_data);
 typedef void (*mq_disconnected_cb_t) (void *user_data);
 
-int8_t mq_publish_direct_message_rpc(const char *exchange,
+struct mq_context;
+
+int8_t mq_publish_direct_message_rpc(struct mq_context *ctx,
+				     const char *exchange,
 				     const char *routing_key,
 				     amqp_table_entry_t *headers,
 				     size_t num_headers,
@@ -31,26 +84,50 @@ int8_t mq_publish_direct_message_rpc(const char *exchange,
 				     amqp_bytes_t reply_to,
 				     const char *correlation_id,
 				     const char *body);
-int8_t mq_publish_direct_message(const char *exchange,
+int8_t mq_publish_direct_message(struct mq_context *ctx,
+				 const char *exchange,
 				 const char *routing_key,
 				 amqp_table_entry_t *headers,
 				 size_t num_headers,
 				 uint64_t expiration_ms,
 				 const char *body);
-int8_t mq_publish_fanout_message(const char *exchange,
+int8_t mq_publish_fanout_message(struct mq_context *ctx,
+				 const char *exchange,
 				 amqp_table_entry_t *headers,
 				 size_t num_headers,
 				 uint64_t expiration_ms,
 				 const char *body);
 
-amqp_bytes_t mq_declare_new_queue(const char *name);
-int mq_delete_queue(amqp_bytes_t queue);
-int mq_prepare_direct_queue(amqp_bytes_t queue, const char *exchange,
-			    const char *routing_key);
-int mq_consumer_queue(amqp_bytes_t queue);
+amqp_bytes_t mq_declare_new_queue(struct mq_context *ctx, const char *name);
+int mq_delete_queue(struct mq_context *ctx, amqp_bytes_t queue);
+int mq_prepare_direct_queue(struct mq_context *ctx, amqp_bytes_t queue,
+			    const char *exchange, const char *routing_key);
+int mq_unbind_queue(struct mq_context *ctx, amqp_bytes_t queue,
+		    const char *exchange, const char *routing_key);
+int mq_consumer_queue(struct mq_context *ctx, amqp_bytes_t queue);
+int mq_consume_direct_reply(struct mq_context *ctx);
+int mq_sync(struct mq_context *ctx);
 
-int mq_set_read_cb(mq_read_cb_t read_cb, void *user_data);
+int mq_set_read_cb(struct mq_context *ctx, mq_read_cb_t read_cb,
+		   void *user_data);
+void mq_set_arena_retain(struct mq_context *ctx, bool retain);
+void mq_arena_release(struct mq_context *ctx, struct arena *arena);
+int mq_settle(struct mq_context *ctx, const struct mq_delivery *delivery,
+	      enum mq_read_result result);
+int mq_inject(struct mq_context *ctx, const char *exchange,
+	      const char *routing_key, const char *correlation_id,
+	      const char *body);
+int mq_set_capture(struct mq_context *ctx, const char *path);
 
-int mq_start(char *url, mq_connected_cb_t connected_cb,
+struct mq_context *mq_new(void);
+void mq_free(struct mq_context *ctx);
+int mq_start(struct mq_context *ctx, const char *url,
+	     mq_connected_cb_t connected_cb,
 	     mq_disconnected_cb_t disconnected_cb, void *user_data);
-void mq_stop(void);
+void mq_stop(struct mq_context *ctx);
+void mq_set_state_cb(struct mq_context *ctx, mq_state_cb_t state_cb,
+		     void *user_data);
+void mq_set_tls(struct mq_context *ctx, const struct tls_config *config);
+void mq_get_tls_stats(struct mq_context *ctx, struct tls_stats *stats);
+void mq_get_stats(struct mq_context *ctx, struct mq_stats *stats);
+void mq_set_trace(struct mq_context *ctx, bool enable);
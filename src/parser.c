@@ -20,6 +20,7 @@
 
 #include <errno.h>
 #include <stdio.h>
+#include <string.h>
 
 #include <ell/ell.h>
 
@@ -28,6 +29,8 @@
 
 #include <json-c/json.h>
 
+#include "arena.h"
+#include "base64.h"
 #include "parser.h"
 
 #define MIN(x, y) ((x) < (y) ? (x) : (y))
@@ -39,7 +42,7 @@ static int parse_json2data(json_object *jobj, knot_value_type *kvalue)
 {
 	json_object *jobjkey;
 	const char *str;
-	uint8_t *u8val;
+	int len;
 	size_t olen = 0;
 
 	jobjkey = jobj;
@@ -59,15 +62,13 @@ static int parse_json2data(json_object *jobj, knot_value_type *kvalue)
 		break;
 	case json_type_string:
 		str = json_object_get_string(jobjkey);
-		u8val = l_base64_decode(str, strlen(str), &olen);
-		if (!u8val)
+		/* Decoded straight into the value, truncated to its size */
+		len = base64_decode(str, json_object_get_string_len(jobjkey),
+				    kvalue->raw, KNOT_DATA_RAW_SIZE);
+		if (len < 0)
 			break;
 
-		if (olen > KNOT_DATA_RAW_SIZE)
-			olen = KNOT_DATA_RAW_SIZE; /* truncate */
-
-		memcpy(kvalue->raw, u8val, olen);
-		l_free(u8val);
+		olen = len;
 		break;
 	/* FIXME: not implemented */
 	case json_type_null:
@@ -212,12 +213,16 @@ struct l_queue *parser_queue_from_json_array(json_object *jobj,
 	return list;
 }
 
-struct l_queue *parser_request_to_list(json_object *jso)
+/*
+ * List items are taken from @arena when given, so they are released with it
+ * and the list must be destroyed without a destroy function.
+ */
+struct l_queue *parser_request_to_list(json_object *jso, struct arena *arena)
 {
 	struct l_queue *list;
 	json_object *json_array;
 	json_object *jobjentry;
-	int sensor_id;
+	int *sensor_id;
 	uint64_t i;
 
 	list = l_queue_new();
@@ -234,17 +239,24 @@ struct l_queue *parser_request_to_list(json_object *jso)
 		if (json_object_get_type(jobjentry) != json_type_int)
 			goto fail;
 
-		sensor_id = json_object_get_int(jobjentry);
+		if (arena)
+			sensor_id = arena_alloc(arena, sizeof(*sensor_id));
+		else
+			sensor_id = l_new(int, 1);
+
+		*sensor_id = json_object_get_int(jobjentry);
 
-		if (!l_queue_push_tail(list,
-				l_memdup(&sensor_id, sizeof(sensor_id))))
+		if (!l_queue_push_tail(list, sensor_id)) {
+			if (!arena)
+				l_free(sensor_id);
 			goto fail;
+		}
 	}
 
 	return list;
 
 fail:
-	l_queue_destroy(list, l_free);
+	l_queue_destroy(list, arena ? NULL : l_free);
 	return NULL;
 }
 
@@ -270,7 +282,7 @@ json_object *parser_sensorid_to_json(const char *key, struct l_queue *list)
 	return setdatajobj;
 }
 
-struct l_queue *parser_update_to_list(json_object *jso)
+struct l_queue *parser_update_to_list(json_object *jso, struct arena *arena)
 {
 	json_object *json_array;
 	json_object *json_data;
@@ -313,11 +325,15 @@ struct l_queue *parser_update_to_list(json_object *jso)
 			jtype != json_type_string)
 			goto fail;
 
-		msg = l_new(knot_msg_data, 1);
+		if (arena)
+			msg = arena_alloc(arena, sizeof(*msg));
+		else
+			msg = l_new(knot_msg_data, 1);
 
 		olen = parse_json2data(jobjkey, &msg->payload);
 		if (olen <= 0) {
-			l_free(msg);
+			if (!arena)
+				l_free(msg);
 			goto fail;
 		}
 
@@ -326,7 +342,8 @@ struct l_queue *parser_update_to_list(json_object *jso)
 		msg->hdr.payload_len = olen + sizeof(msg->sensor_id);
 
 		if (!l_queue_push_tail(list, msg)) {
-			l_free(msg);
+			if (!arena)
+				l_free(msg);
 			goto fail;
 		}
 	}
@@ -334,7 +351,7 @@ struct l_queue *parser_update_to_list(json_object *jso)
 	return list;
 
 fail:
-	l_queue_destroy(list, l_free);
+	l_queue_destroy(list, arena ? NULL : l_free);
 	return NULL;
 }
 
@@ -362,19 +379,11 @@ static bool knot_value_as_boolean(const knot_value_type *data)
 	return data->val_b;
 }
 
-static char *knot_value_as_raw(const knot_value_type *data,
-			       uint8_t kval_len, size_t *encoded_len)
+static size_t knot_value_as_raw(const knot_value_type *data,
+				uint8_t kval_len, char *encoded)
 {
-	char *encoded;
-	size_t olen;
-
-	encoded = l_base64_encode(data->raw, kval_len, 0, &olen);
-	if (!encoded)
-		return NULL;
-
-	*encoded_len = olen;
-
-	return encoded;
+	return base64_encode(data->raw, MIN(kval_len, KNOT_DATA_RAW_SIZE),
+			     encoded);
 }
 
 /*
@@ -409,7 +418,7 @@ json_object *parser_data_create_object(const char *device_id, uint8_t sensor_id,
 	json_object *json_msg;
 	json_object *data;
 	json_object *json_array;
-	char *encoded;
+	char encoded[BASE64_ENCODED_LEN(KNOT_DATA_RAW_SIZE)];
 	size_t encoded_len;
 
 	json_msg = json_object_new_object();
@@ -436,10 +445,7 @@ json_object *parser_data_create_object(const char *device_id, uint8_t sensor_id,
 		break;
 	case KNOT_VALUE_TYPE_RAW:
 		/* Encode as base64 */
-		encoded = knot_value_as_raw(value, kval_len, &encoded_len);
-		if (!encoded)
-			goto fail;
-
+		encoded_len = knot_value_as_raw(value, kval_len, encoded);
 		json_object_object_add(data, "value",
 			json_object_new_string_len(encoded, encoded_len));
 		break;
@@ -628,6 +634,63 @@ json_object *parser_schema_create_object(const char *device_id,
 	return json_msg;
 }
 
+#define FNV1A_64_OFFSET 0xcbf29ce484222325ULL
+#define FNV1A_64_PRIME 0x100000001b3ULL
+
+static uint64_t fnv1a_64(uint64_t hash, const void *data, size_t len)
+{
+	const uint8_t *byte = data;
+	size_t i;
+
+	for (i = 0; i < len; i++) {
+		hash ^= byte[i];
+		hash *= FNV1A_64_PRIME;
+	}
+
+	return hash;
+}
+
+static void schema_item_hash(void *data, void *user_data)
+{
+	knot_msg_schema *schema = data;
+	uint64_t *hash = user_data;
+	uint8_t fields[5];
+	size_t len;
+
+	/* Same fields and order sent by parser_schema_create_object() */
+	fields[0] = schema->sensor_id;
+	fields[1] = schema->values.value_type;
+	fields[2] = schema->values.unit;
+	fields[3] = schema->values.type_id & 0xff;
+	fields[4] = schema->values.type_id >> 8;
+
+	len = strnlen(schema->values.name, sizeof(schema->values.name));
+
+	*hash = fnv1a_64(*hash, fields, sizeof(fields));
+	*hash = fnv1a_64(*hash, schema->values.name, len);
+	/* Terminates the name, so name and next item don't mix */
+	*hash = fnv1a_64(*hash, "", 1);
+}
+
+/*
+ * Hash of the schema content, independent of the host byte order, used to
+ * detect if a schema changed since it was sent.
+ */
+uint64_t parser_schema_hash(struct l_queue *schema_list)
+{
+	uint64_t hash = FNV1A_64_OFFSET;
+
+	l_queue_foreach(schema_list, schema_item_hash, &hash);
+
+	return hash;
+}
+
+/* Hash of a string, the same on every host */
+uint64_t parser_string_hash(const char *str)
+{
+	return fnv1a_64(FNV1A_64_OFFSET, str, strlen(str));
+}
+
 const char *parser_get_key_str_from_json_obj(json_object *jso, const char *key)
 {
 	json_object *jobjkey;
@@ -20,9 +20,9 @@ struct l_queue *parser_schema_to_list(const char *json_str);
 struct l_queue *parser_queue_from_json_array(json_object *jobj,
 				parser_json_array_item_cb foreach_cb);
 
-struct l_queue *parser_request_to_list(json_object *jso);
+struct l_queue *parser_request_to_list(json_object *jso, struct arena *arena);
 json_object *parser_sensorid_to_json(const char *key, struct l_queue *list);
-struct l_queue *parser_update_to_list(json_object *jso);
+struct l_queue *parser_update_to_list(json_object *jso, struct arena *arena);
 
 json_object *parser_data_create_object(const char *device_id, uint8_t sensor_id,
 				uint8_t value_type,
@@ -35,5 +35,7 @@ json_object *parser_auth_json_create(const char *device_id,
 json_object *parser_unregister_json_create(const char *device_id);
 json_object *parser_schema_create_object(const char *device_id,
 					 struct l_queue *schema_list);
+uint64_t parser_schema_hash(struct l_queue *schema_list);
+uint64_t parser_string_hash(const char *str);
 const char *parser_get_key_str_from_json_obj(json_object *jso, const char *key);
 bool parser_is_key_str_or_null(const json_object *jso, const char *key);
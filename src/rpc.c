@@ -0,0 +1,330 @@
+/**
+ * This file is part of the KNOT Project
+ *
+ * Copyright (c) 2019, CESAR. All rights reserved.
+ *
+ *  This library is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU Lesser General Public
+ *  License as published by the Free Software Foundation; either
+ *  version 2.1 of the License, or (at your option) any later version.
+ *
+ *  This library is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Lesser General Public License for more details.
+ */
+
+/**
+ *  RPC correlation table source file
+ *
+ *  Each request gets a unique correlation id, used as key of the table of
+ *  pending requests. Requests are also kept in a min-heap by deadline, so a
+ *  single timer armed for the earliest one enforces every deadline, and
+ *  adding or completing a request is O(log n).
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
+#include <errno.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <ell/ell.h>
+
+#include "rpc.h"
+
+/* Random instance prefix and a sequence number */
+#define RPC_CORRELATION_ID_LEN 24
+#define RPC_HEAP_MIN 16
+
+struct rpc_request {
+	char correlation_id[RPC_CORRELATION_ID_LEN];
+	uint64_t deadline;
+	/* Position in the deadline heap */
+	unsigned int index;
+	rpc_complete_cb_t complete_cb;
+	void *user_data;
+};
+
+struct rpc {
+	struct l_hashmap *pending;
+	/* Min-heap of the pending requests by deadline */
+	struct rpc_request **heap;
+	unsigned int heap_len;
+	unsigned int heap_size;
+	struct l_timeout *timeout;
+	uint32_t prefix;
+	uint32_t seq;
+};
+
+static void rpc_arm_timeout(struct rpc *rpc);
+
+static void rpc_heap_set(struct rpc *rpc, unsigned int i,
+			 struct rpc_request *req)
+{
+	rpc->heap[i] = req;
+	req->index = i;
+}
+
+static void rpc_heap_sift_up(struct rpc *rpc, unsigned int i)
+{
+	struct rpc_request *req = rpc->heap[i];
+	unsigned int parent;
+
+	while (i > 0) {
+		parent = (i - 1) / 2;
+		if (rpc->heap[parent]->deadline <= req->deadline)
+			break;
+
+		rpc_heap_set(rpc, i, rpc->heap[parent]);
+		i = parent;
+	}
+
+	rpc_heap_set(rpc, i, req);
+}
+
+static void rpc_heap_sift_down(struct rpc *rpc, unsigned int i)
+{
+	struct rpc_request *req = rpc->heap[i];
+	unsigned int child;
+
+	while ((child = 2 * i + 1) < rpc->heap_len) {
+		if (child + 1 < rpc->heap_len &&
+				rpc->heap[child + 1]->deadline <
+				rpc->heap[child]->deadline)
+			child++;
+
+		if (req->deadline <= rpc->heap[child]->deadline)
+			break;
+
+		rpc_heap_set(rpc, i, rpc->heap[child]);
+		i = child;
+	}
+
+	rpc_heap_set(rpc, i, req);
+}
+
+static void rpc_heap_push(struct rpc *rpc, struct rpc_request *req)
+{
+	if (rpc->heap_len == rpc->heap_size) {
+		rpc->heap_size = rpc->heap_size ? rpc->heap_size * 2 :
+								RPC_HEAP_MIN;
+		rpc->heap = l_realloc(rpc->heap,
+				      rpc->heap_size * sizeof(*rpc->heap));
+	}
+
+	rpc_heap_set(rpc, rpc->heap_len++, req);
+	rpc_heap_sift_up(rpc, req->index);
+}
+
+static void rpc_heap_remove(struct rpc *rpc, struct rpc_request *req)
+{
+	struct rpc_request *last = rpc->heap[--rpc->heap_len];
+	unsigned int i = req->index;
+
+	if (last == req)
+		return;
+
+	rpc_heap_set(rpc, i, last);
+
+	if (i > 0 && rpc->heap[(i - 1) / 2]->deadline > last->deadline)
+		rpc_heap_sift_up(rpc, i);
+	else
+		rpc_heap_sift_down(rpc, i);
+}
+
+static struct rpc_request *rpc_heap_peek(struct rpc *rpc)
+{
+	return rpc->heap_len ? rpc->heap[0] : NULL;
+}
+
+/* Removes the request from the table and calls its completion */
+static void rpc_request_finish(struct rpc *rpc, struct rpc_request *req,
+			       const void *reply, int err)
+{
+	l_hashmap_remove(rpc->pending, req->correlation_id);
+	rpc_heap_remove(rpc, req);
+
+	req->complete_cb(reply, err, req->user_data);
+	l_free(req);
+}
+
+static void on_rpc_timeout(struct l_timeout *timeout, void *user_data)
+{
+	struct rpc *rpc = user_data;
+	struct rpc_request *req;
+	uint64_t now = l_time_now();
+
+	while ((req = rpc_heap_peek(rpc)) && req->deadline <= now) {
+		l_debug("RPC %s timed out", req->correlation_id);
+		rpc_request_finish(rpc, req, NULL, -ETIMEDOUT);
+	}
+
+	rpc_arm_timeout(rpc);
+}
+
+static void rpc_arm_timeout(struct rpc *rpc)
+{
+	struct rpc_request *req = rpc_heap_peek(rpc);
+	uint64_t now = l_time_now();
+	uint64_t ms;
+
+	if (!req) {
+		l_timeout_remove(rpc->timeout);
+		rpc->timeout = NULL;
+		return;
+	}
+
+	ms = req->deadline > now ? (req->deadline - now + 999) / 1000 : 1;
+
+	if (rpc->timeout)
+		l_timeout_modify_ms(rpc->timeout, ms);
+	else
+		rpc->timeout = l_timeout_create_ms(ms, on_rpc_timeout, rpc,
+						   NULL);
+}
+
+/**
+ * rpc_new:
+ *
+ * Creates an empty table of pending requests.
+ *
+ * Returns: the table created.
+ */
+struct rpc *rpc_new(void)
+{
+	struct rpc *rpc = l_new(struct rpc, 1);
+
+	rpc->pending = l_hashmap_string_new();
+	rpc->prefix = l_getrandom_uint32();
+
+	return rpc;
+}
+
+/**
+ * rpc_free:
+ * @rpc: table created by rpc_new()
+ *
+ * Cancels the pending requests and releases @rpc.
+ */
+void rpc_free(struct rpc *rpc)
+{
+	if (!rpc)
+		return;
+
+	rpc_cancel_all(rpc, -ECANCELED);
+
+	l_timeout_remove(rpc->timeout);
+	l_free(rpc->heap);
+	l_hashmap_destroy(rpc->pending, NULL);
+	l_free(rpc);
+}
+
+/**
+ * rpc_add:
+ * @rpc: pending requests table
+ * @timeout_ms: time to wait for the reply
+ * @complete_cb: callback called once with the reply or an error
+ * @user_data: user data provided to @complete_cb
+ *
+ * Adds a pending request. If the request can't be sent, it must be removed
+ * with rpc_complete().
+ *
+ * Returns: the correlation id to send with the request, valid until the
+ * request is completed.
+ */
+const char *rpc_add(struct rpc *rpc, unsigned int timeout_ms,
+		    rpc_complete_cb_t complete_cb, void *user_data)
+{
+	struct rpc_request *req = l_new(struct rpc_request, 1);
+
+	snprintf(req->correlation_id, sizeof(req->correlation_id),
+		 "%08x.%u", rpc->prefix, ++rpc->seq);
+	req->deadline = l_time_now() + (uint64_t) timeout_ms * 1000;
+	req->complete_cb = complete_cb;
+	req->user_data = user_data;
+
+	l_hashmap_insert(rpc->pending, req->correlation_id, req);
+
+	rpc_heap_push(rpc, req);
+
+	if (rpc_heap_peek(rpc) == req)
+		rpc_arm_timeout(rpc);
+
+	return req->correlation_id;
+}
+
+/**
+ * rpc_complete:
+ * @rpc: pending requests table
+ * @correlation_id: correlation id of a reply received
+ * @reply: reply provided to the completion callback
+ * @err: 0 or a negative errno provided to the completion callback
+ *
+ * Completes the request matching @correlation_id, if any.
+ *
+ * Returns: true if a pending request was completed and false otherwise.
+ */
+bool rpc_complete(struct rpc *rpc, const char *correlation_id,
+		  const void *reply, int err)
+{
+	struct rpc_request *req;
+	bool head;
+
+	if (!rpc || !correlation_id)
+		return false;
+
+	req = l_hashmap_lookup(rpc->pending, correlation_id);
+	if (!req)
+		return false;
+
+	head = rpc_heap_peek(rpc) == req;
+
+	rpc_request_finish(rpc, req, reply, err);
+
+	if (head)
+		rpc_arm_timeout(rpc);
+
+	return true;
+}
+
+/**
+ * rpc_cancel_all:
+ * @rpc: pending requests table
+ * @err: negative errno provided to the completion callbacks
+ *
+ * Completes every pending request with @err.
+ */
+void rpc_cancel_all(struct rpc *rpc, int err)
+{
+	struct rpc_request *req;
+
+	if (!rpc)
+		return;
+
+	while ((req = rpc_heap_peek(rpc)))
+		rpc_request_finish(rpc, req, NULL, err);
+
+	l_timeout_remove(rpc->timeout);
+	rpc->timeout = NULL;
+}
+
+/**
+ * rpc_pending:
+ * @rpc: pending requests table
+ *
+ * Returns: the number of requests waiting for a reply.
+ */
+unsigned int rpc_pending(struct rpc *rpc)
+{
+	if (!rpc)
+		return 0;
+
+	return rpc->heap_len;
+}
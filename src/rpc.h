@@ -0,0 +1,37 @@
+/**
+ * This file is part of the KNOT Project
+ *
+ * Copyright (c) 2019, CESAR. All rights reserved.
+ *
+ *  This library is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU Lesser General Public
+ *  License as published by the Free Software Foundation; either
+ *  version 2.1 of the License, or (at your option) any later version.
+ *
+ *  This library is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Lesser General Public License for more details.
+ */
+
+/**
+ *  RPC correlation table header file
+ */
+
+/*
+ * Called on the main loop with the reply, or with NULL and a negative errno
+ * if the request timed out or was cancelled.
+ */
+typedef void (*rpc_complete_cb_t) (const void *reply, int err,
+				   void *user_data);
+
+struct rpc;
+
+struct rpc *rpc_new(void);
+void rpc_free(struct rpc *rpc);
+const char *rpc_add(struct rpc *rpc, unsigned int timeout_ms,
+		    rpc_complete_cb_t complete_cb, void *user_data);
+bool rpc_complete(struct rpc *rpc, const char *correlation_id,
+		  const void *reply, int err);
+void rpc_cancel_all(struct rpc *rpc, int err);
+unsigned int rpc_pending(struct rpc *rpc);
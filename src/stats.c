@@ -0,0 +1,54 @@
+/**
+ * This file is part of the KNOT Project
+ *
+ * Copyright (c) 2019, CESAR. All rights reserved.
+ *
+ *  This library is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU Lesser General Public
+ *  License as published by the Free Software Foundation; either
+ *  version 2.1 of the License, or (at your option) any later version.
+ *
+ *  This library is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Lesser General Public License for more details.
+ */
+
+
+/**
+ *  Statistics source file
+ *
+ *  Histograms are log-bucketed so recording a value is a couple of
+ *  increments, cheap enough to be done on every message.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <stdint.h>
+
+#include "stats.h"
+
+/**
+ * stats_histogram_add:
+ * @hist: histogram
+ * @value: value recorded, usually a duration in microseconds
+ *
+ * Adds @value to @hist. Not thread safe, concurrent updates must be
+ * serialized by the caller.
+ */
+void stats_histogram_add(struct stats_histogram *hist, uint64_t value)
+{
+	unsigned int bucket = value ? 64 - __builtin_clzll(value) : 0;
+
+	if (bucket >= STATS_HISTOGRAM_BUCKETS)
+		bucket = STATS_HISTOGRAM_BUCKETS - 1;
+
+	hist->buckets[bucket]++;
+	hist->count++;
+	hist->sum += value;
+
+	if (value > hist->max)
+		hist->max = value;
+}
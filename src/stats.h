@@ -0,0 +1,35 @@
+/**
+ * This file is part of the KNOT Project
+ *
+ * Copyright (c) 2019, CESAR. All rights reserved.
+ *
+ *  This library is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU Lesser General Public
+ *  License as published by the Free Software Foundation; either
+ *  version 2.1 of the License, or (at your option) any later version.
+ *
+ *  This library is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Lesser General Public License for more details.
+ */
+
+
+/**
+ *  Statistics header file
+ */
+
+/*
+ * Bucket 0 counts zeros and bucket i the values from 2^(i - 1) to 2^i - 1,
+ * the last one also counts everything above.
+ */
+#define STATS_HISTOGRAM_BUCKETS 32
+
+struct stats_histogram {
+	uint64_t count;
+	uint64_t sum;
+	uint64_t max;
+	uint64_t buckets[STATS_HISTOGRAM_BUCKETS];
+};
+
+void stats_histogram_add(struct stats_histogram *hist, uint64_t value);
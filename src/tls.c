@@ -0,0 +1,317 @@
+/**
+ * This file is part of the KNOT Project
+ *
+ * Copyright (c) 2019, CESAR. All rights reserved.
+ *
+ *  This library is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU Lesser General Public
+ *  License as published by the Free Software Foundation; either
+ *  version 2.1 of the License, or (at your option) any later version.
+ *
+ *  This library is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Lesser General Public License for more details.
+ */
+
+/**
+ *  TLS transport source file
+ *
+ *  Sockets are created by librabbitmq, with a new OpenSSL context on every
+ *  connection. To resume sessions across reconnections the last session
+ *  received is kept here and set on the next handshake, from the OpenSSL
+ *  info callback as librabbitmq doesn't expose the SSL object. Without
+ *  OpenSSL headers at build time, connections still use TLS but every
+ *  handshake is a full one.
+ *
+ *  The callbacks run on whichever thread drives the connection, the state
+ *  shared between connections is protected by a lock.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <ell/ell.h>
+#include <amqp.h>
+#include <amqp_ssl_socket.h>
+
+#ifdef HAVE_OPENSSL
+#include <openssl/ssl.h>
+#endif
+
+#include "stats.h"
+#include "tls.h"
+
+struct tls {
+	pthread_mutex_t lock;
+	int refs;
+	char *ca_cert;
+	char *cert;
+	char *key;
+	char *ciphers;
+	bool verify_peer;
+	struct tls_stats stats;
+#ifdef HAVE_OPENSSL
+	SSL_SESSION *session;
+#endif
+};
+
+#ifdef HAVE_OPENSSL
+/* Keeps the last session to offer it on the next connection */
+static int on_new_session(SSL *ssl, SSL_SESSION *session)
+{
+	struct tls *tls = SSL_CTX_get_app_data(SSL_get_SSL_CTX(ssl));
+
+	pthread_mutex_lock(&tls->lock);
+
+	if (tls->session)
+		SSL_SESSION_free(tls->session);
+
+	tls->session = session;
+
+	pthread_mutex_unlock(&tls->lock);
+
+	/* The reference is kept */
+	return 1;
+}
+
+/* Start time of the handshake in progress, kept on each SSL object */
+static int handshake_index = -1;
+static pthread_once_t handshake_once = PTHREAD_ONCE_INIT;
+
+static void handshake_start_free(void *parent, void *ptr,
+				 CRYPTO_EX_DATA *ad, int index, long argl,
+				 void *argp)
+{
+	l_free(ptr);
+}
+
+static void handshake_index_new(void)
+{
+	handshake_index = SSL_get_ex_new_index(0, NULL, NULL, NULL,
+					       handshake_start_free);
+}
+
+/*
+ * TLS 1.3 post-handshake messages, like session tickets, are reported as
+ * handshakes too. Only the one starting from the initial state is counted.
+ */
+static void on_info(const SSL *ssl, int where, int ret)
+{
+	struct tls *tls = SSL_CTX_get_app_data(SSL_get_SSL_CTX(ssl));
+	uint64_t *start;
+	uint64_t elapsed;
+
+	if ((where & SSL_CB_HANDSHAKE_START) && SSL_in_before(ssl)) {
+		start = l_new(uint64_t, 1);
+		*start = l_time_now();
+		SSL_set_ex_data((SSL *) ssl, handshake_index, start);
+
+		pthread_mutex_lock(&tls->lock);
+
+		/* Still before the ClientHello is built */
+		if (tls->session && !SSL_session_reused((SSL *) ssl))
+			SSL_set_session((SSL *) ssl, tls->session);
+
+		pthread_mutex_unlock(&tls->lock);
+	}
+
+	if (!(where & SSL_CB_HANDSHAKE_DONE))
+		return;
+
+	start = SSL_get_ex_data(ssl, handshake_index);
+	if (!start)
+		return;
+
+	elapsed = l_time_now() - *start;
+	SSL_set_ex_data((SSL *) ssl, handshake_index, NULL);
+	l_free(start);
+
+	pthread_mutex_lock(&tls->lock);
+
+	tls->stats.handshakes++;
+	tls->stats.last_handshake_us = elapsed;
+	tls->stats.total_handshake_us += elapsed;
+	stats_histogram_add(&tls->stats.handshake, elapsed);
+
+	if (SSL_session_reused((SSL *) ssl))
+		tls->stats.resumed++;
+
+	pthread_mutex_unlock(&tls->lock);
+}
+
+static int tls_setup_context(struct tls *tls, amqp_socket_t *socket)
+{
+	SSL_CTX *ctx = amqp_ssl_socket_get_context(socket);
+
+	if (!ctx)
+		return -1;
+
+	pthread_once(&handshake_once, handshake_index_new);
+	if (handshake_index < 0)
+		return -1;
+
+	if (tls->ciphers && !SSL_CTX_set_cipher_list(ctx, tls->ciphers)) {
+		l_error("Invalid TLS cipher list %s", tls->ciphers);
+		return -1;
+	}
+
+	if (!tls->ca_cert)
+		SSL_CTX_set_default_verify_paths(ctx);
+
+	SSL_CTX_set_app_data(ctx, tls);
+	SSL_CTX_set_session_cache_mode(ctx, SSL_SESS_CACHE_CLIENT |
+				       SSL_SESS_CACHE_NO_INTERNAL_STORE);
+	SSL_CTX_sess_set_new_cb(ctx, on_new_session);
+	SSL_CTX_set_info_callback(ctx, on_info);
+
+	return 0;
+}
+#else
+/* The context isn't reachable, the defaults of librabbitmq are used */
+static int tls_setup_context(struct tls *tls, amqp_socket_t *socket)
+{
+	if (tls->ciphers) {
+		l_error("TLS cipher list %s not applied, built without OpenSSL",
+			tls->ciphers);
+		return -1;
+	}
+
+	return 0;
+}
+#endif
+
+/**
+ * tls_new:
+ * @config: TLS settings, copied
+ *
+ * Creates the TLS state shared by the connections of a context.
+ *
+ * Returns: the state created, with one reference.
+ */
+struct tls *tls_new(const struct tls_config *config)
+{
+	struct tls *tls = l_new(struct tls, 1);
+
+	pthread_mutex_init(&tls->lock, NULL);
+	tls->refs = 1;
+	tls->ca_cert = l_strdup(config->ca_cert);
+	tls->cert = l_strdup(config->cert);
+	tls->key = l_strdup(config->key);
+	tls->ciphers = l_strdup(config->ciphers);
+	tls->verify_peer = config->verify_peer;
+
+	return tls;
+}
+
+/**
+ * tls_ref:
+ * @tls: TLS state
+ *
+ * Connections being opened keep a reference, they may outlive the context.
+ *
+ * Returns: @tls.
+ */
+struct tls *tls_ref(struct tls *tls)
+{
+	if (!tls)
+		return NULL;
+
+	pthread_mutex_lock(&tls->lock);
+	tls->refs++;
+	pthread_mutex_unlock(&tls->lock);
+
+	return tls;
+}
+
+/**
+ * tls_unref:
+ * @tls: TLS state
+ *
+ * Releases a reference, @tls is freed with the last one.
+ */
+void tls_unref(struct tls *tls)
+{
+	bool last;
+
+	if (!tls)
+		return;
+
+	pthread_mutex_lock(&tls->lock);
+	last = --tls->refs == 0;
+	pthread_mutex_unlock(&tls->lock);
+
+	if (!last)
+		return;
+
+#ifdef HAVE_OPENSSL
+	if (tls->session)
+		SSL_SESSION_free(tls->session);
+#endif
+
+	pthread_mutex_destroy(&tls->lock);
+	l_free(tls->ca_cert);
+	l_free(tls->cert);
+	l_free(tls->key);
+	l_free(tls->ciphers);
+	l_free(tls);
+}
+
+/**
+ * tls_socket_new:
+ * @tls: TLS state
+ * @conn: connection to create the socket to
+ *
+ * Creates a TLS socket, resuming the previous session if possible. The
+ * connection must be destroyed before @tls is released.
+ *
+ * Returns: the socket created or NULL otherwise.
+ */
+amqp_socket_t *tls_socket_new(struct tls *tls, amqp_connection_state_t conn)
+{
+	amqp_socket_t *socket = amqp_ssl_socket_new(conn);
+
+	if (!socket) {
+		l_error("Error creating TLS socket");
+		return NULL;
+	}
+
+	amqp_ssl_socket_set_verify_peer(socket, tls->verify_peer);
+	amqp_ssl_socket_set_verify_hostname(socket, tls->verify_peer);
+
+	if (tls->ca_cert && amqp_ssl_socket_set_cacert(socket, tls->ca_cert)) {
+		l_error("Error setting CA certificate %s", tls->ca_cert);
+		return NULL;
+	}
+
+	if (tls->cert && amqp_ssl_socket_set_key(socket, tls->cert,
+						 tls->key)) {
+		l_error("Error setting client certificate %s", tls->cert);
+		return NULL;
+	}
+
+	if (tls_setup_context(tls, socket))
+		return NULL;
+
+	return socket;
+}
+
+/**
+ * tls_get_stats:
+ * @tls: TLS state
+ * @stats: filled with the handshakes done so far
+ */
+void tls_get_stats(struct tls *tls, struct tls_stats *stats)
+{
+	pthread_mutex_lock(&tls->lock);
+	*stats = tls->stats;
+	pthread_mutex_unlock(&tls->lock);
+}
@@ -0,0 +1,43 @@
+/**
+ * This file is part of the KNOT Project
+ *
+ * Copyright (c) 2019, CESAR. All rights reserved.
+ *
+ *  This library is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU Lesser General Public
+ *  License as published by the Free Software Foundation; either
+ *  version 2.1 of the License, or (at your option) any later version.
+ *
+ *  This library is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Lesser General Public License for more details.
+ */
+
+/**
+ *  TLS transport header file
+ */
+
+struct tls_config {
+	const char *ca_cert;	/* NULL to use the system CAs */
+	const char *cert;	/* Client certificate, optional */
+	const char *key;
+	const char *ciphers;	/* OpenSSL cipher list, NULL for default */
+	bool verify_peer;
+};
+
+struct tls_stats {
+	uint64_t handshakes;
+	uint64_t resumed;
+	uint64_t last_handshake_us;
+	uint64_t total_handshake_us;
+	struct stats_histogram handshake;
+};
+
+struct tls;
+
+struct tls *tls_new(const struct tls_config *config);
+struct tls *tls_ref(struct tls *tls);
+void tls_unref(struct tls *tls);
+amqp_socket_t *tls_socket_new(struct tls *tls, amqp_connection_state_t conn);
+void tls_get_stats(struct tls *tls, struct tls_stats *stats);
@@ -0,0 +1,1326 @@
+/**
+ * This file is part of the KNOT Project
+ *
+ * Copyright (c) 2019, CESAR. All rights reserved.
+ *
+ *  This library is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU Lesser General Public
+ *  License as published by the Free Software Foundation; either
+ *  version 2.1 of the License, or (at your option) any later version.
+ *
+ *  This library is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Lesser General Public License for more details.
+ */
+
+/**
+ *  Load generator
+ *
+ *  Simulates many things sharing one SDK instance, as a gateway does. The
+ *  things are onboarded, publish their data at a fixed rate and answer the
+ *  commands they get. With --loopback, a broker started in process stands
+ *  in for the cloud: it answers onboarding and sends the commands.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <getopt.h>
+#include <signal.h>
+#include <pthread.h>
+#include <sys/resource.h>
+#include <ell/ell.h>
+#include <json-c/json.h>
+
+#include <knot/knot_protocol.h>
+
+#include "knot_cloud.h"
+#include "loopback.h"
+
+#define LOAD_ID_LEN 16
+#define LOAD_TOKEN_LEN 40
+#define LOAD_THINGS_MAX 100000
+#define LOAD_SENSORS_MAX 32
+
+/* Things onboarding at the same time */
+#define LOAD_ONBOARD_WINDOW 64
+#define LOAD_AUTH_TIMEOUT_MS 10000
+#define LOAD_UNREGISTER_TIMEOUT 5
+
+#define LOAD_TICK_MS 10
+/* Messages a thing publishes on a tick at most, when catching up */
+#define LOAD_BURST_MAX 100
+
+/* Latencies kept for the percentiles, sampled past that */
+#define LOAD_SAMPLES_MAX 100000
+
+#define LOAD_TYPE_ID 0xfff1
+
+#define LOAD_EXCHANGE_DEVICE "device"
+#define LOAD_CMD_REGISTER "device.register"
+#define LOAD_CMD_UNREGISTER "device.unregister"
+#define LOAD_CMD_AUTH "device.auth"
+#define LOAD_CMD_SCHEMA "device.schema.sent"
+#define LOAD_EVENT_REGISTERED "device.registered"
+#define LOAD_EVENT_UNREGISTERED "device.unregistered"
+#define LOAD_EVENT_SCHEMA "device.schema.updated"
+
+enum thing_state {
+	THING_IDLE,
+	THING_REGISTERING,
+	THING_AUTHENTICATING,
+	THING_UPDATING_SCHEMA,
+	THING_READY,
+	THING_UNREGISTERING,
+	THING_FAILED,
+};
+
+struct samples {
+	uint64_t values[LOAD_SAMPLES_MAX];
+	uint64_t seen;
+	uint64_t max;
+};
+
+struct thing {
+	struct load *load;
+	char id[LOAD_ID_LEN + 1];
+	char *token;
+	enum thing_state state;
+	uint64_t step_start;
+	uint64_t sent;
+	uint64_t counter;
+	const struct l_queue_entry *next_sensor;
+	struct l_queue *schema;
+};
+
+struct load {
+	/* Options */
+	char *url;
+	char *user_token;
+	bool use_loopback;
+	unsigned int num_things;
+	unsigned int num_sensors;
+	uint8_t mix[LOAD_SENSORS_MAX];
+	double rate;
+	double command_rate;
+	unsigned int duration;
+	unsigned int onboard_timeout;
+	unsigned int num_workers;
+	bool keep;
+
+	struct knot_cloud *cloud;
+	struct loopback *loopback;
+	char session_id[LOAD_ID_LEN + 1];
+	/* Messages handed over by the workers to the main loop */
+	pthread_mutex_t handoff_lock;
+	struct l_queue *handoff;
+	struct l_io *handoff_io;
+	int handoff_fds[2];
+	bool started;
+	bool running;
+	bool finished;
+
+	struct thing *things;
+	struct l_hashmap *things_by_id;
+	unsigned int onboard_next;
+	unsigned int onboarding;
+	unsigned int ready;
+	unsigned int failed;
+	unsigned int unregistering;
+	uint64_t onboard_start;
+	uint64_t onboard_end;
+
+	struct l_timeout *phase_timeout;
+	struct l_timeout *tick;
+	uint64_t run_start;
+	uint64_t run_end;
+	struct rusage usage_start;
+	struct rusage usage_end;
+	struct rusage thread_start;
+	struct rusage thread_end;
+
+	uint64_t published;
+	uint64_t publish_errors;
+	uint64_t commands_sent;
+	uint64_t updates;
+	uint64_t requests;
+	uint64_t replies;
+	unsigned int disconnections;
+
+	struct samples publish;
+	struct samples registration;
+	struct samples auth;
+	struct samples schema;
+	struct samples lag;
+};
+
+struct handoff {
+	const struct knot_cloud_msg *msg;
+	struct knot_cloud_msg_token *token;
+};
+
+struct value_type_name {
+	const char *name;
+	uint8_t value_type;
+};
+
+static const struct value_type_name value_types[] = {
+	{ "int", KNOT_VALUE_TYPE_INT },
+	{ "float", KNOT_VALUE_TYPE_FLOAT },
+	{ "bool", KNOT_VALUE_TYPE_BOOL },
+	{ "raw", KNOT_VALUE_TYPE_RAW },
+	{ "int64", KNOT_VALUE_TYPE_INT64 },
+	{ "uint", KNOT_VALUE_TYPE_UINT },
+	{ "uint64", KNOT_VALUE_TYPE_UINT64 },
+};
+
+static uint64_t random_state = 0x9e3779b97f4a7c15ULL;
+
+/* xorshift64, only used to sample the latencies */
+static uint64_t random_next(void)
+{
+	random_state ^= random_state << 13;
+	random_state ^= random_state >> 7;
+	random_state ^= random_state << 17;
+
+	return random_state;
+}
+
+static void samples_add(struct samples *samples, uint64_t value)
+{
+	uint64_t i;
+
+	if (value > samples->max)
+		samples->max = value;
+
+	/* Reservoir sampling, every value has the same chance to be kept */
+	i = samples->seen++;
+	if (i >= LOAD_SAMPLES_MAX) {
+		i = random_next() % samples->seen;
+		if (i >= LOAD_SAMPLES_MAX)
+			return;
+	}
+
+	samples->values[i] = value;
+}
+
+static int compare_u64(const void *a, const void *b)
+{
+	uint64_t va = *(const uint64_t *) a;
+	uint64_t vb = *(const uint64_t *) b;
+
+	return va < vb ? -1 : va > vb;
+}
+
+static void samples_print(const char *name, struct samples *samples)
+{
+	size_t count = samples->seen < LOAD_SAMPLES_MAX ?
+					samples->seen : LOAD_SAMPLES_MAX;
+
+	if (!count) {
+		printf("  %-16s %10s\n", name, "-");
+		return;
+	}
+
+	qsort(samples->values, count, sizeof(samples->values[0]),
+	      compare_u64);
+
+	printf("  %-16s %10" PRIu64 " %10" PRIu64 " %10" PRIu64
+	       " %10" PRIu64 " %10" PRIu64 "\n", name, samples->seen,
+	       samples->values[count / 2], samples->values[count * 9 / 10],
+	       samples->values[count * 99 / 100], samples->max);
+}
+
+static uint64_t timeval_us(const struct timeval *tv)
+{
+	return (uint64_t) tv->tv_sec * 1000000 + tv->tv_usec;
+}
+
+static uint64_t cpu_us(const struct rusage *start, const struct rusage *end)
+{
+	return timeval_us(&end->ru_utime) + timeval_us(&end->ru_stime) -
+		timeval_us(&start->ru_utime) - timeval_us(&start->ru_stime);
+}
+
+static uint8_t value_fill(uint8_t value_type, uint64_t counter,
+			  knot_value_type *value)
+{
+	switch (value_type) {
+	case KNOT_VALUE_TYPE_FLOAT:
+		value->val_f = (counter % 1000) / 10.0f;
+		return sizeof(float);
+	case KNOT_VALUE_TYPE_BOOL:
+		value->val_b = counter & 1;
+		return sizeof(bool);
+	case KNOT_VALUE_TYPE_RAW:
+		memset(value->raw, counter, sizeof(value->raw));
+		return KNOT_DATA_RAW_SIZE;
+	case KNOT_VALUE_TYPE_INT64:
+		value->val_i64 = counter;
+		return sizeof(int64_t);
+	case KNOT_VALUE_TYPE_UINT:
+		value->val_u = counter;
+		return sizeof(uint32_t);
+	case KNOT_VALUE_TYPE_UINT64:
+		value->val_u64 = counter;
+		return sizeof(uint64_t);
+	case KNOT_VALUE_TYPE_INT:
+	default:
+		value->val_i = counter % 1000;
+		return sizeof(int32_t);
+	}
+}
+
+static bool schema_match_sensor(const void *data, const void *match_data)
+{
+	const knot_msg_schema *schema = data;
+
+	return schema->sensor_id == L_PTR_TO_UINT(match_data);
+}
+
+static void publish_sensor(struct thing *thing,
+			   const knot_msg_schema *schema,
+			   const knot_value_type *value, uint8_t len)
+{
+	struct load *load = thing->load;
+	uint64_t start = l_time_now();
+
+	if (knot_cloud_session_publish_data(load->cloud, thing->id,
+					    schema->sensor_id,
+					    schema->values.value_type,
+					    value, len)) {
+		load->publish_errors++;
+		return;
+	}
+
+	samples_add(&load->publish, l_time_now() - start);
+	load->published++;
+}
+
+static void publish_next(struct thing *thing)
+{
+	const knot_msg_schema *schema;
+	knot_value_type value;
+	uint8_t len;
+
+	/* Sensors take turns */
+	if (!thing->next_sensor)
+		thing->next_sensor = l_queue_get_entries(thing->schema);
+
+	schema = thing->next_sensor->data;
+	thing->next_sensor = thing->next_sensor->next;
+
+	len = value_fill(schema->values.value_type, thing->counter++,
+			 &value);
+	publish_sensor(thing, schema, &value, len);
+	thing->sent++;
+}
+
+static void thing_failed(struct thing *thing, const char *step,
+			 const char *error)
+{
+	struct load *load = thing->load;
+
+	l_warn("Thing %s failed on %s: %s", thing->id, step,
+	       error ? : "no reply");
+
+	thing->state = THING_FAILED;
+	load->onboarding--;
+	load->failed++;
+}
+
+static void onboard_fill(struct load *load);
+
+static void on_auth_reply(const struct knot_cloud_msg *msg, int err,
+			  void *user_data)
+{
+	struct thing *thing = user_data;
+	struct load *load = thing->load;
+	int result;
+
+	if (thing->state != THING_AUTHENTICATING)
+		return;
+
+	if (err || msg->error) {
+		thing_failed(thing, "auth", err ? strerror(-err) : msg->error);
+		onboard_fill(load);
+		return;
+	}
+
+	samples_add(&load->auth, l_time_now() - thing->step_start);
+
+	thing->state = THING_UPDATING_SCHEMA;
+	thing->step_start = l_time_now();
+
+	result = knot_cloud_session_update_schema(load->cloud, thing->id,
+						  thing->schema);
+	if (result) {
+		thing_failed(thing, "schema", "not sent");
+		onboard_fill(load);
+	}
+}
+
+static void on_registered(struct thing *thing,
+			  const struct knot_cloud_msg *msg)
+{
+	struct load *load = thing->load;
+	int result;
+
+	if (thing->state != THING_REGISTERING)
+		return;
+
+	if (msg->error) {
+		thing_failed(thing, "register", msg->error);
+		onboard_fill(load);
+		return;
+	}
+
+	samples_add(&load->registration, l_time_now() - thing->step_start);
+
+	l_free(thing->token);
+	thing->token = l_strdup(msg->token);
+	thing->state = THING_AUTHENTICATING;
+	thing->step_start = l_time_now();
+
+	result = knot_cloud_session_auth_device_async(load->cloud, thing->id,
+						      thing->token,
+						      LOAD_AUTH_TIMEOUT_MS,
+						      on_auth_reply, thing);
+	if (result) {
+		thing_failed(thing, "auth", "not sent");
+		onboard_fill(load);
+	}
+}
+
+static void on_schema_updated(struct thing *thing,
+			      const struct knot_cloud_msg *msg)
+{
+	struct load *load = thing->load;
+
+	if (thing->state != THING_UPDATING_SCHEMA)
+		return;
+
+	if (msg->error) {
+		thing_failed(thing, "schema", msg->error);
+		onboard_fill(load);
+		return;
+	}
+
+	samples_add(&load->schema, l_time_now() - thing->step_start);
+
+	thing->state = THING_READY;
+	load->onboarding--;
+	load->ready++;
+	onboard_fill(load);
+}
+
+static void finish(struct load *load);
+
+static void on_unregistered(struct thing *thing)
+{
+	struct load *load = thing->load;
+
+	if (thing->state != THING_UNREGISTERING)
+		return;
+
+	thing->state = THING_IDLE;
+	if (--load->unregistering == 0)
+		finish(load);
+}
+
+/* Answers as the thing would: updates are applied and published back */
+static void on_update(struct thing *thing, const struct knot_cloud_msg *msg)
+{
+	const struct l_queue_entry *entry;
+	const knot_msg_schema *schema;
+	const knot_msg_data *data;
+
+	thing->load->updates++;
+
+	for (entry = l_queue_get_entries(msg->list); entry;
+						entry = entry->next) {
+		data = entry->data;
+		schema = l_queue_find(thing->schema, schema_match_sensor,
+				      L_UINT_TO_PTR(data->sensor_id));
+		if (!schema)
+			continue;
+
+		publish_sensor(thing, schema, &data->payload,
+			       data->hdr.payload_len -
+			       sizeof(data->sensor_id));
+		thing->load->replies++;
+	}
+}
+
+static void on_request(struct thing *thing, const struct knot_cloud_msg *msg)
+{
+	const struct l_queue_entry *entry;
+	const knot_msg_schema *schema;
+	knot_value_type value;
+	const int *sensor_id;
+	uint8_t len;
+
+	thing->load->requests++;
+
+	for (entry = l_queue_get_entries(msg->list); entry;
+						entry = entry->next) {
+		sensor_id = entry->data;
+		schema = l_queue_find(thing->schema, schema_match_sensor,
+				      L_UINT_TO_PTR(*sensor_id));
+		if (!schema)
+			continue;
+
+		len = value_fill(schema->values.value_type, thing->counter,
+				 &value);
+		publish_sensor(thing, schema, &value, len);
+		thing->load->replies++;
+	}
+}
+
+static void msg_handle(struct load *load, const struct knot_cloud_msg *msg)
+{
+	struct thing *thing;
+
+	thing = l_hashmap_lookup(load->things_by_id, msg->device_id);
+	if (!thing)
+		return;
+
+	if (msg->lag_us)
+		samples_add(&load->lag, msg->lag_us);
+
+	switch (msg->type) {
+	case UPDATE_MSG:
+		on_update(thing, msg);
+		break;
+	case REQUEST_MSG:
+		on_request(thing, msg);
+		break;
+	case REGISTER_MSG:
+		on_registered(thing, msg);
+		break;
+	case UNREGISTER_MSG:
+		on_unregistered(thing);
+		break;
+	case SCHEMA_MSG:
+		on_schema_updated(thing, msg);
+		break;
+	case AUTH_MSG:
+	case MSG_TYPES_LENGTH:
+	default:
+		break;
+	}
+}
+
+/*
+ * The SDK can't be called from the workers, their messages are deferred
+ * and handled on the main loop instead.
+ */
+static bool on_cloud_msg(const struct knot_cloud_msg *msg, void *user_data)
+{
+	struct load *load = user_data;
+	struct handoff *handoff;
+	uint8_t byte = 0;
+
+	if (!load->handoff) {
+		msg_handle(load, msg);
+		return true;
+	}
+
+	handoff = l_new(struct handoff, 1);
+	handoff->msg = msg;
+	handoff->token = knot_cloud_msg_defer(msg);
+
+	pthread_mutex_lock(&load->handoff_lock);
+	l_queue_push_tail(load->handoff, handoff);
+	pthread_mutex_unlock(&load->handoff_lock);
+
+	if (write(load->handoff_fds[1], &byte, sizeof(byte)) < 0)
+		fprintf(stderr, "write(): %s\n", strerror(errno));
+
+	return true;
+}
+
+static bool on_handoff(struct l_io *io, void *user_data)
+{
+	struct load *load = user_data;
+	struct handoff *handoff;
+	uint8_t buf[64];
+
+	while (read(load->handoff_fds[0], buf, sizeof(buf)) > 0)
+		;
+
+	while (true) {
+		pthread_mutex_lock(&load->handoff_lock);
+		handoff = l_queue_pop_head(load->handoff);
+		pthread_mutex_unlock(&load->handoff_lock);
+
+		if (!handoff)
+			break;
+
+		msg_handle(load, handoff->msg);
+		knot_cloud_msg_complete(handoff->token, true);
+		l_free(handoff);
+	}
+
+	return true;
+}
+
+static int handoff_start(struct load *load)
+{
+	if (pipe2(load->handoff_fds, O_NONBLOCK | O_CLOEXEC) < 0) {
+		fprintf(stderr, "pipe2(): %s\n", strerror(errno));
+		return -1;
+	}
+
+	pthread_mutex_init(&load->handoff_lock, NULL);
+	load->handoff = l_queue_new();
+	load->handoff_io = l_io_new(load->handoff_fds[0]);
+	l_io_set_read_handler(load->handoff_io, on_handoff, load, NULL);
+
+	return 0;
+}
+
+static void handoff_stop(struct load *load)
+{
+	if (!load->handoff)
+		return;
+
+	l_io_destroy(load->handoff_io);
+	close(load->handoff_fds[0]);
+	close(load->handoff_fds[1]);
+	l_queue_destroy(load->handoff, l_free);
+	pthread_mutex_destroy(&load->handoff_lock);
+}
+
+static void run_start(struct load *load);
+
+static void thing_register(struct thing *thing)
+{
+	struct load *load = thing->load;
+	char name[KNOT_PROTOCOL_DATA_NAME_LEN];
+
+	snprintf(name, sizeof(name), "Load %u",
+		 (unsigned int) (thing - load->things));
+
+	thing->state = THING_REGISTERING;
+	thing->step_start = l_time_now();
+	load->onboarding++;
+
+	if (knot_cloud_session_register_device(load->cloud, thing->id,
+					       name))
+		thing_failed(thing, "register", "not sent");
+}
+
+static void onboard_fill(struct load *load)
+{
+	while (!load->running && load->onboarding < LOAD_ONBOARD_WINDOW &&
+			load->onboard_next < load->num_things)
+		thing_register(&load->things[load->onboard_next++]);
+
+	if (load->ready + load->failed == load->num_things)
+		run_start(load);
+}
+
+static void on_onboard_timeout(struct l_timeout *timeout, void *user_data)
+{
+	struct load *load = user_data;
+	unsigned int i;
+
+	for (i = 0; i < load->num_things; i++) {
+		if (load->things[i].state == THING_READY ||
+				load->things[i].state == THING_FAILED)
+			continue;
+
+		if (load->things[i].state == THING_IDLE)
+			load->onboarding++;
+
+		thing_failed(&load->things[i], "onboarding", "timed out");
+	}
+
+	run_start(load);
+}
+
+/* JSON value of an update to a sensor of @value_type */
+static const char *command_value(uint8_t value_type)
+{
+	switch (value_type) {
+	case KNOT_VALUE_TYPE_FLOAT:
+		return "1.5";
+	case KNOT_VALUE_TYPE_BOOL:
+		return "true";
+	case KNOT_VALUE_TYPE_RAW:
+		return "\"AAECAwQFBgcICQoLDA0ODw==\"";
+	default:
+		return "1";
+	}
+}
+
+static void on_tick(struct l_timeout *timeout, void *user_data)
+{
+	struct load *load = user_data;
+	struct loopback_msg cmd = { .exchange = LOAD_EXCHANGE_DEVICE };
+	char key[64], body[128];
+	struct thing *thing;
+	uint64_t elapsed = l_time_now() - load->run_start;
+	uint64_t due, i;
+	unsigned int n;
+
+	due = elapsed * load->rate / 1000000;
+
+	for (n = 0; n < load->num_things; n++) {
+		thing = &load->things[n];
+		if (thing->state != THING_READY)
+			continue;
+
+		for (i = 0; thing->sent < due && i < LOAD_BURST_MAX; i++)
+			publish_next(thing);
+	}
+
+	/* Commands go to a random thing, alternating update and request */
+	due = elapsed * load->command_rate / 1000000;
+	for (; load->loopback && load->commands_sent < due;
+						load->commands_sent++) {
+		thing = &load->things[random_next() % load->num_things];
+		if (thing->state != THING_READY)
+			continue;
+
+		if (load->commands_sent % 2) {
+			snprintf(key, sizeof(key), "device.%s.data.request",
+				 thing->id);
+			snprintf(body, sizeof(body),
+				 "{\"id\": \"%s\", \"sensorIds\": [1]}",
+				 thing->id);
+		} else {
+			snprintf(key, sizeof(key), "device.%s.data.update",
+				 thing->id);
+			snprintf(body, sizeof(body),
+				 "{\"id\": \"%s\", \"data\": "
+				 "[{\"sensorId\": 1, \"value\": %s}]}",
+				 thing->id, command_value(load->mix[0]));
+		}
+
+		cmd.routing_key = key;
+		cmd.body = body;
+		cmd.len = strlen(body);
+		loopback_inject(load->loopback, &cmd);
+	}
+
+	l_timeout_modify_ms(timeout, LOAD_TICK_MS);
+}
+
+static void on_unregister_timeout(struct l_timeout *timeout,
+				  void *user_data)
+{
+	struct load *load = user_data;
+
+	l_warn("%u things not unregistered", load->unregistering);
+	finish(load);
+}
+
+static void run_end(struct load *load)
+{
+	unsigned int i;
+
+	if (!load->running)
+		return;
+
+	load->running = false;
+	load->run_end = l_time_now();
+	getrusage(RUSAGE_SELF, &load->usage_end);
+	getrusage(RUSAGE_THREAD, &load->thread_end);
+
+	l_timeout_remove(load->tick);
+	load->tick = NULL;
+	l_timeout_remove(load->phase_timeout);
+	load->phase_timeout = NULL;
+
+	if (load->keep) {
+		finish(load);
+		return;
+	}
+
+	for (i = 0; i < load->num_things; i++) {
+		if (load->things[i].state != THING_READY)
+			continue;
+
+		if (knot_cloud_session_unregister_device(load->cloud,
+							 load->things[i].id))
+			continue;
+
+		load->things[i].state = THING_UNREGISTERING;
+		load->unregistering++;
+	}
+
+	if (!load->unregistering) {
+		finish(load);
+		return;
+	}
+
+	load->phase_timeout = l_timeout_create(LOAD_UNREGISTER_TIMEOUT,
+					       on_unregister_timeout, load,
+					       NULL);
+}
+
+static void on_run_timeout(struct l_timeout *timeout, void *user_data)
+{
+	run_end(user_data);
+}
+
+static void run_start(struct load *load)
+{
+	if (load->running || load->run_start)
+		return;
+
+	load->onboard_end = l_time_now();
+	l_timeout_remove(load->phase_timeout);
+	load->phase_timeout = NULL;
+
+	printf("Onboarded %u of %u things in %.2f s, %u failed\n",
+	       load->ready, load->num_things,
+	       (load->onboard_end - load->onboard_start) / 1e6, load->failed);
+	fflush(stdout);
+
+	if (!load->ready) {
+		finish(load);
+		return;
+	}
+
+	load->running = true;
+	load->run_start = l_time_now();
+	getrusage(RUSAGE_SELF, &load->usage_start);
+	getrusage(RUSAGE_THREAD, &load->thread_start);
+
+	load->tick = l_timeout_create_ms(LOAD_TICK_MS, on_tick, load, NULL);
+	load->phase_timeout = l_timeout_create(load->duration,
+					       on_run_timeout, load, NULL);
+}
+
+/* Only available when the library is built with --enable-alloc-stats */
+static void print_allocs(void)
+{
+	struct knot_cloud_alloc_stats stats;
+	const struct knot_cloud_alloc_site *site;
+	unsigned int i;
+
+	if (knot_cloud_get_alloc_stats(&stats))
+		return;
+
+	printf("Allocations (peak live heap %" PRIu64 " KiB)\n",
+	       stats.peak_bytes / 1024);
+	printf("  %-16s %10s %12s %14s %10s %10s\n", "", "messages", "allocs",
+	       "bytes", "allocs/msg", "bytes/msg");
+
+	for (i = 0; i < stats.num_sites; i++) {
+		site = &stats.sites[i];
+		if (!site->allocs && !site->messages)
+			continue;
+
+		printf("  %-16s %10" PRIu64 " %12" PRIu64 " %14" PRIu64,
+		       site->name, site->messages, site->allocs,
+		       site->bytes);
+
+		if (site->messages)
+			printf(" %10.1f %10.0f\n",
+			       (double) site->allocs / site->messages,
+			       (double) site->bytes / site->messages);
+		else
+			printf(" %10s %10s\n", "-", "-");
+	}
+}
+
+static void print_report(struct load *load)
+{
+	struct knot_cloud_stats stats;
+	double seconds = (load->run_end - load->run_start) / 1e6;
+	uint64_t messages = load->published;
+	struct rusage usage;
+
+	knot_cloud_session_get_stats(load->cloud, &stats);
+	getrusage(RUSAGE_SELF, &usage);
+
+	printf("Ran %u things for %.2f s\n", load->ready, seconds);
+	printf("  %-24s %" PRIu64 " (%" PRIu64 " errors)\n", "published",
+	       load->published, load->publish_errors);
+	printf("  %-24s %.1f msgs/s (target %.1f)\n", "throughput",
+	       load->published / seconds, load->ready * load->rate);
+	printf("  %-24s %" PRIu64 " updates, %" PRIu64 " requests, %"
+	       PRIu64 " replies\n", "commands", load->updates,
+	       load->requests, load->replies);
+	printf("  %-24s %.0f process, %.0f main thread\n", "cpu ns/msg",
+	       messages ? cpu_us(&load->usage_start, &load->usage_end) *
+	       1e3 / messages : 0,
+	       messages ? cpu_us(&load->thread_start, &load->thread_end) *
+	       1e3 / messages : 0);
+	printf("  %-24s %ld KiB\n", "max rss", usage.ru_maxrss);
+	printf("  %-24s %.1f\n", "bytes/msg", stats.publish_calls ?
+	       (double) stats.bytes_out / stats.publish_calls : 0);
+	printf("  %-24s %" PRIu64 " (%u disconnections)\n", "reconnects",
+	       stats.reconnects, load->disconnections);
+
+	if (load->use_loopback)
+		printf("  The loopback broker runs in process, it adds to "
+		       "the process CPU time and memory\n");
+
+	printf("Latency (us)\n");
+	printf("  %-16s %10s %10s %10s %10s %10s\n", "", "count", "p50", "p90",
+	       "p99", "max");
+	samples_print("publish", &load->publish);
+	samples_print("register", &load->registration);
+	samples_print("auth", &load->auth);
+	samples_print("schema", &load->schema);
+	samples_print("command lag", &load->lag);
+	print_allocs();
+	fflush(stdout);
+}
+
+static void finish(struct load *load)
+{
+	if (load->finished)
+		return;
+
+	load->finished = true;
+	l_timeout_remove(load->phase_timeout);
+	load->phase_timeout = NULL;
+
+	if (load->run_start)
+		print_report(load);
+
+	l_main_quit();
+}
+
+static void on_connected(void *user_data)
+{
+	struct load *load = user_data;
+	unsigned int i;
+
+	/* Queues and bindings are restored by the SDK on reconnection */
+	if (load->started)
+		return;
+
+	if (knot_cloud_session_read_start(load->cloud, load->session_id,
+					  on_cloud_msg, load)) {
+		fprintf(stderr, "Error starting to read from the cloud\n");
+		l_main_quit();
+		return;
+	}
+
+	for (i = 0; i < load->num_things; i++) {
+		if (knot_cloud_session_device_add(load->cloud,
+						  load->things[i].id)) {
+			fprintf(stderr, "Error adding the things\n");
+			l_main_quit();
+			return;
+		}
+	}
+
+	load->started = true;
+	load->onboard_start = l_time_now();
+	load->phase_timeout = l_timeout_create(load->onboard_timeout,
+					       on_onboard_timeout, load, NULL);
+	onboard_fill(load);
+}
+
+static void on_disconnected(void *user_data)
+{
+	struct load *load = user_data;
+
+	load->disconnections++;
+}
+
+static void on_signal(uint32_t signo, void *user_data)
+{
+	struct load *load = user_data;
+
+	switch (signo) {
+	case SIGINT:
+	case SIGTERM:
+		if (load->running)
+			run_end(load);
+		else
+			l_main_quit();
+		break;
+	}
+}
+
+static void random_hex(char *str, size_t len)
+{
+	static const char hex[] = "0123456789abcdef";
+	size_t i;
+
+	for (i = 0; i < len; i++)
+		str[i] = hex[l_getrandom_uint32() & 0xf];
+
+	str[len] = '\0';
+}
+
+/*
+ * Cloud stand-in, called on the broker thread. Commands are answered right
+ * away: things are always registered and authenticated.
+ */
+static void on_loopback_publish(const struct loopback_msg *msg,
+				void *user_data)
+{
+	struct load *load = user_data;
+	struct loopback_msg reply = { .exchange = LOAD_EXCHANGE_DEVICE };
+	char token[LOAD_TOKEN_LEN + 1];
+	char body[256];
+	json_object *jso, *jid;
+	char *json;
+
+	if (strcmp(msg->exchange, LOAD_EXCHANGE_DEVICE))
+		return;
+
+	json = l_strndup(msg->body, msg->len);
+	jso = json_tokener_parse(json);
+	l_free(json);
+
+	if (!jso)
+		return;
+
+	if (!json_object_object_get_ex(jso, "id", &jid)) {
+		json_object_put(jso);
+		return;
+	}
+
+	if (!strcmp(msg->routing_key, LOAD_CMD_REGISTER)) {
+		random_hex(token, LOAD_TOKEN_LEN);
+		snprintf(body, sizeof(body), "{\"id\": \"%s\", "
+			 "\"token\": \"%s\", \"error\": null}",
+			 json_object_get_string(jid), token);
+		reply.routing_key = LOAD_EVENT_REGISTERED;
+	} else if (!strcmp(msg->routing_key, LOAD_CMD_AUTH) &&
+			msg->reply_to) {
+		snprintf(body, sizeof(body), "{\"id\": \"%s\", "
+			 "\"authenticated\": true, \"error\": null}",
+			 json_object_get_string(jid));
+		/* Replies go through the default exchange */
+		reply.exchange = "";
+		reply.routing_key = msg->reply_to;
+		reply.correlation_id = msg->correlation_id;
+	} else if (!strcmp(msg->routing_key, LOAD_CMD_SCHEMA)) {
+		snprintf(body, sizeof(body),
+			 "{\"id\": \"%s\", \"error\": null}",
+			 json_object_get_string(jid));
+		reply.routing_key = LOAD_EVENT_SCHEMA;
+	} else if (!strcmp(msg->routing_key, LOAD_CMD_UNREGISTER)) {
+		snprintf(body, sizeof(body),
+			 "{\"id\": \"%s\", \"error\": null}",
+			 json_object_get_string(jid));
+		reply.routing_key = LOAD_EVENT_UNREGISTERED;
+	} else {
+		json_object_put(jso);
+		return;
+	}
+
+	json_object_put(jso);
+
+	reply.body = body;
+	reply.len = strlen(body);
+	loopback_inject(load->loopback, &reply);
+}
+
+static int parse_mix(struct load *load, const char *spec)
+{
+	unsigned int weights[L_ARRAY_SIZE(value_types)] = { 0 };
+	unsigned int total = 0, sum, i, j;
+	char **entries, *weight;
+	unsigned long value;
+
+	entries = l_strsplit(spec, ',');
+	if (!entries)
+		return -1;
+
+	for (i = 0; entries[i]; i++) {
+		weight = strchr(entries[i], ':');
+		value = 1;
+		if (weight) {
+			*weight++ = '\0';
+			value = strtoul(weight, NULL, 10);
+		}
+
+		for (j = 0; j < L_ARRAY_SIZE(value_types); j++) {
+			if (!strcmp(entries[i], value_types[j].name))
+				break;
+		}
+
+		if (j == L_ARRAY_SIZE(value_types) || !value || value > 100) {
+			fprintf(stderr, "Invalid value type: %s\n",
+				entries[i]);
+			l_strfreev(entries);
+			return -1;
+		}
+
+		weights[j] += value;
+		total += value;
+	}
+
+	l_strfreev(entries);
+
+	if (!total)
+		return -1;
+
+	/* Sensors get the value types in proportion to their weights */
+	for (i = 0; i < load->num_sensors; i++) {
+		for (j = 0, sum = 0; j < L_ARRAY_SIZE(value_types); j++) {
+			sum += weights[j];
+			if (i % total < sum)
+				break;
+		}
+
+		load->mix[i] = value_types[j].value_type;
+	}
+
+	return 0;
+}
+
+static struct l_queue *schema_new(struct load *load)
+{
+	struct l_queue *list = l_queue_new();
+	knot_msg_schema *schema;
+	unsigned int i;
+
+	for (i = 0; i < load->num_sensors; i++) {
+		schema = l_new(knot_msg_schema, 1);
+		schema->sensor_id = i + 1;
+		schema->values.value_type = load->mix[i];
+		schema->values.unit = 0;
+		schema->values.type_id = LOAD_TYPE_ID;
+		snprintf(schema->values.name, sizeof(schema->values.name),
+			 "Sensor %u", i + 1);
+		l_queue_push_tail(list, schema);
+	}
+
+	return list;
+}
+
+static void things_create(struct load *load)
+{
+	struct thing *thing;
+	char prefix[9];
+	unsigned int i;
+
+	/* Ids are unique to the run, so things are registered anew */
+	random_hex(prefix, 8);
+	snprintf(load->session_id, sizeof(load->session_id), "%sffffffff",
+		 prefix);
+
+	load->things = l_new(struct thing, load->num_things);
+	load->things_by_id = l_hashmap_string_new();
+
+	for (i = 0; i < load->num_things; i++) {
+		thing = &load->things[i];
+		thing->load = load;
+		snprintf(thing->id, sizeof(thing->id), "%s%08x", prefix, i);
+		thing->schema = schema_new(load);
+		l_hashmap_insert(load->things_by_id, thing->id, thing);
+	}
+}
+
+static void things_free(struct load *load)
+{
+	unsigned int i;
+
+	for (i = 0; load->things && i < load->num_things; i++) {
+		l_queue_destroy(load->things[i].schema, l_free);
+		l_free(load->things[i].token);
+	}
+
+	l_hashmap_destroy(load->things_by_id, NULL);
+	l_free(load->things);
+}
+
+static void usage(void)
+{
+	printf("knot-cloud-load - KNoT Cloud SDK load generator\n"
+	       "Usage:\n"
+	       "\tknot-cloud-load [options]\n"
+	       "Options:\n"
+	       "\t-u, --url           Broker url, or a comma separated list\n"
+	       "\t-t, --token         User token\n"
+	       "\t-l, --loopback      Run against a local cloud stand-in\n"
+	       "\t-n, --things        Number of things (default 10)\n"
+	       "\t-s, --sensors       Sensors per thing (default 4)\n"
+	       "\t-m, --mix           Value types with weights, e.g. "
+	       "int:3,float:1,raw:1\n"
+	       "\t-r, --rate          Messages per second per thing "
+	       "(default 1)\n"
+	       "\t-c, --commands      Commands per second to the things, "
+	       "loopback only\n"
+	       "\t-d, --duration      Seconds publishing (default 10)\n"
+	       "\t-T, --timeout       Seconds to onboard the things "
+	       "(default 30)\n"
+	       "\t-w, --workers       Worker threads running the handler\n"
+	       "\t-k, --keep          Don't unregister the things\n"
+	       "\t-h, --help          Show help options\n");
+}
+
+static const struct option main_options[] = {
+	{ "url",	required_argument,	NULL, 'u' },
+	{ "token",	required_argument,	NULL, 't' },
+	{ "loopback",	no_argument,		NULL, 'l' },
+	{ "things",	required_argument,	NULL, 'n' },
+	{ "sensors",	required_argument,	NULL, 's' },
+	{ "mix",	required_argument,	NULL, 'm' },
+	{ "rate",	required_argument,	NULL, 'r' },
+	{ "commands",	required_argument,	NULL, 'c' },
+	{ "duration",	required_argument,	NULL, 'd' },
+	{ "timeout",	required_argument,	NULL, 'T' },
+	{ "workers",	required_argument,	NULL, 'w' },
+	{ "keep",	no_argument,		NULL, 'k' },
+	{ "help",	no_argument,		NULL, 'h' },
+	{ }
+};
+
+static int parse_args(struct load *load, int argc, char *argv[])
+{
+	const char *mix = "int";
+	int opt;
+
+	load->num_things = 10;
+	load->num_sensors = 4;
+	load->rate = 1;
+	load->duration = 10;
+	load->onboard_timeout = 30;
+
+	while ((opt = getopt_long(argc, argv, "u:t:ln:s:m:r:c:d:T:w:kh",
+				  main_options, NULL)) != -1) {
+		switch (opt) {
+		case 'u':
+			load->url = optarg;
+			break;
+		case 't':
+			load->user_token = optarg;
+			break;
+		case 'l':
+			load->use_loopback = true;
+			break;
+		case 'n':
+			load->num_things = strtoul(optarg, NULL, 10);
+			break;
+		case 's':
+			load->num_sensors = strtoul(optarg, NULL, 10);
+			break;
+		case 'm':
+			mix = optarg;
+			break;
+		case 'r':
+			load->rate = strtod(optarg, NULL);
+			break;
+		case 'c':
+			load->command_rate = strtod(optarg, NULL);
+			break;
+		case 'd':
+			load->duration = strtoul(optarg, NULL, 10);
+			break;
+		case 'T':
+			load->onboard_timeout = strtoul(optarg, NULL, 10);
+			break;
+		case 'w':
+			load->num_workers = strtoul(optarg, NULL, 10);
+			break;
+		case 'k':
+			load->keep = true;
+			break;
+		case 'h':
+		default:
+			usage();
+			return -1;
+		}
+	}
+
+	if (!load->use_loopback && (!load->url || !load->user_token)) {
+		fprintf(stderr, "A broker url and user token are required, "
+			"or --loopback\n");
+		return -1;
+	}
+
+	if (!load->num_things || load->num_things > LOAD_THINGS_MAX ||
+			!load->num_sensors ||
+			load->num_sensors > LOAD_SENSORS_MAX ||
+			load->rate <= 0 || load->command_rate < 0 ||
+			!load->duration || !load->onboard_timeout) {
+		fprintf(stderr, "Invalid arguments\n");
+		return -1;
+	}
+
+	if (load->command_rate && !load->use_loopback)
+		fprintf(stderr, "Commands are only sent with --loopback\n");
+
+	return parse_mix(load, mix);
+}
+
+int main(int argc, char *argv[])
+{
+	struct load *load;
+	int err = EXIT_FAILURE;
+
+	load = l_new(struct load, 1);
+
+	if (parse_args(load, argc, argv))
+		goto free_load;
+
+	if (!l_main_init())
+		goto free_load;
+
+	l_log_set_stderr();
+
+	things_create(load);
+
+	if (load->use_loopback) {
+		load->loopback = loopback_new(on_loopback_publish, load);
+		if (!load->loopback)
+			goto done;
+
+		load->url = (char *) loopback_get_url(load->loopback);
+		if (!load->user_token)
+			load->user_token = "load";
+	}
+
+	load->cloud = knot_cloud_session_new();
+
+	if (load->num_workers && (handoff_start(load) ||
+			knot_cloud_session_set_workers(load->cloud,
+						       load->num_workers)))
+		goto done;
+
+	if (knot_cloud_session_start(load->cloud, load->url,
+				     load->user_token, on_connected,
+				     on_disconnected, load)) {
+		fprintf(stderr, "Error connecting to %s\n", load->url);
+		goto done;
+	}
+
+	l_main_run_with_signal(on_signal, load);
+
+	if (load->finished)
+		err = EXIT_SUCCESS;
+
+done:
+	l_timeout_remove(load->tick);
+	l_timeout_remove(load->phase_timeout);
+	knot_cloud_session_free(load->cloud);
+	handoff_stop(load);
+	loopback_free(load->loopback);
+	things_free(load);
+	l_main_exit();
+
+free_load:
+	l_free(load);
+
+	return err;
+}
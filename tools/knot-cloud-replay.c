@@ -0,0 +1,855 @@
+/**
+ * This file is part of the KNOT Project
+ *
+ * Copyright (c) 2019, CESAR. All rights reserved.
+ *
+ *  This library is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU Lesser General Public
+ *  License as published by the Free Software Foundation; either
+ *  version 2.1 of the License, or (at your option) any later version.
+ *
+ *  This library is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Lesser General Public License for more details.
+ */
+
+/**
+ *  Traffic replay
+ *
+ *  Replays a capture recorded with knot_cloud_set_capture() against the
+ *  loopback broker, at the pace it was recorded, faster or as fast as
+ *  possible. Messages received go through the receive path of the SDK as
+ *  if they were consumed from the fog queue. Data published is published
+ *  again through knot_cloud_publish_data(), other messages are published
+ *  as they were recorded, on the connection of the session.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <string.h>
+#include <errno.h>
+#include <getopt.h>
+#include <time.h>
+#include <sys/resource.h>
+#include <ell/ell.h>
+#include <json-c/json.h>
+#include <amqp.h>
+
+#include <knot/knot_protocol.h>
+
+#include "knot_cloud.h"
+#include "arena.h"
+#include "stats.h"
+#include "tls.h"
+#include "mq.h"
+#include "parser.h"
+#include "knot_cloud_internal.h"
+#include "base64.h"
+#include "capture.h"
+#include "loopback.h"
+
+#define REPLAY_USER_TOKEN "replay"
+#define REPLAY_SESSION_ID "replay"
+#define REPLAY_CONNECT_TIMEOUT 5
+#define REPLAY_DRAIN_TIMEOUT_MS 5000
+#define REPLAY_VALUES_MAX 32
+
+/* Records replayed between main loop iterations at full speed */
+#define REPLAY_ITERATE_BATCH 32
+
+struct replay_value {
+	uint8_t sensor_id;
+	uint8_t value_type;
+	knot_value_type value;
+	uint8_t len;
+};
+
+struct replay_event {
+	struct capture_record record;
+	/* Data published through the SDK, set for data.sent messages */
+	char *device_id;
+	struct replay_value *values;
+	unsigned int num_values;
+};
+
+struct replay {
+	const char *path;
+	double speed; // 0 for as fast as possible
+	unsigned int loops;
+	unsigned int num_workers;
+	bool replay_in;
+	bool replay_out;
+	struct replay_event *events;
+	size_t num_events;
+	uint64_t capture_start;
+	char *session_id;
+	struct l_queue *devices;
+	struct loopback *loopback;
+	struct knot_cloud *cloud;
+	bool ready;
+	bool failed;
+	uint64_t received;
+	uint64_t inject_errors;
+	uint64_t data_published;
+	uint64_t raw_published;
+	uint64_t publish_errors;
+	uint64_t behind_max_us;
+	/* Written by the workers */
+	uint64_t handled;
+	/* Written by the broker thread */
+	uint64_t broker_received;
+	uint64_t run_start;
+	uint64_t run_end;
+	struct rusage usage_start;
+	struct rusage usage_end;
+	struct rusage thread_start;
+	struct rusage thread_end;
+};
+
+static uint64_t timeval_us(const struct timeval *tv)
+{
+	return (uint64_t) tv->tv_sec * 1000000 + tv->tv_usec;
+}
+
+static uint64_t cpu_us(const struct rusage *start, const struct rusage *end)
+{
+	return timeval_us(&end->ru_utime) - timeval_us(&start->ru_utime) +
+		timeval_us(&end->ru_stime) - timeval_us(&start->ru_stime);
+}
+
+static bool device_match(const void *data, const void *match_data)
+{
+	return !strcmp(data, match_data);
+}
+
+static void device_found(struct replay *replay, const char *id, size_t len)
+{
+	char *device_id = l_strndup(id, len);
+
+	if (l_queue_find(replay->devices, device_match, device_id)) {
+		l_free(device_id);
+		return;
+	}
+
+	l_queue_push_tail(replay->devices, device_id);
+}
+
+/*
+ * Routes of the messages received depend on the thing id of the session
+ * and on the devices added, both are found from the routing keys.
+ */
+static void scan_routing_key(struct replay *replay, const char *key)
+{
+	const char *prefix = MQ_EVENT_PREFIX_DEVICE ".";
+	size_t len = strlen(prefix);
+	const char *id, *end;
+
+	if (!strncmp(key, MQ_QUEUE_REPLY "-", strlen(MQ_QUEUE_REPLY "-"))) {
+		if (!replay->session_id)
+			replay->session_id = l_strdup(key +
+						strlen(MQ_QUEUE_REPLY "-"));
+		return;
+	}
+
+	if (strncmp(key, prefix, len))
+		return;
+
+	id = key + len;
+	end = strchr(id, '.');
+	if (!end)
+		return;
+
+	if (!strcmp(end + 1, MQ_EVENT_POSTFIX_DATA_UPDATE) ||
+			!strcmp(end + 1, MQ_EVENT_POSTFIX_DATA_REQUEST))
+		device_found(replay, id, end - id);
+}
+
+static bool value_from_json(json_object *jso, struct replay_value *value)
+{
+	const char *str;
+	int len;
+	int64_t val;
+
+	switch (json_object_get_type(jso)) {
+	case json_type_boolean:
+		value->value_type = KNOT_VALUE_TYPE_BOOL;
+		value->value.val_b = json_object_get_boolean(jso);
+		value->len = sizeof(value->value.val_b);
+		break;
+	case json_type_double:
+		value->value_type = KNOT_VALUE_TYPE_FLOAT;
+		value->value.val_f = json_object_get_double(jso);
+		value->len = sizeof(value->value.val_f);
+		break;
+	case json_type_int:
+		val = json_object_get_int64(jso);
+		if (val >= INT32_MIN && val <= INT32_MAX) {
+			value->value_type = KNOT_VALUE_TYPE_INT;
+			value->value.val_i = val;
+			value->len = sizeof(value->value.val_i);
+		} else {
+			value->value_type = KNOT_VALUE_TYPE_INT64;
+			value->value.val_i64 = val;
+			value->len = sizeof(value->value.val_i64);
+		}
+		break;
+	case json_type_string:
+		str = json_object_get_string(jso);
+		len = base64_decode(str, json_object_get_string_len(jso),
+				    value->value.raw, KNOT_DATA_RAW_SIZE);
+		if (len < 0)
+			return false;
+
+		value->value_type = KNOT_VALUE_TYPE_RAW;
+		value->len = len;
+		break;
+	case json_type_null:
+	case json_type_object:
+	case json_type_array:
+	default:
+		return false;
+	}
+
+	return true;
+}
+
+/*
+ * Data messages are decoded once while loading, so the replay only spends
+ * time in the SDK. Values are typed after their JSON type, integers and
+ * floats in the narrowest type holding them.
+ */
+static bool event_parse_data(struct replay_event *event)
+{
+	json_object *jso, *jobj_data, *jobj_entry, *jobj_key;
+	struct replay_value values[REPLAY_VALUES_MAX];
+	const char *id;
+	size_t i, count;
+
+	jso = json_tokener_parse(event->record.body);
+	if (!jso)
+		return false;
+
+	id = parser_get_key_str_from_json_obj(jso, "id");
+	if (!id || !json_object_object_get_ex(jso, "data", &jobj_data) ||
+			json_object_get_type(jobj_data) != json_type_array)
+		goto fail;
+
+	count = json_object_array_length(jobj_data);
+	if (!count || count > REPLAY_VALUES_MAX)
+		goto fail;
+
+	for (i = 0; i < count; i++) {
+		jobj_entry = json_object_array_get_idx(jobj_data, i);
+
+		if (!json_object_object_get_ex(jobj_entry, "sensorId",
+					       &jobj_key))
+			goto fail;
+
+		values[i].sensor_id = json_object_get_int(jobj_key);
+
+		if (!json_object_object_get_ex(jobj_entry, "value",
+					       &jobj_key) ||
+				!value_from_json(jobj_key, &values[i]))
+			goto fail;
+	}
+
+	event->device_id = l_strdup(id);
+	event->values = l_memdup(values, count * sizeof(values[0]));
+	event->num_values = count;
+	json_object_put(jso);
+
+	return true;
+
+fail:
+	json_object_put(jso);
+	return false;
+}
+
+static char *strdup_or_null(const char *str)
+{
+	return str ? l_strdup(str) : NULL;
+}
+
+static int replay_load(struct replay *replay)
+{
+	struct capture_reader *reader;
+	struct capture_record record;
+	struct replay_event *event;
+	size_t allocated = 0;
+	int err;
+
+	reader = capture_reader_new(replay->path);
+	if (!reader)
+		return -1;
+
+	replay->capture_start = capture_reader_get_start(reader);
+	replay->devices = l_queue_new();
+
+	while ((err = capture_reader_next(reader, &record)) == 1) {
+		if (record.direction == CAPTURE_IN)
+			scan_routing_key(replay, record.routing_key);
+
+		if ((record.direction == CAPTURE_IN && !replay->replay_in) ||
+				(record.direction == CAPTURE_OUT &&
+				 !replay->replay_out))
+			continue;
+
+		if (replay->num_events == allocated) {
+			allocated = allocated ? allocated * 2 : 1024;
+			replay->events = l_realloc(replay->events, allocated *
+						   sizeof(*replay->events));
+		}
+
+		event = &replay->events[replay->num_events++];
+		memset(event, 0, sizeof(*event));
+		event->record = record;
+		event->record.exchange = l_strdup(record.exchange);
+		event->record.routing_key = l_strdup(record.routing_key);
+		event->record.correlation_id =
+					strdup_or_null(record.correlation_id);
+		event->record.reply_to = strdup_or_null(record.reply_to);
+		event->record.body = l_memdup(record.body,
+					      record.body_len + 1);
+
+		if (record.direction != CAPTURE_OUT ||
+				strcmp(record.exchange, MQ_EXCHANGE_DATA_SENT))
+			continue;
+
+		if (!event_parse_data(event))
+			fprintf(stderr, "Data not understood, published "
+				"as recorded: %s\n", record.body);
+	}
+
+	capture_reader_free(reader);
+
+	if (err < 0) {
+		fprintf(stderr, "%s is truncated or corrupted\n",
+			replay->path);
+		return -1;
+	}
+
+	if (!replay->num_events) {
+		fprintf(stderr, "Nothing to replay in %s\n", replay->path);
+		return -1;
+	}
+
+	if (!replay->session_id)
+		replay->session_id = l_strdup(REPLAY_SESSION_ID);
+
+	return 0;
+}
+
+static void replay_free_events(struct replay *replay)
+{
+	struct replay_event *event;
+	size_t i;
+
+	for (i = 0; i < replay->num_events; i++) {
+		event = &replay->events[i];
+		l_free((char *) event->record.exchange);
+		l_free((char *) event->record.routing_key);
+		l_free((char *) event->record.correlation_id);
+		l_free((char *) event->record.reply_to);
+		l_free((char *) event->record.body);
+		l_free(event->device_id);
+		l_free(event->values);
+	}
+
+	l_free(replay->events);
+}
+
+/* Called on the broker thread */
+static void on_broker_publish(const struct loopback_msg *msg,
+			      void *user_data)
+{
+	struct replay *replay = user_data;
+
+	__atomic_add_fetch(&replay->broker_received, 1, __ATOMIC_RELAXED);
+}
+
+static bool on_cloud_msg(const struct knot_cloud_msg *msg, void *user_data)
+{
+	struct replay *replay = user_data;
+
+	/* Called by the workers too */
+	__atomic_add_fetch(&replay->handled, 1, __ATOMIC_RELAXED);
+
+	return true;
+}
+
+static void on_connected(void *user_data)
+{
+	struct replay *replay = user_data;
+	const struct l_queue_entry *entry;
+
+	if (replay->ready)
+		return;
+
+	if (knot_cloud_session_read_start(replay->cloud, replay->session_id,
+					  on_cloud_msg, replay)) {
+		replay->failed = true;
+		return;
+	}
+
+	entry = l_queue_get_entries(replay->devices);
+	for (; entry; entry = entry->next) {
+		if (knot_cloud_session_device_add(replay->cloud,
+						  entry->data)) {
+			replay->failed = true;
+			return;
+		}
+	}
+
+	replay->ready = true;
+}
+
+static void on_disconnected(void *user_data)
+{
+	struct replay *replay = user_data;
+
+	replay->failed = true;
+}
+
+static void on_connect_timeout(struct l_timeout *timeout, void *user_data)
+{
+	struct replay *replay = user_data;
+
+	replay->failed = true;
+}
+
+static int replay_connect(struct replay *replay)
+{
+	struct l_timeout *timeout;
+
+	replay->loopback = loopback_new(on_broker_publish, replay);
+	if (!replay->loopback)
+		return -1;
+
+	replay->cloud = knot_cloud_session_new();
+
+	if (replay->num_workers &&
+			knot_cloud_session_set_workers(replay->cloud,
+						       replay->num_workers))
+		return -1;
+
+	if (knot_cloud_session_start(replay->cloud,
+				     loopback_get_url(replay->loopback),
+				     REPLAY_USER_TOKEN, on_connected,
+				     on_disconnected, replay))
+		return -1;
+
+	timeout = l_timeout_create(REPLAY_CONNECT_TIMEOUT, on_connect_timeout,
+				   replay, NULL);
+
+	while (!replay->ready && !replay->failed)
+		l_main_iterate(-1);
+
+	l_timeout_remove(timeout);
+
+	if (replay->failed) {
+		fprintf(stderr, "Error connecting to the loopback broker\n");
+		return -1;
+	}
+
+	return 0;
+}
+
+/* Sleeps on the main loop until @due, serving the connection meanwhile */
+static void wait_until(struct replay *replay, uint64_t due)
+{
+	uint64_t now;
+
+	while ((now = l_time_now()) < due && !replay->failed)
+		l_main_iterate((due - now + 999) / 1000);
+
+	if (now - due > replay->behind_max_us)
+		replay->behind_max_us = now - due;
+}
+
+static void replay_in(struct replay *replay,
+		      const struct capture_record *record)
+{
+	if (mq_inject(cloud_internal_get_mq(replay->cloud),
+		      record->exchange,
+		      record->routing_key, record->correlation_id,
+		      record->body)) {
+		replay->inject_errors++;
+		return;
+	}
+
+	replay->received++;
+}
+
+static void replay_out(struct replay *replay,
+		       const struct replay_event *event)
+{
+	const struct capture_record *record = &event->record;
+	struct knot_cloud *cloud = replay->cloud;
+	struct mq_context *mq = cloud_internal_get_mq(cloud);
+	const struct replay_value *value;
+	amqp_table_entry_t *headers;
+	unsigned int i;
+	int err;
+
+	if (event->device_id) {
+		for (i = 0; i < event->num_values; i++) {
+			value = &event->values[i];
+			if (knot_cloud_session_publish_data(cloud,
+							event->device_id,
+							value->sensor_id,
+							value->value_type,
+							&value->value,
+							value->len))
+				replay->publish_errors++;
+			else
+				replay->data_published++;
+		}
+
+		return;
+	}
+
+	headers = cloud_internal_get_headers(cloud);
+
+	if (record->flags & CAPTURE_FANOUT)
+		err = mq_publish_fanout_message(mq, record->exchange,
+						headers, 1,
+						record->expiration_ms,
+						record->body);
+	else if (record->reply_to)
+		err = mq_publish_direct_message_rpc(mq, record->exchange,
+					record->routing_key, headers,
+					1, record->expiration_ms,
+					amqp_cstring_bytes(record->reply_to),
+					record->correlation_id, record->body);
+	else
+		err = mq_publish_direct_message(mq, record->exchange,
+						record->routing_key,
+						headers, 1,
+						record->expiration_ms,
+						record->body);
+
+	if (err < 0)
+		replay->publish_errors++;
+	else
+		replay->raw_published++;
+}
+
+static void replay_run(struct replay *replay)
+{
+	const struct replay_event *event;
+	uint64_t origin;
+	unsigned int loop;
+	size_t i;
+
+	for (loop = 0; loop < replay->loops && !replay->failed; loop++) {
+		origin = l_time_now();
+
+		for (i = 0; i < replay->num_events && !replay->failed; i++) {
+			event = &replay->events[i];
+
+			if (replay->speed)
+				wait_until(replay, origin +
+					   event->record.time_us /
+					   replay->speed);
+			else if (i % REPLAY_ITERATE_BATCH == 0)
+				l_main_iterate(0);
+
+			if (event->record.direction == CAPTURE_IN)
+				replay_in(replay, &event->record);
+			else
+				replay_out(replay, event);
+		}
+	}
+}
+
+/*
+ * Waits for the messages handed to the workers and for the broker to get
+ * every message published.
+ */
+static void replay_drain(struct replay *replay)
+{
+	uint64_t deadline = l_time_now() + REPLAY_DRAIN_TIMEOUT_MS * 1000;
+	uint64_t published;
+	struct knot_cloud_stats stats;
+
+	while (!replay->failed && l_time_now() < deadline) {
+		knot_cloud_session_get_stats(replay->cloud, &stats);
+		published = stats.publish_calls - stats.publish_errors;
+
+		if (!stats.pending_messages &&
+				__atomic_load_n(&replay->broker_received,
+						__ATOMIC_RELAXED) >= published)
+			return;
+
+		l_main_iterate(10);
+	}
+
+	fprintf(stderr, "Messages still pending at the end\n");
+}
+
+/* Upper bound of the bucket holding the @percent percentile */
+static uint64_t histogram_percentile(const struct knot_cloud_histogram *hist,
+				     unsigned int percent)
+{
+	uint64_t rank = (hist->count * percent + 99) / 100;
+	uint64_t seen = 0, upper;
+	unsigned int i;
+
+	for (i = 0; i < KNOT_CLOUD_HISTOGRAM_BUCKETS; i++) {
+		seen += hist->buckets[i];
+		if (seen >= rank)
+			break;
+	}
+
+	if (i == 0)
+		return 0;
+
+	if (i == KNOT_CLOUD_HISTOGRAM_BUCKETS)
+		return hist->max_us;
+
+	upper = ((uint64_t) 1 << i) - 1;
+
+	return upper < hist->max_us ? upper : hist->max_us;
+}
+
+static void histogram_print(const char *name,
+			    const struct knot_cloud_histogram *hist)
+{
+	if (!hist->count) {
+		printf("  %-16s %10s\n", name, "-");
+		return;
+	}
+
+	printf("  %-16s %10" PRIu64 " %10.1f %10" PRIu64 " %10" PRIu64
+	       " %10" PRIu64 "\n", name, hist->count,
+	       (double) hist->sum_us / hist->count,
+	       histogram_percentile(hist, 50),
+	       histogram_percentile(hist, 99), hist->max_us);
+}
+
+/* Only available when the library is built with --enable-alloc-stats */
+static void print_allocs(void)
+{
+	struct knot_cloud_alloc_stats stats;
+	const struct knot_cloud_alloc_site *site;
+	unsigned int i;
+
+	if (knot_cloud_get_alloc_stats(&stats))
+		return;
+
+	printf("Allocations (peak live heap %" PRIu64 " KiB)\n",
+	       stats.peak_bytes / 1024);
+	printf("  %-16s %10s %12s %14s %10s %10s\n", "", "messages", "allocs",
+	       "bytes", "allocs/msg", "bytes/msg");
+
+	for (i = 0; i < stats.num_sites; i++) {
+		site = &stats.sites[i];
+		if (!site->allocs && !site->messages)
+			continue;
+
+		printf("  %-16s %10" PRIu64 " %12" PRIu64 " %14" PRIu64,
+		       site->name, site->messages, site->allocs,
+		       site->bytes);
+
+		if (site->messages)
+			printf(" %10.1f %10.0f\n",
+			       (double) site->allocs / site->messages,
+			       (double) site->bytes / site->messages);
+		else
+			printf(" %10s %10s\n", "-", "-");
+	}
+}
+
+static void print_report(struct replay *replay)
+{
+	struct knot_cloud_stats stats;
+	double seconds = (replay->run_end - replay->run_start) / 1e6;
+	uint64_t records = replay->received + replay->data_published +
+			   replay->raw_published;
+	time_t captured = replay->capture_start / 1000000;
+	char speed[32];
+
+	knot_cloud_session_get_stats(replay->cloud, &stats);
+
+	if (replay->speed)
+		snprintf(speed, sizeof(speed), "%gx", replay->speed);
+	else
+		snprintf(speed, sizeof(speed), "max");
+
+	printf("Replayed %s, captured %s", replay->path, ctime(&captured));
+	printf("  %-24s %zu records x %u, speed %s, %.2f s\n", "replay",
+	       replay->num_events, replay->loops, speed, seconds);
+	printf("  %-24s %" PRIu64 " (%" PRIu64 " handled, %" PRIu64
+	       " errors)\n", "received", replay->received, replay->handled,
+	       replay->inject_errors);
+	printf("  %-24s %" PRIu64 " data, %" PRIu64 " other (%" PRIu64
+	       " errors)\n", "published", replay->data_published,
+	       replay->raw_published, replay->publish_errors);
+	printf("  %-24s %.1f msgs/s\n", "throughput", records / seconds);
+	printf("  %-24s %.0f process, %.0f main thread\n", "cpu ns/msg",
+	       records ? cpu_us(&replay->usage_start, &replay->usage_end) *
+	       1e3 / records : 0,
+	       records ? cpu_us(&replay->thread_start, &replay->thread_end) *
+	       1e3 / records : 0);
+
+	if (replay->speed)
+		printf("  %-24s %" PRIu64 " us\n", "max behind schedule",
+		       replay->behind_max_us);
+
+	printf("  The loopback broker runs in process, it adds to the "
+	       "process CPU time\n");
+
+	printf("SDK time (us)\n");
+	printf("  %-16s %10s %10s %10s %10s %10s\n", "", "count", "mean",
+	       "p50", "p99", "max");
+	histogram_print("serialize", &stats.serialize);
+	histogram_print("publish", &stats.publish);
+	histogram_print("parse", &stats.parse);
+	histogram_print("callback", &stats.callback);
+	print_allocs();
+	fflush(stdout);
+}
+
+static void usage(void)
+{
+	printf("knot-cloud-replay - KNoT Cloud SDK traffic replay\n"
+	       "Usage:\n"
+	       "\tknot-cloud-replay [options] <capture>\n"
+	       "Options:\n"
+	       "\t-s, --speed         Speed factor, or max (default 1)\n"
+	       "\t-n, --loops         Times the capture is replayed "
+	       "(default 1)\n"
+	       "\t-d, --direction     Messages replayed: in, out or both "
+	       "(default both)\n"
+	       "\t-w, --workers       Worker threads running the handler\n"
+	       "\t-h, --help          Show help options\n");
+}
+
+static const struct option main_options[] = {
+	{ "speed",	required_argument,	NULL, 's' },
+	{ "loops",	required_argument,	NULL, 'n' },
+	{ "direction",	required_argument,	NULL, 'd' },
+	{ "workers",	required_argument,	NULL, 'w' },
+	{ "help",	no_argument,		NULL, 'h' },
+	{ }
+};
+
+static int parse_args(struct replay *replay, int argc, char *argv[])
+{
+	int opt;
+
+	replay->speed = 1;
+	replay->loops = 1;
+	replay->replay_in = true;
+	replay->replay_out = true;
+
+	while ((opt = getopt_long(argc, argv, "s:n:d:w:h", main_options,
+				  NULL)) != -1) {
+		switch (opt) {
+		case 's':
+			if (!strcmp(optarg, "max"))
+				replay->speed = 0;
+			else if ((replay->speed = strtod(optarg, NULL)) <= 0)
+				goto invalid;
+			break;
+		case 'n':
+			replay->loops = strtoul(optarg, NULL, 10);
+			if (!replay->loops)
+				goto invalid;
+			break;
+		case 'd':
+			replay->replay_in = strcmp(optarg, "out");
+			replay->replay_out = strcmp(optarg, "in");
+			if (strcmp(optarg, "in") && strcmp(optarg, "out") &&
+					strcmp(optarg, "both"))
+				goto invalid;
+			break;
+		case 'w':
+			replay->num_workers = strtoul(optarg, NULL, 10);
+			break;
+		case 'h':
+		default:
+			usage();
+			return -1;
+		}
+	}
+
+	if (optind != argc - 1) {
+		usage();
+		return -1;
+	}
+
+	replay->path = argv[optind];
+
+	return 0;
+
+invalid:
+	fprintf(stderr, "Invalid arguments\n");
+	return -1;
+}
+
+int main(int argc, char *argv[])
+{
+	struct replay *replay;
+	int err = EXIT_FAILURE;
+
+	replay = l_new(struct replay, 1);
+
+	if (parse_args(replay, argc, argv))
+		goto free_replay;
+
+	if (!l_main_init())
+		goto free_replay;
+
+	l_log_set_stderr();
+
+	if (replay_load(replay))
+		goto done;
+
+	if (replay_connect(replay))
+		goto done;
+
+	getrusage(RUSAGE_SELF, &replay->usage_start);
+	getrusage(RUSAGE_THREAD, &replay->thread_start);
+	replay->run_start = l_time_now();
+
+	replay_run(replay);
+	replay_drain(replay);
+
+	replay->run_end = l_time_now();
+	getrusage(RUSAGE_SELF, &replay->usage_end);
+	getrusage(RUSAGE_THREAD, &replay->thread_end);
+
+	if (replay->failed) {
+		fprintf(stderr, "Connection to the loopback broker lost\n");
+		goto done;
+	}
+
+	print_report(replay);
+	err = EXIT_SUCCESS;
+
+done:
+	knot_cloud_session_free(replay->cloud);
+	loopback_free(replay->loopback);
+	l_main_exit();
+	replay_free_events(replay);
+	l_queue_destroy(replay->devices, l_free);
+	l_free(replay->session_id);
+
+free_replay:
+	l_free(replay);
+
+	return err;
+}